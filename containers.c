@@ -0,0 +1,450 @@
+/*
+ * containers.c - artist, album, genre and folder views of the files
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+
+#include "containers.h"
+
+/*
+ * ObjectIDs: 0 is the root, 1..max_files are the files (as before), containers are
+ * FIRSTID_CONTAINER_SHARED+serial. list[0] is the root.
+ *
+ * watch.c calls init_containers again when files change. A container with the same parent and
+ * title as one in the old tree keeps its ObjectID, so players can keep browsing it, and its
+ * ContainerUpdateID only moves if its children changed.
+ */
+
+#define UNKNOWN_CONTAINERS	"Unknown"
+
+#define FOLDER_CLASS_CONTAINERS	"object.container.storageFolder"
+#define ARTIST_CLASS_CONTAINERS	"object.container.person.musicArtist"
+#define ALBUM_CLASS_CONTAINERS	"object.container.album.musicAlbum"
+#define GENRE_CLASS_CONTAINERS	"object.container.genre.musicGenre"
+
+struct previous {
+	struct container_shared *list; // the old tree, NULL at startup
+	unsigned int count;
+	unsigned int *table; // hash of the old list, idx+1
+	unsigned int tablemask;
+	unsigned char *isclaimed; // [old idx]
+	unsigned int *matched; // [new idx] => old idx+1, realloc'd with containers.list
+};
+static struct previous *previous_global;
+
+struct sortitem {
+	struct file_shared *file;
+	unsigned int id;
+	char *folder; // only for folders
+};
+
+unsigned int getid_containers(struct shared *shared, unsigned int idx) {
+return shared->containers.list[idx].id;
+}
+
+struct container_shared *find_containers(struct shared *shared, unsigned int id) {
+unsigned int serial,n;
+if (!id) {
+	if (!shared->containers.count) return NULL;
+	return &shared->containers.list[0];
+}
+if (id<FIRSTID_CONTAINER_SHARED) return NULL;
+serial=id-FIRSTID_CONTAINER_SHARED;
+if (serial>=shared->containers.serialcount) return NULL;
+if (!(n=shared->containers.byserial[serial])) return NULL;
+return &shared->containers.list[n-1];
+}
+
+static uint32_t hashkey(unsigned int parentid, char *title) {
+uint32_t h=2166136261u^parentid;
+for (;*title;title++) {
+	h^=(unsigned char)tolower(*title);
+	h*=16777619;
+}
+return h;
+}
+
+static int issamekey(struct container_shared *c, unsigned int parentid, char *title, char *upnpclass) {
+if (c->parentid!=parentid) return 0;
+if (strcmp(c->upnpclass,upnpclass)) return 0;
+if (!strcmp(upnpclass,FOLDER_CLASS_CONTAINERS)) return !strcmp(c->title,title);
+return !strcasecmp(c->title,title);
+}
+
+static int findprevious(unsigned int *idx_out, struct previous *p, unsigned int parentid, char *title, char *upnpclass) {
+// 0 => not found
+unsigned int slot;
+if (!p->count) return 0;
+slot=hashkey(parentid,title)&p->tablemask;
+while (p->table[slot]) {
+	unsigned int idx=p->table[slot]-1;
+	if (!p->isclaimed[idx] && issamekey(p->list+idx,parentid,title,upnpclass)) {
+		p->isclaimed[idx]=1;
+		*idx_out=idx;
+		return 1;
+	}
+	slot=(slot+1)&p->tablemask;
+}
+return 0;
+}
+
+static int setprevious(struct previous *p, struct shared *shared) {
+// takes the current tree as the old one
+unsigned int ui,size=16;
+
+memset(p,0,sizeof(struct previous));
+p->list=shared->containers.list;
+p->count=shared->containers.count;
+shared->containers.list=NULL;
+shared->containers.count=shared->containers.max=0;
+if (!p->count) return 0;
+while (size<p->count*2) size*=2;
+if (!(p->table=calloc(size,sizeof(unsigned int)))) GOTOERROR;
+p->tablemask=size-1;
+if (!(p->isclaimed=calloc(p->count,1))) GOTOERROR;
+for (ui=0;ui<p->count;ui++) {
+	struct container_shared *c=p->list+ui;
+	unsigned int slot;
+	slot=hashkey(c->parentid,c->title)&p->tablemask;
+	while (p->table[slot]) slot=(slot+1)&p->tablemask;
+	p->table[slot]=ui+1;
+}
+return 0;
+error:
+	return -1;
+}
+
+static void freeprevious(struct previous *p) {
+iffree(p->list);
+iffree(p->table);
+iffree(p->isclaimed);
+iffree(p->matched);
+}
+
+static int newserial(unsigned int *id_out, struct shared *shared) {
+if (shared->containers.serialcount==shared->containers.serialmax) {
+	unsigned int max=shared->containers.serialmax*2+64;
+	unsigned int *byserial;
+	if (!(byserial=realloc(shared->containers.byserial,max*sizeof(unsigned int)))) GOTOERROR;
+	shared->containers.byserial=byserial;
+	shared->containers.serialmax=max;
+}
+shared->containers.byserial[shared->containers.serialcount]=0;
+*id_out=FIRSTID_CONTAINER_SHARED+shared->containers.serialcount;
+shared->containers.serialcount+=1;
+return 0;
+error:
+	return -1;
+}
+
+static int addcontainer(unsigned int *idx_out, struct shared *shared, unsigned int parentid, char *title, char *upnpclass,
+		unsigned int childcount) {
+struct previous *p=previous_global;
+struct container_shared *c;
+unsigned int idx,previdx;
+
+if (shared->containers.count==shared->containers.max) {
+	unsigned int max=shared->containers.max*2+16;
+	struct container_shared *list;
+	unsigned int *matched;
+	if (!(list=realloc(shared->containers.list,max*sizeof(struct container_shared)))) GOTOERROR;
+	shared->containers.list=list;
+	if (!(matched=realloc(p->matched,max*sizeof(unsigned int)))) GOTOERROR;
+	p->matched=matched;
+	shared->containers.max=max;
+}
+idx=shared->containers.count;
+c=&shared->containers.list[idx];
+memset(c,0,sizeof(struct container_shared));
+c->parentid=parentid;
+c->title=title;
+c->upnpclass=upnpclass;
+p->matched[idx]=0;
+if (!idx) { // the root
+	c->id=0;
+	if (p->count) p->matched[idx]=1;
+} else if (findprevious(&previdx,p,parentid,title,upnpclass)) {
+	c->id=p->list[previdx].id;
+	p->matched[idx]=previdx+1;
+} else {
+	if (newserial(&c->id,shared)) GOTOERROR;
+}
+c->updateid=shared->updateid;
+if (childcount) {
+	if (!(c->children=ALLOC2_blockmem(shared->derived,unsigned int,childcount))) GOTOERROR;
+	c->childmax=childcount;
+}
+shared->containers.count+=1;
+*idx_out=idx;
+return 0;
+error:
+	return -1;
+}
+
+static int addchild(struct shared *shared, unsigned int idx, unsigned int childid) {
+// children was sized when the container was added
+struct container_shared *c=&shared->containers.list[idx];
+if (c->childcount==c->childmax) {
+	log_shared(shared,0,"%s:%d container \"%s\" has more children than counted\n",__FILE__,__LINE__,c->title);
+	GOTOERROR;
+}
+c->children[c->childcount]=childid;
+c->childcount+=1;
+return 0;
+error:
+	return -1;
+}
+
+static char *getartist(struct file_shared *file) {
+if (!file->meta || !*file->meta->artist) return UNKNOWN_CONTAINERS;
+return file->meta->artist;
+}
+static char *getalbum(struct file_shared *file) {
+if (!file->meta || !*file->meta->album) return UNKNOWN_CONTAINERS;
+return file->meta->album;
+}
+static char *getgenre(struct file_shared *file) {
+if (!file->meta || !*file->meta->genre) return UNKNOWN_CONTAINERS;
+return file->meta->genre;
+}
+static int cmp_track(struct file_shared *a, struct file_shared *b) {
+unsigned int ta=0,tb=0;
+if (a->meta) ta=a->meta->tracknumber;
+if (b->meta) tb=b->meta->tracknumber;
+if (ta!=tb) return (ta<tb)?-1:1;
+return strcmp(a->filename,b->filename);
+}
+
+static int cmp_artist(const void *va, const void *vb) {
+const struct sortitem *a=va,*b=vb;
+int r;
+if ((r=strcasecmp(getartist(a->file),getartist(b->file)))) return r;
+if ((r=strcasecmp(getalbum(a->file),getalbum(b->file)))) return r;
+return cmp_track(a->file,b->file);
+}
+
+static int cmp_genre(const void *va, const void *vb) {
+const struct sortitem *a=va,*b=vb;
+int r;
+if ((r=strcasecmp(getgenre(a->file),getgenre(b->file)))) return r;
+return cmp_artist(va,vb);
+}
+
+static int cmp_folder(const void *va, const void *vb) {
+const struct sortitem *a=va,*b=vb;
+int r;
+if ((r=strcmp(a->folder,b->folder))) return r;
+return strcmp(a->file->filename,b->file->filename);
+}
+
+static int addartists(struct shared *shared, unsigned int rootidx, struct sortitem *items, unsigned int count) {
+// artist -> album -> track
+unsigned int i=0;
+
+qsort(items,count,sizeof(struct sortitem),cmp_artist);
+while (i<count) {
+	unsigned int j,k,albums=0,artistidx;
+	char *artist=getartist(items[i].file);
+	for (j=i;(j<count) && !strcasecmp(artist,getartist(items[j].file));j++) {
+		if ((j==i) || strcasecmp(getalbum(items[j-1].file),getalbum(items[j].file))) albums++;
+	}
+	if (addcontainer(&artistidx,shared,getid_containers(shared,rootidx),artist,ARTIST_CLASS_CONTAINERS,albums)) GOTOERROR;
+	if (addchild(shared,rootidx,getid_containers(shared,artistidx))) GOTOERROR;
+	for (k=i;k<j;) {
+		unsigned int l,albumidx;
+		char *album=getalbum(items[k].file);
+		for (l=k;(l<j) && !strcasecmp(album,getalbum(items[l].file));l++);
+		if (addcontainer(&albumidx,shared,getid_containers(shared,artistidx),album,ALBUM_CLASS_CONTAINERS,l-k)) GOTOERROR;
+		if (addchild(shared,artistidx,getid_containers(shared,albumidx))) GOTOERROR;
+		for (;k<l;k++) if (addchild(shared,albumidx,items[k].id)) GOTOERROR;
+	}
+	i=j;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int addgroups(struct shared *shared, unsigned int rootidx, struct sortitem *items, unsigned int count,
+		char *(*getname)(struct sortitem *), int (*cmp)(const void *,const void *), char *upnpclass, int issensitive) {
+// one level of containers, each holding tracks
+unsigned int i=0;
+
+qsort(items,count,sizeof(struct sortitem),cmp);
+while (i<count) {
+	unsigned int j,groupidx;
+	char *name=getname(items+i);
+	for (j=i;j<count;j++) {
+		if (issensitive) { if (strcmp(name,getname(items+j))) break; }
+		else { if (strcasecmp(name,getname(items+j))) break; }
+	}
+	if (addcontainer(&groupidx,shared,getid_containers(shared,rootidx),name,upnpclass,j-i)) GOTOERROR;
+	if (addchild(shared,rootidx,getid_containers(shared,groupidx))) GOTOERROR;
+	for (;i<j;i++) if (addchild(shared,groupidx,items[i].id)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static char *getartist_sortitem(struct sortitem *s) { return getartist(s->file); }
+static char *getgenre_sortitem(struct sortitem *s) { return getgenre(s->file); }
+static char *getfolder_sortitem(struct sortitem *s) { return s->folder; }
+
+static unsigned int countgroups(struct sortitem *items, unsigned int count, char *(*getname)(struct sortitem *),
+		int (*cmp)(const void *,const void *), int issensitive) {
+unsigned int ui,groups=0;
+qsort(items,count,sizeof(struct sortitem),cmp);
+for (ui=0;ui<count;ui++) {
+	if (!ui) { groups++; continue; }
+	if (issensitive) { if (strcmp(getname(items+ui-1),getname(items+ui))) groups++; }
+	else { if (strcasecmp(getname(items+ui-1),getname(items+ui))) groups++; }
+}
+return groups;
+}
+
+static int setfolders(struct shared *shared, struct sortitem *items, unsigned int count) {
+unsigned int ui;
+for (ui=0;ui<count;ui++) {
+	char *filename=items[ui].file->filename;
+	char *slash;
+	slash=strrchr(filename,'/');
+	if (!slash) items[ui].folder=".";
+	else if (slash==filename) items[ui].folder="/";
+	else if (!(items[ui].folder=strndup_blockmem(shared->derived,filename,slash-filename))) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int ischanged(struct shared *shared, struct previous *p, struct container_shared *c, struct container_shared *old) {
+// => a child was added, removed or changed since the old tree
+unsigned int ui;
+if (c->childcount!=old->childcount) return 1;
+if (memcmp(c->children,old->children,c->childcount*sizeof(unsigned int))) return 1;
+for (ui=0;ui<c->childcount;ui++) {
+	unsigned int id=c->children[ui];
+	if (id<FIRSTID_CONTAINER_SHARED) {
+		if (shared->files[id-1]->updateid==shared->updateid) return 1;
+	} else {
+		struct container_shared *child;
+		unsigned int childidx;
+		if (!(child=find_containers(shared,id))) return 1;
+		childidx=child-shared->containers.list;
+		if (!p->matched[childidx]) return 1;
+		if (child->childcount!=p->list[p->matched[childidx]-1].childcount) return 1;
+	}
+}
+return 0;
+}
+
+static void setupdateids(struct shared *shared, struct previous *p) {
+unsigned int ui;
+for (ui=0;ui<shared->containers.serialcount;ui++) shared->containers.byserial[ui]=0;
+for (ui=1;ui<shared->containers.count;ui++) {
+	shared->containers.byserial[shared->containers.list[ui].id-FIRSTID_CONTAINER_SHARED]=ui+1;
+}
+if (!p->count) return;
+for (ui=0;ui<shared->containers.count;ui++) {
+	struct container_shared *c=&shared->containers.list[ui],*old;
+	if (!p->matched[ui]) continue;
+	old=p->list+p->matched[ui]-1;
+	if (!ischanged(shared,p,c,old)) c->updateid=old->updateid;
+}
+}
+
+int init_containers(struct shared *shared) {
+struct previous previous;
+struct sortitem *items=NULL,*music=NULL;
+unsigned int ui,count=0,musiccount=0;
+unsigned int rootidx,artistsidx,genresidx,foldersidx,allidx;
+
+if (setprevious(&previous,shared)) GOTOERROR;
+previous_global=&previous;
+if (!(items=malloc((shared->max_files+1)*sizeof(struct sortitem)))) GOTOERROR;
+if (!(music=malloc((shared->max_files+1)*sizeof(struct sortitem)))) GOTOERROR;
+for (ui=0;ui<shared->max_files;ui++) { // music first, videos after
+	struct file_shared *file=shared->files[ui];
+	if (file->isremoved) continue;
+	if (!(file->type&MUSICMASK_TYPE_FILE_SHARED)) continue;
+	music[musiccount].file=file;
+	music[musiccount].id=ui+1;
+	music[musiccount].folder=NULL;
+	musiccount++;
+}
+// folders sort all of items, so artists and genres keep their own copy of the music
+memcpy(items,music,musiccount*sizeof(struct sortitem));
+count=musiccount;
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	if (file->isremoved) continue;
+	if (file->type&MUSICMASK_TYPE_FILE_SHARED) continue;
+	items[count].file=file;
+	items[count].id=ui+1;
+	count++;
+}
+if (setfolders(shared,items,count)) GOTOERROR;
+
+if (addcontainer(&rootidx,shared,0,"root",FOLDER_CLASS_CONTAINERS,4)) GOTOERROR;
+if (addcontainer(&artistsidx,shared,0,"Artists",FOLDER_CLASS_CONTAINERS,
+		countgroups(music,musiccount,getartist_sortitem,cmp_artist,0))) GOTOERROR;
+if (addchild(shared,rootidx,getid_containers(shared,artistsidx))) GOTOERROR;
+if (addcontainer(&genresidx,shared,0,"Genres",FOLDER_CLASS_CONTAINERS,
+		countgroups(music,musiccount,getgenre_sortitem,cmp_genre,0))) GOTOERROR;
+if (addchild(shared,rootidx,getid_containers(shared,genresidx))) GOTOERROR;
+if (addcontainer(&foldersidx,shared,0,"Folders",FOLDER_CLASS_CONTAINERS,
+		countgroups(items,count,getfolder_sortitem,cmp_folder,1))) GOTOERROR;
+if (addchild(shared,rootidx,getid_containers(shared,foldersidx))) GOTOERROR;
+if (addcontainer(&allidx,shared,0,"All",FOLDER_CLASS_CONTAINERS,count)) GOTOERROR;
+if (addchild(shared,rootidx,getid_containers(shared,allidx))) GOTOERROR;
+shared->containers.allid=getid_containers(shared,allidx);
+for (ui=0;ui<shared->max_files;ui++) {
+	if (shared->files[ui]->isremoved) continue;
+	if (addchild(shared,allidx,ui+1)) GOTOERROR;
+}
+
+if (addartists(shared,artistsidx,music,musiccount)) GOTOERROR;
+if (addgroups(shared,genresidx,music,musiccount,getgenre_sortitem,cmp_genre,GENRE_CLASS_CONTAINERS,0)) GOTOERROR;
+if (addgroups(shared,foldersidx,items,count,getfolder_sortitem,cmp_folder,FOLDER_CLASS_CONTAINERS,1)) GOTOERROR;
+(void)setupdateids(shared,&previous);
+
+log_shared(shared,1,"%s:%d made %u containers\n",__FILE__,__LINE__,shared->containers.count);
+free(items);
+free(music);
+freeprevious(&previous);
+previous_global=NULL;
+return 0;
+error:
+	iffree(items);
+	iffree(music);
+	freeprevious(&previous);
+	previous_global=NULL;
+	return -1;
+}
@@ -0,0 +1,3 @@
+int init_containers(struct shared *shared);
+struct container_shared *find_containers(struct shared *shared, unsigned int id);
+unsigned int getid_containers(struct shared *shared, unsigned int idx);
@@ -0,0 +1,260 @@
+/*
+ * eventloop.c - serve http and ssdp from one process with epoll
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+#include "ssdp.h"
+#include "httpd.h"
+#include "watch.h"
+
+#include "eventloop.h"
+
+#define MAX_EVENTS_EVENTLOOP	64
+
+void clear_eventloop(struct eventloop *e) {
+static struct eventloop blank={.epollfd=-1};
+*e=blank;
+}
+
+static int addfd(struct eventloop *e, int fd, struct node_eventloop *node) {
+struct epoll_event ev;
+ev.events=EPOLLIN;
+ev.data.ptr=node;
+if (epoll_ctl(e->epollfd,EPOLL_CTL_ADD,fd,&ev)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+int init_eventloop(struct eventloop *e, struct shared *shared) {
+int flags;
+
+if (0>(e->epollfd=epoll_create1(EPOLL_CLOEXEC))) GOTOERROR;
+
+flags=fcntl(shared->tcp_socket,F_GETFL);
+if (flags<0) GOTOERROR;
+if (fcntl(shared->tcp_socket,F_SETFL,flags|O_NONBLOCK)) GOTOERROR;
+e->tcpnode.type=TCP_TYPE_NODE_EVENTLOOP;
+if (addfd(e,shared->tcp_socket,&e->tcpnode)) GOTOERROR;
+
+if (!shared->options.isnodiscovery) {
+	e->udpnode.type=UDP_TYPE_NODE_EVENTLOOP;
+	if (addfd(e,shared->udp_socket,&e->udpnode)) GOTOERROR;
+}
+if (shared->watch.fd>=0) {
+	e->watchnode.type=WATCH_TYPE_NODE_EVENTLOOP;
+	if (addfd(e,shared->watch.fd,&e->watchnode)) GOTOERROR;
+}
+e->lastexpire=time(NULL);
+return 0;
+error:
+	return -1;
+}
+
+void deinit_eventloop(struct eventloop *e) {
+struct node_eventloop *node,*next;
+for (node=e->first_client;node;node=next) {
+	next=node->next;
+	free_client_httpd(node->client);
+	free(node);
+}
+for (node=e->first_recycle;node;node=next) {
+	next=node->next;
+	free_client_httpd(node->client);
+	free(node);
+}
+ifclose(e->epollfd);
+}
+
+void unlisten_eventloop(struct eventloop *e, struct shared *shared) {
+// a stale worker stops accepting, its clients are finished first
+if (shared->tcp_socket<0) return;
+(ignore)epoll_ctl(e->epollfd,EPOLL_CTL_DEL,shared->tcp_socket,NULL);
+close(shared->tcp_socket);
+shared->tcp_socket=-1;
+e->acceptpaused=0;
+}
+
+int isbrowsing_eventloop(struct eventloop *e) {
+// => a client is still copying a browse reply out of shared
+struct node_eventloop *node;
+for (node=e->first_client;node;node=node->next) {
+	if (isbrowsing_client_httpd(node->client)) return 1;
+}
+return 0;
+}
+
+static void removeclient(struct eventloop *e, struct node_eventloop *node) {
+retire_client_httpd(node->client); // closing the fd removes it from epoll
+// the node keeps the client and its replybuffer for the next accept
+if (node->prev) node->prev->next=node->next;
+else e->first_client=node->next;
+if (node->next) node->next->prev=node->prev;
+e->clientcount-=1;
+
+node->prev=NULL;
+node->next=e->first_recycle;
+e->first_recycle=node;
+}
+
+static int pauseaccept(struct eventloop *e, struct shared *shared, int ispause) {
+// the listener stays readable while we're out of fds, so it's left out of epoll for a second
+struct epoll_event ev;
+ev.events=(ispause)?0:EPOLLIN;
+ev.data.ptr=&e->tcpnode;
+if (epoll_ctl(e->epollfd,EPOLL_CTL_MOD,shared->tcp_socket,&ev)) GOTOERROR;
+e->acceptpaused=(ispause)?time(NULL):0;
+return 0;
+error:
+	return -1;
+}
+
+static int acceptclients(struct eventloop *e, struct shared *shared) {
+while (1) {
+	struct node_eventloop *node;
+	struct client_httpd *client;
+	int isagain=0,isfull=0;
+
+	client=accept_client_httpd(&isagain,&isfull,(e->first_recycle)?e->first_recycle->client:NULL,shared);
+	if (!client) {
+		if (isfull) {
+			log_shared(shared,0,"%s:%d out of file descriptors, not accepting for a second\n",__FILE__,__LINE__);
+			if (pauseaccept(e,shared,1)) GOTOERROR;
+		}
+		if (isagain) break;
+		continue; // rejected or failed, try the next one
+	}
+	if (e->first_recycle) {
+		node=e->first_recycle;
+		e->first_recycle=node->next;
+	} else {
+		if (!(node=malloc(sizeof(struct node_eventloop)))) {
+			free_client_httpd(client);
+			GOTOERROR;
+		}
+	}
+	node->type=CLIENT_TYPE_NODE_EVENTLOOP;
+	node->iswriting=0;
+	node->client=client;
+	node->prev=NULL;
+	node->next=e->first_client;
+	if (node->next) node->next->prev=node;
+	e->first_client=node;
+	e->clientcount+=1;
+	if (addfd(e,getfd_client_httpd(client),node)) {
+		removeclient(e,node);
+		GOTOERROR;
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+static int stepclient(struct eventloop *e, struct shared *shared, struct node_eventloop *node) {
+int isdone=0,iswriting;
+
+if (step_client_httpd(&isdone,shared,node->client)) {
+	removeclient(e,node);
+	return 0;
+}
+if (isdone) {
+	removeclient(e,node);
+	return 0;
+}
+iswriting=iswriting_client_httpd(node->client);
+if (iswriting!=node->iswriting) {
+	struct epoll_event ev;
+	ev.events=(iswriting)?EPOLLOUT:EPOLLIN;
+	ev.data.ptr=node;
+	if (epoll_ctl(e->epollfd,EPOLL_CTL_MOD,getfd_client_httpd(node->client),&ev)) GOTOERROR;
+	node->iswriting=iswriting;
+}
+return 0;
+error:
+	return -1;
+}
+
+static void expireclients(struct eventloop *e, time_t now) {
+struct node_eventloop *node,*next;
+for (node=e->first_client;node;node=next) {
+	next=node->next;
+	if (isexpired_client_httpd(node->client,now)) {
+#ifdef DEBUG
+		fprintf(stderr,"%s:%d client timed out\n",__FILE__,__LINE__);
+#endif
+		removeclient(e,node);
+	}
+}
+}
+
+int step_eventloop(struct eventloop *e, struct shared *shared, unsigned int seconds) {
+struct epoll_event events[MAX_EVENTS_EVENTLOOP];
+int i,r,timeout;
+time_t now;
+
+timeout=(e->clientcount||e->acceptpaused)?1000:seconds*1000;
+if (e->sigmask) r=epoll_pwait(e->epollfd,events,MAX_EVENTS_EVENTLOOP,timeout,e->sigmask);
+else r=epoll_wait(e->epollfd,events,MAX_EVENTS_EVENTLOOP,timeout);
+if (r<0) {
+	if (errno!=EINTR) GOTOERROR;
+	r=0;
+}
+for (i=0;i<r;i++) {
+	struct node_eventloop *node;
+	node=events[i].data.ptr;
+	switch (node->type) {
+		case TCP_TYPE_NODE_EVENTLOOP:
+			if (acceptclients(e,shared)) GOTOERROR;
+			break;
+		case UDP_TYPE_NODE_EVENTLOOP:
+			if (checkclient_ssdp(shared)) GOTOERROR;
+			break;
+		case CLIENT_TYPE_NODE_EVENTLOOP:
+			if (stepclient(e,shared,node)) GOTOERROR;
+			break;
+		case WATCH_TYPE_NODE_EVENTLOOP:
+			if (read_watch(shared)) GOTOERROR;
+			break;
+	}
+}
+
+now=time(NULL);
+if (e->acceptpaused && (now!=e->acceptpaused)) {
+	if (pauseaccept(e,shared,0)) GOTOERROR;
+}
+if (now!=e->lastexpire) {
+	e->lastexpire=now;
+	(void)expireclients(e,now);
+}
+return 0;
+error:
+	return -1;
+}
@@ -0,0 +1,28 @@
+struct node_eventloop {
+#define TCP_TYPE_NODE_EVENTLOOP	1
+#define UDP_TYPE_NODE_EVENTLOOP	2
+#define CLIENT_TYPE_NODE_EVENTLOOP	3
+#define WATCH_TYPE_NODE_EVENTLOOP	4
+	int type;
+	int iswriting;
+	struct client_httpd *client;
+	struct node_eventloop *prev,*next;
+};
+
+struct eventloop {
+	int epollfd;
+	struct node_eventloop tcpnode,udpnode,watchnode;
+	struct node_eventloop *first_client;
+	struct node_eventloop *first_recycle; // each keeps its retired client, replybuffer and all
+	unsigned int clientcount;
+	time_t lastexpire;
+	time_t acceptpaused; // 0 => listening, otherwise when we ran out of fds
+	sigset_t *sigmask; // for epoll_pwait, NULL => epoll_wait
+};
+H_CLEARFUNC(eventloop);
+
+int init_eventloop(struct eventloop *e, struct shared *shared);
+void deinit_eventloop(struct eventloop *e);
+void unlisten_eventloop(struct eventloop *e, struct shared *shared);
+int isbrowsing_eventloop(struct eventloop *e);
+int step_eventloop(struct eventloop *e, struct shared *shared, unsigned int seconds);
@@ -28,12 +28,28 @@
 #include "common/conventions.h"
 #include "common/blockmem.h"
 #include "shared.h"
+#include "flacheader.h"
+#include "mp3header.h"
+#include "wavheader.h"
+#include "metaindex.h"
 
 #include "files.h"
 
+int gettype_files(char *filename, unsigned int len) {
+// 0 => not a type we serve
+char *last4;
+if (len<4) return 0;
+last4=filename+len-4;
+if (!strncasecmp("flac",last4,4)) return FLAC_TYPE_FILE_SHARED;
+if (!strncasecmp(".wav",last4,4)) return WAV_TYPE_FILE_SHARED;
+if (!strncasecmp(".mp3",last4,4)) return MP3_TYPE_FILE_SHARED;
+if (!strncasecmp(".mp4",last4,4)) return VIDEO_TYPE_FILE_SHARED;
+return 0;
+}
+
 static int checkfile(struct shared *shared, struct file_shared *file) {
 struct stat statbuf;
-char *filename,*last4;
+char *filename;
 int len;
 
 filename=file->filename;
@@ -42,17 +58,7 @@ if (len<4) {
 	log_shared(shared,0,"error: filename is too short to identify: \"%s\"\n",__FILE__,__LINE__,filename);
 	GOTOERROR;
 }
-last4=filename+len-4;
-
-if (!strncasecmp("flac",last4,4)) {
-	file->type=FLAC_TYPE_FILE_SHARED;
-} else if (!strncasecmp(".wav",last4,4)) {
-	file->type=WAV_TYPE_FILE_SHARED;
-} else if (!strncasecmp(".mp3",last4,4)) {
-	file->type=MP3_TYPE_FILE_SHARED;
-} else if (!strncasecmp(".mp4",last4,4)) {
-	file->type=VIDEO_TYPE_FILE_SHARED;
-} else {
+if (!(file->type=gettype_files(filename,len))) {
 	log_shared(shared,0,"error: couldn't determine file type: \"%s\"\n",__FILE__,__LINE__,filename);
 	GOTOERROR;
 }
@@ -61,6 +67,121 @@ if (stat(filename,&statbuf)) {
 	GOTOERROR;
 }
 file->size=statbuf.st_size;
+file->mtime=(uint64_t)statbuf.st_mtim.tv_sec*1000000000+statbuf.st_mtim.tv_nsec;
+return 0;
+error:
+	return -1;
+}
+
+static int setmp3(struct shared *shared, struct meta_file_shared *meta, struct file_shared *file) {
+struct mp3header mp3header;
+
+if (read_mp3header(&mp3header,file->filename)) {
+	log_shared(shared,1,"%s:%d error reading mp3header for \"%s\"\n",__FILE__,__LINE__,file->filename);
+	return 0;
+}
+if (!(meta->title=strdup_blockmem(&shared->blockmem,mp3header.title))) GOTOERROR;
+if (!(meta->artist=strdup_blockmem(&shared->blockmem,mp3header.artist))) GOTOERROR;
+if (!(meta->album=strdup_blockmem(&shared->blockmem,mp3header.album))) GOTOERROR;
+if (!(meta->date=strdup_blockmem(&shared->blockmem,mp3header.date))) GOTOERROR;
+if (!(meta->genre=strdup_blockmem(&shared->blockmem,mp3header.genre))) GOTOERROR;
+meta->tracknumber=mp3header.tracknumber;
+meta->duration=mp3header.duration;
+meta->bitrate=mp3header.bitrate;
+file->meta=meta;
+return 0;
+error:
+	return -1;
+}
+
+static int setwav(struct shared *shared, struct meta_file_shared *meta, struct file_shared *file) {
+struct wavheader wavheader;
+
+if (read_wavheader(&wavheader,file->filename)) {
+	log_shared(shared,1,"%s:%d error reading wavheader for \"%s\"\n",__FILE__,__LINE__,file->filename);
+	return 0;
+}
+if (!(meta->title=strdup_blockmem(&shared->blockmem,wavheader.title))) GOTOERROR;
+if (!(meta->artist=strdup_blockmem(&shared->blockmem,wavheader.artist))) GOTOERROR;
+if (!(meta->album=strdup_blockmem(&shared->blockmem,wavheader.album))) GOTOERROR;
+if (!(meta->date=strdup_blockmem(&shared->blockmem,wavheader.date))) GOTOERROR;
+if (!(meta->genre=strdup_blockmem(&shared->blockmem,wavheader.genre))) GOTOERROR;
+meta->tracknumber=wavheader.tracknumber;
+meta->duration=wavheader.duration;
+meta->bitrate=wavheader.bitrate;
+meta->samples=wavheader.frames;
+meta->samplerate=wavheader.samplerate;
+meta->channels=wavheader.channels;
+meta->bitspersample=wavheader.bitspersample;
+meta->audiooffset=wavheader.dataoffset;
+file->meta=meta;
+return 0;
+error:
+	return -1;
+}
+
+static int setflac(struct shared *shared, struct meta_file_shared *meta, struct file_shared *file) {
+struct flacheader flacheader;
+
+if (read_flacheader(&flacheader,file->filename)) {
+	log_shared(shared,1,"%s:%d error reading flacheader for \"%s\"\n",__FILE__,__LINE__,file->filename);
+	return 0;
+}
+if (!(meta->title=strdup_blockmem(&shared->blockmem,flacheader.title))) GOTOERROR;
+if (!(meta->artist=strdup_blockmem(&shared->blockmem,flacheader.artist))) GOTOERROR;
+if (!(meta->album=strdup_blockmem(&shared->blockmem,flacheader.album))) GOTOERROR;
+if (!(meta->date=strdup_blockmem(&shared->blockmem,flacheader.date))) GOTOERROR;
+if (!(meta->genre=strdup_blockmem(&shared->blockmem,flacheader.genre))) GOTOERROR;
+meta->tracknumber=flacheader.tracknumber;
+meta->duration=flacheader.duration;
+if (meta->duration) meta->bitrate=8*(unsigned int)(file->size/(uint64_t)meta->duration);
+meta->samples=((uint64_t)flacheader.high_samplecount<<32)|flacheader.low_samplecount;
+if (meta->samples) meta->samplerate=flacheader.samplerate; // an unknown length can't be searched
+meta->blocksize=flacheader.blocksize;
+meta->audiooffset=flacheader.audiooffset;
+if (flacheader.seekpoints) {
+	if (!(meta->seekpoints=ALLOC2_blockmem(&shared->blockmem,struct seekpoint_flacheader,flacheader.seekcount))) GOTOERROR;
+	memcpy(meta->seekpoints,flacheader.seekpoints,flacheader.seekcount*sizeof(struct seekpoint_flacheader));
+	meta->seekcount=flacheader.seekcount;
+}
+meta->artoffset=flacheader.artoffset;
+meta->artsize=flacheader.artsize;
+meta->arttype=flacheader.arttype;
+meta->artwidth=flacheader.artwidth;
+meta->artheight=flacheader.artheight;
+file->meta=meta;
+deinit_flacheader(&flacheader);
+return 0;
+error:
+	deinit_flacheader(&flacheader);
+	return -1;
+}
+
+static int hasmeta(struct shared *shared, struct file_shared *file) {
+// mergefiles treats everything as flac
+if (shared->options.ismergefiles) return 1;
+return (file->type==FLAC_TYPE_FILE_SHARED)||(file->type==MP3_TYPE_FILE_SHARED)||(file->type==WAV_TYPE_FILE_SHARED);
+}
+
+static int setmeta(struct shared *shared, struct meta_file_shared *meta, struct file_shared *file) {
+file->isparsed=1;
+if (!shared->options.ismergefiles) switch (file->type) {
+	case MP3_TYPE_FILE_SHARED: return setmp3(shared,meta,file);
+	case WAV_TYPE_FILE_SHARED: return setwav(shared,meta,file);
+}
+return setflac(shared,meta,file);
+}
+
+int refresh_files(struct shared *shared, struct file_shared *file) {
+// rereads the header of a file that changed on disk, the old meta stays in blockmem
+struct meta_file_shared *meta;
+
+file->meta=NULL;
+file->isparsed=0;
+file->didl=NULL;
+if (!hasmeta(shared,file)) return 0;
+if (!(meta=CALLOC_blockmem(&shared->blockmem,struct meta_file_shared))) GOTOERROR;
+if (setmeta(shared,meta,file)) GOTOERROR;
 return 0;
 error:
 	return -1;
@@ -69,9 +190,35 @@ error:
 int init_files(struct shared *shared) {
 struct file_shared **files=shared->files;
 unsigned int ui,max=shared->max_files;
+unsigned int changed=0;
 
+if (shared->options.indexfile) {
+	if (load_metaindex(shared)) GOTOERROR;
+	if (!shared->index.map) changed=1;
+}
+if (!(shared->catalog=CALLOC2_blockmem(&shared->blockmem,struct meta_file_shared,max))) GOTOERROR;
 for (ui=0;ui<max;ui++) {
-	if (checkfile(shared,files[ui])) GOTOERROR;
+	struct file_shared *file=files[ui];
+	if (!file->type) { // scan.c already has type, size and mtime
+		if (checkfile(shared,file)) GOTOERROR;
+	}
+	if (hasmeta(shared,file)) {
+		int isfound=0;
+		if (shared->index.map) {
+			if (lookup_metaindex(&isfound,shared,file,&shared->catalog[ui])) GOTOERROR;
+		}
+		if (!isfound) {
+			if (setmeta(shared,&shared->catalog[ui],file)) GOTOERROR;
+			changed+=1;
+		}
+	}
+}
+shared->live.count=max;
+shared->watch.filesmax=max;
+if (changed && shared->options.indexfile) {
+	if (save_metaindex(shared)) {
+		log_shared(shared,0,"%s:%d warning: couldn't save index \"%s\"\n",__FILE__,__LINE__,shared->options.indexfile);
+	}
 }
 return 0;
 error:
@@ -1,2 +1,4 @@
 
+int gettype_files(char *filename, unsigned int len);
 int init_files(struct shared *shared);
+int refresh_files(struct shared *shared, struct file_shared *file);
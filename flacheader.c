@@ -42,43 +42,190 @@ static unsigned int charstouintr(unsigned char *c) {
 return (c[3]<<24)|(c[2]<<16)|(c[1]<<8)|c[0];
 }
 
-#define SIZE_SIMPLEBUFFER	(1024*2)
+/*
+ * The metadata chain is walked with pread() through a small window. Blocks we don't use (PADDING,
+ * APPLICATION, ...) are skipped by offset without being read. For a PICTURE, only the fields before
+ * the image are read, so a file with embedded art usually costs one read. A VORBIS_COMMENT bigger
+ * than the window is read on its own.
+ */
+
+#define SIZE_WINDOW	(1024*4)
+#define STREAMINFO_BLOCKTYPE_FLACHEADER	0
+#define SEEKTABLE_BLOCKTYPE_FLACHEADER	3
+#define VORBISCOMMENT_BLOCKTYPE_FLACHEADER	4
+#define PICTURE_BLOCKTYPE_FLACHEADER	6
+#define FRONTCOVER_PICTURE_FLACHEADER	3
+#define MAX_MIME_FLACHEADER	64
+#define SIZE_SEEKPOINT_FLACHEADER	18
 
-struct simplebuffer {
-	unsigned int pos;
-	unsigned char buffer[SIZE_SIMPLEBUFFER];
+struct window {
+	int fd;
+	uint64_t offset; // of buffer[0] in the file
+	unsigned int len; // valid bytes in buffer
+	unsigned char buffer[SIZE_WINDOW];
 };
 
-static void reset_simplebuffer(struct simplebuffer *sb) {
-sb->pos=0;
+static int preadall(int fd, unsigned char *dest, unsigned int len, uint64_t offset, unsigned int *got_out) {
+// *got_out is short only at the end of the file
+unsigned int got=0;
+while (got<len) {
+	ssize_t k;
+	k=pread(fd,dest+got,len-got,offset+got);
+	if (k<0) GOTOERROR;
+	if (!k) break;
+	got+=k;
+}
+*got_out=got;
+return 0;
+error:
+	return -1;
 }
 
-static int load_simplebuffer(struct simplebuffer *sb, char *filename) {
-int fd=-1;
-fd=open(filename,O_RDONLY);
-if (fd<0) GOTOERROR;
-if (read(fd,sb->buffer,SIZE_SIMPLEBUFFER)!=SIZE_SIMPLEBUFFER) GOTOERROR;
-close(fd);
+static int get_window(unsigned char **data_out, struct window *w, uint64_t offset, unsigned int len) {
+// len<=SIZE_WINDOW, -1 if the file is shorter
+if ((offset<w->offset) || (offset+len>w->offset+w->len)) {
+	if (preadall(w->fd,w->buffer,SIZE_WINDOW,offset,&w->len)) GOTOERROR;
+	w->offset=offset;
+	if (len>w->len) GOTOERROR;
+}
+*data_out=w->buffer+(offset-w->offset);
 return 0;
 error:
-	if (fd>=0) close(fd);
 	return -1;
 }
 
-static int read_simplebuffer(struct simplebuffer *sb, unsigned char *dest, unsigned int len) {
-if (sb->pos+len>=SIZE_SIMPLEBUFFER) {
-#ifdef DEBUG
-	fprintf(stderr,"%s:%d attempted to seek past buffer: %u + %u\n",__FILE__,__LINE__,sb->pos,len);
-#endif
+static int getblock(unsigned char **data_out, unsigned char **big_inout, struct window *w, uint64_t offset, unsigned int len) {
+// a block bigger than the window is read into *big_inout, which the caller frees
+unsigned int got;
+if (len<=SIZE_WINDOW) return get_window(data_out,w,offset,len);
+if (!(*big_inout=malloc(len))) GOTOERROR;
+if (preadall(w->fd,*big_inout,len,offset,&got)) GOTOERROR;
+if (got!=len) GOTOERROR;
+*data_out=*big_inout;
+return 0;
+error:
 	return -1;
 }
-memcpy(dest,sb->buffer+sb->pos,len);
-sb->pos+=len;
+
+static int parseseektable(struct flacheader *dest, unsigned char *data, unsigned int len) {
+// placeholders are dropped, offsets are made absolute once we know where the frames start
+struct seekpoint_flacheader *points;
+unsigned int ui,count=0;
+
+len/=SIZE_SEEKPOINT_FLACHEADER;
+if (!len || dest->seekpoints) return 0; // there should only be one
+if (!(points=malloc(len*sizeof(struct seekpoint_flacheader)))) GOTOERROR;
+for (ui=0;ui<len;ui++,data+=SIZE_SEEKPOINT_FLACHEADER) {
+	uint64_t sample,offset;
+	sample=((uint64_t)charstouint2(data)<<32)|charstouint2(data+4);
+	offset=((uint64_t)charstouint2(data+8)<<32)|charstouint2(data+12);
+	if (sample==~(uint64_t)0) continue;
+	if (count && (sample<=points[count-1].sample)) continue; // they have to be ascending
+	points[count].sample=sample;
+	points[count].offset=offset;
+	count+=1;
+}
+if (!count) {
+	free(points);
+	return 0;
+}
+dest->seekpoints=points;
+dest->seekcount=count;
 return 0;
+error:
+	return -1;
+}
+
+static int parsepicture(struct flacheader *dest, int *isfront_inout, struct window *w, uint64_t offset, unsigned int len) {
+// records where the image is, the front cover wins over the others, then the first one
+uint64_t end=offset+len;
+unsigned int type,ui,arttype,width,height;
+unsigned char *data;
+
+if (*isfront_inout) return 0;
+if (len<32) goto error;
+if (get_window(&data,w,offset,8)) goto error;
+type=charstouint2(data);
+ui=charstouint2(data+4); // mime type
+if (ui>MAX_MIME_FLACHEADER) goto error;
+offset+=8;
+if (ui+4>end-offset) goto error;
+if (get_window(&data,w,offset,ui+4)) goto error;
+if (((ui==10) && !strncasecmp((char *)data,"image/jpeg",10)) || ((ui==9) && !strncasecmp((char *)data,"image/jpg",9))) {
+	arttype=JPEG_ARTTYPE_FLACHEADER;
+} else if ((ui==9) && !strncasecmp((char *)data,"image/png",9)) {
+	arttype=PNG_ARTTYPE_FLACHEADER;
+} else {
+	return 0; // players want one of these, and "-->" is a link
+}
+offset+=ui;
+ui=charstouint2(data+ui); // description
+offset+=4;
+if ((uint64_t)ui+20>end-offset) goto error;
+offset+=ui;
+if (get_window(&data,w,offset,20)) goto error;
+width=charstouint2(data);
+height=charstouint2(data+4);
+ui=charstouint2(data+16); // skipping depth and colors
+offset+=20;
+if (!ui || (ui>end-offset)) goto error;
+if (dest->artsize && (type!=FRONTCOVER_PICTURE_FLACHEADER)) return 0;
+dest->artoffset=offset;
+dest->artsize=ui;
+dest->arttype=arttype;
+dest->artwidth=width;
+dest->artheight=height;
+if (type==FRONTCOVER_PICTURE_FLACHEADER) *isfront_inout=1;
+return 0;
+error:
+	return -1;
+}
+
+static void copytag(char *dest, unsigned char *src, unsigned int len) {
+if (len>MAXSTR_FLACHEADER) len=MAXSTR_FLACHEADER;
+memcpy(dest,src,len);
+dest[len]='\0';
 }
 
-static void seek_simplebuffer(struct simplebuffer *sb, unsigned int len) {
-sb->pos+=len;
+static int parsecomments(struct flacheader *dest, unsigned char *data, unsigned int len) {
+// data is a VORBIS_COMMENT block, the lengths in it are checked against len
+unsigned char *end=data+len;
+unsigned int ui,comments;
+
+if (len<8) GOTOERROR;
+ui=charstouintr(data); // vendor string
+if (ui>len-8) GOTOERROR;
+data+=4+ui;
+comments=charstouintr(data);
+data+=4;
+while (comments) {
+	char *tag;
+	if (end-data<4) GOTOERROR;
+	ui=charstouintr(data);
+	data+=4;
+	if (ui>(unsigned int)(end-data)) GOTOERROR;
+	tag=(char *)data;
+	if ((ui>12) && !strncasecmp(tag,"TRACKNUMBER=",12)) {
+		char number[16];
+		copytag(number,data+12,(ui-12<15)?ui-12:15);
+		dest->tracknumber=slowtou(number);
+	} else if ((ui>7) && !strncasecmp(tag,"ARTIST=",7)) {
+		copytag(dest->artist,data+7,ui-7);
+	} else if ((ui>6) && !strncasecmp(tag,"ALBUM=",6)) {
+		copytag(dest->album,data+6,ui-6);
+	} else if ((ui>6) && !strncasecmp(tag,"TITLE=",6)) {
+		copytag(dest->title,data+6,ui-6);
+	} else if ((ui>5) && !strncasecmp(tag,"DATE=",5)) {
+		copytag(dest->date,data+5,ui-5);
+	} else if ((ui>6) && !strncasecmp(tag,"GENRE=",6)) {
+		copytag(dest->genre,data+6,ui-6);
+	}
+	data+=ui;
+	comments--;
+}
+return 0;
+error:
+	return -1;
 }
 
 static void reset_flacheader(struct flacheader *p) {
@@ -86,125 +233,89 @@ p->title[0]='\0';
 p->artist[0]='\0';
 p->album[0]='\0';
 p->date[0]='\0';
+p->genre[0]='\0';
 p->duration=0;
 p->tracknumber=0;
+p->samplerate=0;
+p->blocksize=0;
+p->audiooffset=0;
+p->seekpoints=NULL;
+p->seekcount=0;
+p->artoffset=0;
+p->artsize=0;
+p->arttype=NONE_ARTTYPE_FLACHEADER;
 }
 
-static int readheaderfromfile(struct flacheader *dest, char *filename) {
-unsigned char buff4[4];
-struct simplebuffer simplebuffer;
+void deinit_flacheader(struct flacheader *p) {
+iffree(p->seekpoints);
+}
 
-reset_simplebuffer(&simplebuffer);
+static int readheaderfromfile(struct flacheader *dest, char *filename) {
+struct window window;
+unsigned char *big=NULL;
+unsigned char *data;
+uint64_t offset;
+int isfront=0;
 
-if (load_simplebuffer(&simplebuffer,filename)) GOTOERROR;
-if (read_simplebuffer(&simplebuffer,buff4,4)) goto error;
-if (memcmp(buff4,"fLaC",4)) goto error;
+window.offset=window.len=0;
+window.fd=open(filename,O_RDONLY|O_CLOEXEC);
+if (window.fd<0) GOTOERROR;
+if (get_window(&data,&window,0,4)) goto error;
+if (memcmp(data,"fLaC",4)) goto error;
+offset=4;
 
 #if 0
-	fprintf(stderr,"Checking flac: %s\n",dest->filename);
+	fprintf(stderr,"Checking flac: %s\n",filename);
 #endif
 
 while (1) {
 	int islast=0;
 	unsigned int len;
 	unsigned char blocktype;
-	unsigned char buff[512+1];
-	if (read_simplebuffer(&simplebuffer,buff4,4)) goto error;
-	islast=buff4[0]&128;
-	len=charstouint(0,buff4[1],buff4[2],buff4[3]);
-	blocktype=buff4[0]&0x7f;
+	if (get_window(&data,&window,offset,4)) goto error;
+	islast=data[0]&128;
+	len=charstouint(0,data[1],data[2],data[3]);
+	blocktype=data[0]&0x7f;
+	offset+=4;
 #if 0
 	fprintf(stderr,"blocktype: %u, length: %u\n", blocktype,len);
 #endif
 
-	if ((blocktype==0)&&(len==34)) {
-		unsigned char *temp=(unsigned char *)buff;
+	if ((blocktype==STREAMINFO_BLOCKTYPE_FLACHEADER)&&(len==34)) {
 		unsigned int ui;
-		if (read_simplebuffer(&simplebuffer,temp,34)) goto error;
-		ui=charstouint2(temp+10);
+		if (get_window(&data,&window,offset,34)) goto error;
+		ui=charstouint(0,0,data[0],data[1]);
+		if (ui==charstouint(0,0,data[2],data[3])) dest->blocksize=ui; // min==max => fixed
+		ui=charstouint2(data+10);
 		ui=ui>>12;
 		dest->samplerate=ui;
-		ui=charstouint2(temp+10);
+		ui=charstouint2(data+10);
 		ui=ui&15;
 		dest->high_samplecount=ui;
-		ui=charstouint2(temp+14);
+		ui=charstouint2(data+14);
 		dest->low_samplecount=ui;
-	} else if ((blocktype==4)&&(len<512)) {
-		unsigned int ui;
-		unsigned char *temp=buff;
-		unsigned int comments;
-		if (read_simplebuffer(&simplebuffer,buff,len)) goto error;
-		buff[len]='\0';
-
-		ui=charstouintr(temp);
-#if 0
-		{
-			char *temp2=temp+4;
-			fprintf(stderr,"Title %u bytes: ",ui);
-			for (;ui;ui--) { fputc(isprint(temp2[0])?temp2[0]:'?',stderr); temp2++; }
-			fputc('\n',stderr);
-		}
-#endif
-		temp+=4+ui;
-		comments=charstouintr(temp);
-		temp+=4;
-		while (comments) {
-			char pre0;
-			char *tag;
-			ui=charstouintr(temp);
-			temp+=4;
-			pre0=temp[ui];
-			temp[ui]='\0';
-			tag=(char *)temp;
-			if (!strncasecmp(tag,"TRACKNUMBER=",12)) {
-				dest->tracknumber=slowtou(tag+12);
-			} else if (!strncasecmp(tag,"ARTIST=",7)) {
-				strncpy(dest->artist,tag+7,MAXSTR_FLACHEADER);
-				dest->artist[MAXSTR_FLACHEADER]='\0';
-			} else if (!strncasecmp(tag,"ALBUM=",6)) {
-				strncpy(dest->album,tag+6,MAXSTR_FLACHEADER);
-				dest->album[MAXSTR_FLACHEADER]='\0';
-			} else if (!strncasecmp(tag,"TITLE=",6)) {
-				strncpy(dest->title,tag+6,MAXSTR_FLACHEADER);
-				dest->title[MAXSTR_FLACHEADER]='\0';
-			} else if (!strncasecmp(tag,"DATE=",5)) {
-				strncpy(dest->date,tag+5,MAXSTR_FLACHEADER);
-				dest->date[MAXSTR_FLACHEADER]='\0';
-			}
-			temp[ui]=pre0;
-#if 0
-			fprintf(stderr,"\tEntry %u bytes: ",ui);
-			for (;ui;ui--) { fputc(isprint(temp[0])?temp[0]:'?',stderr); temp++; }
-			fputc('\n',stderr);
-#else
-			temp+=ui;
-#endif
-
-			comments--;
-		}
-#if 1
-// assume there is only one comment section
-		break;
-#endif
-		
-#if 0
-		{
-			int i;
-			fprintf(stderr,"Comment: ");
-			for (i=0;i<len;i++) {
-				if (!(i%16)) fputc('\n',stderr);
-				fprintf(stderr,"%c",
-					isprint(buff[i])?buff[i]:'?');
-			}
-			fputc('\n',stderr);
-		}
-#endif
-	} else {
-		(void)seek_simplebuffer(&simplebuffer,len);
+	} else if (blocktype==SEEKTABLE_BLOCKTYPE_FLACHEADER) {
+		if (getblock(&data,&big,&window,offset,len)) goto error;
+		if (parseseektable(dest,data,len)) GOTOERROR;
+	} else if (blocktype==VORBISCOMMENT_BLOCKTYPE_FLACHEADER) {
+		if (getblock(&data,&big,&window,offset,len)) goto error;
+		(ignore)parsecomments(dest,data,len); // keep whatever was found before a bad entry
+	} else if (blocktype==PICTURE_BLOCKTYPE_FLACHEADER) {
+		(ignore)parsepicture(dest,&isfront,&window,offset,len); // a bad one is just skipped
+	}
+	if (big) {
+		free(big);
+		big=NULL;
 	}
+	offset+=len; // other blocks are skipped without reading them
 
 	if (islast) break;
 }
+dest->audiooffset=offset;
+{
+	unsigned int ui;
+	for (ui=0;ui<dest->seekcount;ui++) dest->seekpoints[ui].offset+=offset;
+}
 
 if (dest->samplerate) {
 	uint64_t samples;
@@ -215,15 +326,186 @@ if (dest->samplerate) {
 	samplerate=dest->samplerate;
 	dest->duration=(unsigned int)(samples/samplerate);
 }
+close(window.fd);
 return 0;
 error:
+	iffree(big);
+	ifclose(window.fd);
 	return -1;
 }
 
 int read_flacheader(struct flacheader *dest, char *filename) {
+// call deinit_flacheader after success
 reset_flacheader(dest);
 if (readheaderfromfile(dest,filename)) GOTOERROR;
 return 0;
+error:
+	deinit_flacheader(dest);
+	return -1;
+}
+
+/*
+ * Finding the frame that holds a given sample. The SEEKTABLE, if there is one, narrows it to
+ * the frames between two points. From there, and for files without a seektable, we guess
+ * an offset, find the next frame header after it and read its sample number, alternating
+ * between interpolating and halving. Once the gap is small, the frames are walked one by one.
+ * Frame headers are recognized by their sync code, reserved bits and CRC-8.
+ */
+
+#define SIZE_PROBE_FLACHEADER	(1024*16)
+#define MAX_HEADER_FLACHEADER	16
+#define MAX_ROUNDS_FLACHEADER	40
+
+static unsigned int crc8(unsigned char *data, unsigned int len) {
+unsigned int crc=0;
+while (len) {
+	int i;
+	crc^=*data;
+	for (i=0;i<8;i++) crc=(crc&0x80)?((crc<<1)^0x07)&0xff:(crc<<1)&0xff;
+	data++;
+	len--;
+}
+return crc;
+}
+
+static int parseframe(uint64_t *sample_out, unsigned char *data, unsigned int len, struct stream_flacheader *stream) {
+// 1 => data starts with a frame header
+unsigned int ui,n,hlen,bscode,srcode;
+uint64_t number;
+unsigned char x;
+
+if (len<6) return 0;
+if (data[0]!=0xff) return 0;
+if (data[1]!=(stream->blocksize?0xf8:0xf9)) return 0;
+bscode=data[2]>>4;
+srcode=data[2]&15;
+if (!bscode || (srcode==15)) return 0;
+if (((data[3]>>4)>=11) || (((data[3]>>1)&7)==3) || (data[3]&1)) return 0;
+x=data[4];
+if (!(x&0x80)) { n=0; number=x; }
+else if ((x&0xe0)==0xc0) { n=1; number=x&0x1f; }
+else if ((x&0xf0)==0xe0) { n=2; number=x&0x0f; }
+else if ((x&0xf8)==0xf0) { n=3; number=x&0x07; }
+else if ((x&0xfc)==0xf8) { n=4; number=x&0x03; }
+else if ((x&0xfe)==0xfc) { n=5; number=x&0x01; }
+else if (x==0xfe) { n=6; number=0; }
+else return 0;
+hlen=5+n;
+if (bscode==6) hlen+=1;
+else if (bscode==7) hlen+=2;
+if (srcode==12) hlen+=1;
+else if ((srcode==13)||(srcode==14)) hlen+=2;
+if (hlen+1>len) return 0;
+for (ui=0;ui<n;ui++) {
+	if ((data[5+ui]&0xc0)!=0x80) return 0;
+	number=(number<<6)|(data[5+ui]&0x3f);
+}
+if (crc8(data,hlen)!=data[hlen]) return 0;
+if (stream->blocksize) number*=stream->blocksize; // a frame number
+if (number>=stream->samples) return 0;
+*sample_out=number;
+return 1;
+}
+
+static int nextframe(int *isfound_out, uint64_t *offset_out, uint64_t *sample_out, int fd, struct stream_flacheader *stream,
+		uint64_t offset, uint64_t limit) {
+// the first frame that starts in [offset,limit)
+unsigned char buff[SIZE_PROBE_FLACHEADER];
+
+while (offset<limit) {
+	unsigned int got,ui,len;
+	if (preadall(fd,buff,SIZE_PROBE_FLACHEADER,offset,&got)) GOTOERROR;
+	if (!got) break;
+	len=got;
+	if (got==SIZE_PROBE_FLACHEADER) len-=MAX_HEADER_FLACHEADER; // the rest is looked at next time
+	if (offset+len>limit) len=limit-offset;
+	for (ui=0;ui<len;ui++) {
+		uint64_t sample;
+		if (buff[ui]!=0xff) continue;
+		if (!parseframe(&sample,buff+ui,got-ui,stream)) continue;
+		*isfound_out=1;
+		*offset_out=offset+ui;
+		*sample_out=sample;
+		return 0;
+	}
+	if (got!=SIZE_PROBE_FLACHEADER) break;
+	offset+=len;
+}
+*isfound_out=0;
+return 0;
+error:
+	return -1;
+}
+
+int seek_flacheader(uint64_t *offset_out, uint64_t *sample_out, int fd, struct stream_flacheader *stream, uint64_t target) {
+// the frame holding sample target, -1 if there isn't one
+struct { uint64_t offset,sample; } lo,hi;
+unsigned int ui;
+int isfound;
+
+if (target>=stream->samples) GOTOERROR;
+lo.offset=stream->audiooffset; lo.sample=0;
+hi.offset=stream->filesize; hi.sample=stream->samples;
+for (ui=0;ui<stream->seekcount;ui++) {
+	struct seekpoint_flacheader *p=stream->seekpoints+ui;
+	if ((p->offset<lo.offset) || (p->offset>=hi.offset)) break; // a damaged table
+	if (p->sample<=target) {
+		lo.offset=p->offset; lo.sample=p->sample;
+	} else {
+		hi.offset=p->offset; hi.sample=p->sample;
+		break;
+	}
+}
+{ // the start has to be a frame, otherwise we don't trust the table
+	uint64_t offset,sample;
+	if (nextframe(&isfound,&offset,&sample,fd,stream,lo.offset,lo.offset+1)) GOTOERROR;
+	if (!isfound || (sample!=lo.sample)) {
+		if (lo.offset==stream->audiooffset) GOTOERROR;
+		lo.offset=stream->audiooffset; lo.sample=0;
+		hi.offset=stream->filesize; hi.sample=stream->samples;
+		if (nextframe(&isfound,&offset,&sample,fd,stream,lo.offset,lo.offset+1)) GOTOERROR;
+		if (!isfound || sample) GOTOERROR;
+	}
+}
+for (ui=0;(ui<MAX_ROUNDS_FLACHEADER) && (hi.offset-lo.offset>SIZE_PROBE_FLACHEADER);ui++) {
+	uint64_t guess,offset,sample;
+	if ((ui&1) || (hi.sample<=lo.sample)) {
+		guess=lo.offset+(hi.offset-lo.offset)/2;
+	} else {
+		guess=lo.offset+(uint64_t)((double)(hi.offset-lo.offset)*(double)(target-lo.sample)/(double)(hi.sample-lo.sample));
+	}
+	if (guess<=lo.offset) guess=lo.offset+1;
+	if (nextframe(&isfound,&offset,&sample,fd,stream,guess,hi.offset)) GOTOERROR;
+	if (!isfound) {
+		hi.offset=guess; // nothing starts between guess and hi
+	} else if (sample<=target) {
+		if (sample<lo.sample) GOTOERROR;
+		lo.offset=offset; lo.sample=sample;
+	} else {
+		if (sample>hi.sample) GOTOERROR;
+		hi.offset=offset; hi.sample=sample;
+	}
+}
+while (1) {
+	uint64_t offset,sample;
+	if (nextframe(&isfound,&offset,&sample,fd,stream,lo.offset+1,hi.offset)) GOTOERROR;
+	if (!isfound || (sample>target)) break;
+	lo.offset=offset; lo.sample=sample;
+}
+*offset_out=lo.offset;
+*sample_out=lo.sample;
+return 0;
+error:
+	return -1;
+}
+
+int next_flacheader(uint64_t *offset_out, int fd, struct stream_flacheader *stream, uint64_t offset) {
+// where the frame after the one at offset starts, the file size after the last one
+uint64_t sample;
+int isfound;
+if (nextframe(&isfound,offset_out,&sample,fd,stream,offset+1,stream->filesize)) GOTOERROR;
+if (!isfound) *offset_out=stream->filesize;
+return 0;
 error:
 	return -1;
 }
@@ -1,16 +1,42 @@
-
 #define MAXSTR_FLACHEADER	256
+struct seekpoint_flacheader {
+	uint64_t sample;
+	uint64_t offset; // from the start of the file, unlike in the SEEKTABLE
+};
+
 struct flacheader {
 	char title[MAXSTR_FLACHEADER+1];
 	char artist[MAXSTR_FLACHEADER+1];
 	char album[MAXSTR_FLACHEADER+1];
 	char date[MAXSTR_FLACHEADER+1];
+	char genre[MAXSTR_FLACHEADER+1];
 	int duration; /* in seconds, -1 => dunno */
 	unsigned int tracknumber;
 
 	unsigned int samplerate;
 	unsigned int high_samplecount;
 	unsigned int low_samplecount;
+	unsigned int blocksize; // 0 => variable
+	uint64_t audiooffset; // first frame, after the metadata
+	struct seekpoint_flacheader *seekpoints; // malloc'd, NULL => no SEEKTABLE
+	unsigned int seekcount;
+#define NONE_ARTTYPE_FLACHEADER	0
+#define JPEG_ARTTYPE_FLACHEADER	1
+#define PNG_ARTTYPE_FLACHEADER	2
+	uint64_t artoffset; // of the image in a PICTURE block
+	unsigned int artsize; // 0 => no usable picture
+	unsigned int arttype;
+	unsigned int artwidth,artheight; // as the PICTURE block says, 0 => dunno
+};
+
+struct stream_flacheader {
+	uint64_t samples,filesize,audiooffset;
+	unsigned int samplerate,blocksize;
+	struct seekpoint_flacheader *seekpoints;
+	unsigned int seekcount;
 };
 
 int read_flacheader(struct flacheader *dest, char *filename);
+void deinit_flacheader(struct flacheader *p);
+int seek_flacheader(uint64_t *offset_out, uint64_t *sample_out, int fd, struct stream_flacheader *stream, uint64_t target);
+int next_flacheader(uint64_t *offset_out, int fd, struct stream_flacheader *stream, uint64_t offset);
@@ -16,6 +16,7 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 #include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <ctype.h>
@@ -34,6 +36,8 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <dirent.h>
+#include <sys/sendfile.h>
+#include <signal.h>
 // #define DEBUG
 #include "common/conventions.h"
 #include "common/blockmem.h"
@@ -42,30 +46,72 @@
 #include "dump.h"
 #include "icon.h"
 #include "lineio.h"
-#include "flacheader.h"
 #include "xml.h"
+#include "eventloop.h"
+#include "uring.h"
+#include "containers.h"
+#include "search.h"
+#include "sort.h"
+#include "flacheader.h"
 
 #include "httpd.h"
 
-int getsocket_httpd(struct shared *shared) {
+static int bindsocket(int *fd_out, struct shared *shared, unsigned short port, int isreuseport) {
 struct sockaddr_in sa;
-socklen_t ssa;
 int fd=-1;
 
 if (0>(fd=socket(AF_INET,SOCK_STREAM,0))) GOTOERROR;
+if (isreuseport) {
+	int one=1;
+	if (setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one))) GOTOERROR;
+}
+{ // accept() waits for the request, so the parent can answer HEADs without forking
+	int seconds=5;
+	(ignore)setsockopt(fd,IPPROTO_TCP,TCP_DEFER_ACCEPT,&seconds,sizeof(seconds));
+}
 
 memset(&sa,0,sizeof(sa));
 sa.sin_family=AF_INET;
 sa.sin_addr.s_addr=shared->ipv4_interface;
+sa.sin_port=htons(port);
 if (0>bind(fd,(struct sockaddr*)&sa,sizeof(sa))) GOTOERROR;
 
+*fd_out=fd;
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+int getsocket_httpd(struct shared *shared) {
+struct sockaddr_in sa;
+socklen_t ssa;
+int fd=-1;
+
+if (bindsocket(&fd,shared,0,shared->workers.count!=0)) GOTOERROR;
+
 ssa=sizeof(sa);
 if (getsockname(fd,(struct sockaddr*)&sa,&ssa)) GOTOERROR;
 if (ssa!=sizeof(sa)) GOTOERROR;
 shared->tcp_port=ntohs(sa.sin_port);
 log_shared(shared,1,"%s:%d bound on port %u\n",__FILE__,__LINE__,ntohs(sa.sin_port));
 
-if (listen(fd,5)) GOTOERROR;
+if (listen(fd,shared->pending.backlog)) GOTOERROR;
+
+if (shared->workers.count) {
+// each worker gets its own listener, the kernel spreads connections between them
+// the parent keeps tcp_socket at -1 and never accepts
+	unsigned int ui;
+	shared->workers.list[0].fd=fd;
+	fd=-1;
+	for (ui=1;ui<shared->workers.count;ui++) {
+		if (bindsocket(&fd,shared,shared->tcp_port,1)) GOTOERROR;
+		if (listen(fd,shared->pending.backlog)) GOTOERROR;
+		shared->workers.list[ui].fd=fd;
+		fd=-1;
+	}
+	return 0;
+}
 
 shared->tcp_socket=fd;
 return 0;
@@ -74,6 +120,17 @@ error:
 	return -1;
 }
 
+#define SIZE_LINEBUFF_HTTPD	2048
+#define MAX_RANGES_HTTPD	8
+#define BOUNDARY_HTTPD	"quickdlna-3f9c2a7e51b0d864"
+#define IDLE_SECONDS_KEEPALIVE_HTTPD	5
+#define MAX_REQUESTS_KEEPALIVE_HTTPD	100
+#define WAIT_SECONDS_PENDING_HTTPD	5
+#define RETRYAFTER_SECONDS_HTTPD	5
+#define SIZE_DIDL_HTTPD	(64*1024)
+#define SEEK_FEATURES_HTTPD	"DLNA.ORG_OP=11;DLNA.ORG_CI=0" // byte ranges and TimeSeekRange
+#define RANGE_FEATURES_HTTPD	"DLNA.ORG_OP=01;DLNA.ORG_CI=0" // byte ranges only
+
 struct replybuffer {
 #define SIZE_CONTENTTYPE_REPLYBUFFER	64
 	char contenttype[SIZE_CONTENTTYPE_REPLYBUFFER];
@@ -87,13 +144,41 @@ struct replybuffer {
 	} internal;
 	struct {
 		int fd;
+		uint64_t offset; // where the body starts in the file
 	} external;
 	uint64_t fullsize;
-	int isrange;
+	int isrange; // => 206, with ranges.count>1 it's multipart/byteranges
+	struct {
+		unsigned int count;
+		struct range_replybuffer {
+			uint64_t start,limit;
+		} list[MAX_RANGES_HTTPD];
+		uint64_t fullsize; // for Content-Range on a 416
+	} ranges;
+	unsigned int retryafter; // for a 503
 	struct {
-		uint64_t start,limit;
-	} range;
+		int isstream; // => body comes from fill_browse, fullsize is precomputed
+		int isprefixdone,istaildone;
+		unsigned int idx,limit; // next item to copy, end of the page
+		unsigned int *children,childcount; // children==NULL => all files
+		unsigned int *found; // malloc'd search results or sorted children, children points here
+		unsigned int objectid; // for BrowseMetadata, children points here
+		int isreverse; // => children are walked from the end
+		unsigned int props; // from Filter, see parse_filter
+		unsigned int updateid; // ContainerUpdateID, or SystemUpdateID
+		char parentid[16];
+		unsigned int parentidlen;
+		char *prefix; unsigned int prefixlen;
+		char *action; // for the tail, "Browse" or "Search"
+#define SIZE_TAIL_BROWSE	256
+		char tail[SIZE_TAIL_BROWSE];
+		unsigned int taillen;
+	} browse;
 	int iserror;
+	int ishead; // => send the header only
+	int isclose; // => send "Connection: close" and hang up after
+#define SIZE_HEADERS_REPLYBUFFER	192
+	char headers[SIZE_HEADERS_REPLYBUFFER]; // extra headers, "" => none
 #ifdef DEBUG
 	struct {
 		char *replyheader;
@@ -124,6 +209,19 @@ error:
 	return -1;
 }
 
+static void recycle_replybuffer(struct replybuffer *rb) {
+// keeps the allocated buffer for the next request
+unsigned char *buff=rb->buff;
+unsigned int bufflen=rb->bufflen;
+
+ifclose(rb->external.fd);
+iffree(rb->browse.found);
+clear_replybuffer(rb);
+rb->buff=buff;
+rb->bufflen=bufflen;
+(void)reset_replybuffer(rb);
+}
+
 static void addustring_replybuffer(struct replybuffer *rb, unsigned char *msg, unsigned int msglen) {
 if (rb->internal.left<msglen) {
 	rb->iserror=1;
@@ -154,7 +252,7 @@ if (mimetype) {
 return 0;
 }
 
-static int addmerge_replybuffer(struct shared *shared, struct replybuffer *rb, int isrange, uint64_t rangestart, uint64_t rangelimit) {
+static int addmerge_replybuffer(struct shared *shared, struct replybuffer *rb) {
 uint64_t u64=0;
 unsigned int idx;
 
@@ -171,26 +269,53 @@ for (idx=0;idx<shared->max_files;idx++) {
 
 rb->fullsize=u64;
 
-if (isrange) { // we only support open-ended "xx-" range
-	if (rangestart>u64) {
-		(void)add404_replybuffer(rb); // TODO send correct error
-		return 0;
-	}
-#ifdef DEBUG
-		fprintf(stderr,"%s:%d streaming from offset %"PRIu64" in %s\n",__FILE__,__LINE__,rangestart,"merge");
-#endif
-} else {
 #ifdef DEBUG
 		fprintf(stderr,"%s:%d pid:%d streaming %s\n",__FILE__,__LINE__,getpid(),"merge");
 #endif
-}
 
 return 0;
 }
 
-static int addfile_replybuffer(struct replybuffer *rb, char *filename, char *mimetype, int isrange,
-		uint64_t rangestart, uint64_t rangelimit) {
-struct stat statbuf;
+static struct uring *getring(struct shared *shared) {
+// returns NULL if we should use plain syscalls
+struct uring *ring=NULL;
+
+if (!shared->options.isiouring) return NULL;
+if (shared->uring.ring) return shared->uring.ring;
+if (shared->uring.isfailed) return NULL;
+if (!(ring=malloc(sizeof(struct uring)))) GOTOERROR;
+clear_uring(ring);
+if (init_uring(ring,32)) {
+	log_shared(shared,1,"%s:%d io_uring unsupported, using plain syscalls\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+shared->uring.ring=ring;
+return ring;
+error:
+	if (ring) {
+		deinit_uring(ring);
+		free(ring);
+	}
+	shared->uring.isfailed=1;
+	return NULL;
+}
+
+void readyring_httpd(struct shared *shared) {
+// sets up this process's ring before a request needs it
+(void)getring(shared);
+}
+
+static void handoffring(struct shared *shared) {
+// a forked child keeps the parent's ring, the parent makes another for the next child
+if (!shared->uring.ring) return;
+deinit_uring(shared->uring.ring); // the child's mapping keeps it alive
+free(shared->uring.ring);
+shared->uring.ring=NULL;
+(void)getring(shared);
+}
+
+static int addfile_replybuffer(struct replybuffer *rb, struct shared *shared, char *filename, char *mimetype) {
+struct uring *ring;
 int fd=-1;
 uint64_t u64;
 
@@ -200,26 +325,20 @@ if (mimetype) {
 
 rb->isexternal=1;
 
-if (0>(fd=open(filename,O_RDONLY))) GOTOERROR;
-if (fstat(fd,&statbuf)) GOTOERROR;
-
-rb->fullsize=u64=statbuf.st_size;
-
-if (isrange) { // we only support open-ended "xx-" range
-	if (rangestart>u64) {
-		(void)add404_replybuffer(rb); // TODO send correct error
-		return 0;
-	}
-#ifdef DEBUG
-		fprintf(stderr,"%s:%d streaming from offset %"PRIu64" in %s\n",__FILE__,__LINE__,rangestart,filename);
-#endif
-	rb->external.fd=fd;
+if ((ring=getring(shared))) {
+	if (openstat_uring(&fd,&u64,ring,filename)) GOTOERROR;
 } else {
+	struct stat statbuf;
+	if (0>(fd=open(filename,O_RDONLY))) GOTOERROR;
+	if (fstat(fd,&statbuf)) GOTOERROR;
+	u64=statbuf.st_size;
+}
+
+rb->fullsize=u64;
+rb->external.fd=fd;
 #ifdef DEBUG
 		fprintf(stderr,"%s:%d pid:%d streaming file %s\n",__FILE__,__LINE__,getpid(),filename);
 #endif
-	rb->external.fd=fd;
-}
 
 return 0;
 error:
@@ -227,6 +346,41 @@ error:
 	return -1;
 }
 
+static void addhead_replybuffer(struct replybuffer *rb, struct file_shared *file, char *mimetype) {
+// for HEAD, the catalog already has what we need, there's no need to open the file
+snprintf(rb->contenttype,SIZE_CONTENTTYPE_REPLYBUFFER,"Content-Type: %s\r\n",mimetype);
+rb->fullsize=file->size;
+}
+
+static int addart_replybuffer(struct replybuffer *rb, struct shared *shared, struct file_shared *file) {
+// the image is sent from inside the audio file, by offset, it's never copied
+struct meta_file_shared *meta=file->meta;
+char *mimetype;
+
+if (!meta || !meta->artsize) {
+	(void)add404_replybuffer(rb);
+	return 0;
+}
+mimetype=(meta->arttype==PNG_ARTTYPE_FLACHEADER)?"image/png":"image/jpeg";
+if (rb->ishead) {
+	snprintf(rb->contenttype,SIZE_CONTENTTYPE_REPLYBUFFER,"Content-Type: %s\r\n",mimetype);
+} else {
+	if (addfile_replybuffer(rb,shared,file->filename,mimetype)) GOTOERROR;
+	if (meta->artoffset+meta->artsize>rb->fullsize) { // it changed since we looked
+		ifclose(rb->external.fd);
+		rb->external.fd=-1;
+		(void)add404_replybuffer(rb);
+		return 0;
+	}
+	rb->external.offset=meta->artoffset;
+}
+rb->fullsize=meta->artsize;
+strcpy(rb->headers,"Cache-Control: max-age=31536000\r\n");
+return 0;
+error:
+	return -1;
+}
+
 static int make_rootxml(struct shared *shared, struct replybuffer *rb) {
 
 addstring_replybuffer(rb,"<?xml version=\"1.0\"?>\r\n");
@@ -286,13 +440,25 @@ struct request {
 #define ONEMP3_FILEINDEX_REQUEST	6
 #define ONEMP4_FILEINDEX_REQUEST	7
 #define MERGE_FILEINDEX_REQUEST	8
+#define ART_FILEINDEX_REQUEST	9
 	int fileindex;
 	unsigned int postlen;
 #define MAX_SOAPACTION_REQUEST 79
 	char soapaction[MAX_SOAPACTION_REQUEST+1];
 	int isrange;
-	uint64_t rangestart,rangelimit;
+	unsigned int rangecount;
+	struct rangespec_request {
+		uint64_t first,last;
+		int issuffix; // => last bytes, "-N"
+		int isopen; // => to the end, "N-"
+	} ranges[MAX_RANGES_HTTPD];
 	struct file_shared *file;
+	int ishead; // => no body
+	int isclose; // => client doesn't want keep-alive
+	int istimeseek; // TimeSeekRange.dlna.org, in ms
+	uint64_t seekstart,seekend;
+	int isseekend; // => seekend was given, otherwise to the end
+	int isfeatures; // => getcontentFeatures.dlna.org: 1
 #ifdef DEBUG
 	struct {
 		char *request;
@@ -302,10 +468,11 @@ struct request {
 };
 SICLEARFUNC(request);
 
-static void addduration_replybuffer(struct replybuffer *rb, unsigned int seconds) {
+static void addduration_replybuffer(struct replybuffer *rb, unsigned int seconds, unsigned int ms) {
 //						1:00:00.000
 unsigned int minutes,hours;
 unsigned char buff2[2];
+unsigned char buff4[4];
 
 hours=seconds/3600;
 seconds=seconds%3600;
@@ -325,8 +492,11 @@ buff2[0]='0'+(seconds/10);
 buff2[1]='0'+(seconds%10);
 addustring_replybuffer(rb,buff2,2);
 
-addustring_replybuffer(rb,(unsigned char *)".000",4);
-
+buff4[0]='.';
+buff4[1]='0'+(ms/100)%10;
+buff4[2]='0'+(ms/10)%10;
+buff4[3]='0'+ms%10;
+addustring_replybuffer(rb,buff4,4);
 }
 
 static int mergefiles_browse(struct shared *shared, struct replybuffer *rb) {
@@ -351,23 +521,18 @@ addstring_replybuffer(rb,"&lt;upnp:class&gt;object.item.audioItem.musicTrack&lt;
 	uint64_t mergesize=0;
 	unsigned int duration=0;
 	unsigned int idx;
-	struct flacheader flacheader;
 
 	for (idx=0;idx<shared->max_files;idx++) {
 		struct file_shared *file;
 
 		file=shared->files[idx];
 		mergesize+=file->size;
-		if (read_flacheader(&flacheader,file->filename)) {
-			log_shared(shared,1,"%s:%d error reading flacheader for \"%s\"\n",__FILE__,__LINE__,file->filename);
-			duration+=600;
-		} else {
-			duration+=flacheader.duration;
-		}
+		if (!file->meta) duration+=600;
+		else duration+=file->meta->duration;
 	}
 	addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,mergesize);
 	addstring_replybuffer(rb,"\" duration=\"");
-	addduration_replybuffer(rb,duration);
+	addduration_replybuffer(rb,duration,0);
 	addstring_replybuffer(rb,"\" bitrate=\"");
 	addstring_replybuffer(rb,"100000");
 	addstring_replybuffer(rb,"\" protocolInfo=\"http-get:*:audio/x-flac:*\"&gt;");
@@ -392,20 +557,49 @@ addstring_replybuffer(rb,"</TotalMatches><UpdateID>0</UpdateID></u:BrowseRespons
 return 0;
 }
 
-static int getbrowsevars(unsigned int *start_out, unsigned int *max_out, struct shared *shared, char *data_in, unsigned int datalen) {
+struct browsevars {
+	unsigned int start,max;
+	unsigned int objectid; // ObjectID or ContainerID
+	int ismetadata; // BrowseFlag is BrowseMetadata, => the object itself instead of its children
+	char criteria[SIZE_CRITERIA_SEARCH]; // SearchCriteria
+#define SIZE_SORT_BROWSEVARS	256
+	char sort[SIZE_SORT_BROWSEVARS]; // SortCriteria
+#define SIZE_FILTER_BROWSEVARS	512
+	char filter[SIZE_FILTER_BROWSEVARS]; // Filter
+};
+
+static void copyvalue(char *dest, unsigned int destsize, struct tag_xml *tag) {
+unsigned int len=tag->value.len;
+if (!tag->value.ustr) len=0;
+if (len>=destsize) len=destsize-1;
+memcpy(dest,tag->value.ustr,len);
+dest[len]=0;
+}
+
+static int getbrowsevars(struct browsevars *vars, struct shared *shared, char *action, char *data_in, unsigned int datalen) {
+// action is "Browse" or "Search"
 struct xml xml;
 unsigned char *data=(unsigned char *)data_in;
-struct tag_xml envelope,body,browse,startingindex,requestedcount;
-int start=-1,max=-1;
+struct tag_xml envelope,body,browse,startingindex,requestedcount,objectid,containerid,browseflag,criteria,sort,filter;
+int start=-1,max=-1,id=-1,ismetadata=-1;
 char *temp;
 int ret=0;
 
 clear_xml(&xml);
 (void)set_tag_xml(&envelope,&xml.top,"Envelope");
 (void)set_tag_xml(&body,&envelope,"Body");
-(void)set_tag_xml(&browse,&body,"Browse");
+(void)set_tag_xml(&browse,&body,action);
 (void)set_tag_xml(&startingindex,&browse,"StartingIndex");
 (void)set_tag_xml(&requestedcount,&browse,"RequestedCount");
+(void)set_tag_xml(&objectid,&browse,"ObjectID");
+(void)set_tag_xml(&containerid,&browse,"ContainerID");
+(void)set_tag_xml(&browseflag,&browse,"BrowseFlag");
+(void)set_tag_xml(&criteria,&browse,"SearchCriteria");
+(void)set_tag_xml(&sort,&browse,"SortCriteria");
+(void)set_tag_xml(&filter,&browse,"Filter");
+vars->criteria[0]=0;
+vars->sort[0]=0;
+vars->filter[0]=0;
 
 (void)removecomments_xml(&datalen,data);
 data[datalen]=0;
@@ -425,6 +619,17 @@ if (parse_xml(&xml,data,datalen)) {
 		log_shared(shared,1,"%s:%d didn't find RequestedCount in xml browse request\n",__FILE__,__LINE__);
 		ret=-3;
 	}
+	if (objectid.value.ustr) {
+		id=slowtou((char *)objectid.value.ustr);
+	} else if (containerid.value.ustr) {
+		id=slowtou((char *)containerid.value.ustr);
+	}
+	if (browseflag.value.ustr) {
+		ismetadata=(browseflag.value.len>=14) && !memcmp(browseflag.value.ustr,"BrowseMetadata",14);
+	}
+	(void)copyvalue(vars->criteria,SIZE_CRITERIA_SEARCH,&criteria);
+	(void)copyvalue(vars->sort,SIZE_SORT_BROWSEVARS,&sort);
+	(void)copyvalue(vars->filter,SIZE_FILTER_BROWSEVARS,&filter);
 }
 if (start<0) {
 	temp=strstr(data_in,"<StartingIndex>");
@@ -444,312 +649,1095 @@ if (max<0) {
 		max=10;
 	}
 }
+if (id<0) {
+	if ((temp=strstr(data_in,"<ObjectID>"))) temp+=10;
+	else if ((temp=strstr(data_in,"<ContainerID>"))) temp+=13;
+	if (temp) {
+		for (;isspace(*temp);temp++);
+		id=slowtou(temp);
+	} else {
+		id=0;
+	}
+}
+if (!vars->criteria[0]) {
+	temp=strstr(data_in,"<SearchCriteria>");
+	if (temp) {
+		char *end;
+		temp+=16;
+		if ((end=strstr(temp,"</SearchCriteria>"))) {
+			unsigned int len=end-temp;
+			if (len>=SIZE_CRITERIA_SEARCH) len=SIZE_CRITERIA_SEARCH-1;
+			memcpy(vars->criteria,temp,len);
+			vars->criteria[len]=0;
+		}
+	}
+}
+if (ismetadata<0) {
+	ismetadata=0;
+	temp=strstr(data_in,"<BrowseFlag>");
+	if (temp) {
+		for (temp+=12;isspace(*temp);temp++);
+		ismetadata=!strncmp(temp,"BrowseMetadata",14);
+	}
+}
 
 #ifdef DEBUG
 	fprintf(stderr,"%s:%d got browse start:%d, max:%d\n",__FILE__,__LINE__,start,max);
 #endif
-*start_out=(unsigned int)start;
-*max_out=(unsigned int)max;
+vars->start=(unsigned int)start;
+vars->max=(unsigned int)max;
+vars->objectid=(unsigned int)id;
+vars->ismetadata=ismetadata;
 return ret;
 }
 
 
-static int handle_browse(struct shared *shared, struct request *request, struct replybuffer *rb) {
-unsigned int browse_start=0,browse_max=10,browse_limit;
-unsigned int itemcount=0;
-
-if (!strstr(request->soapaction,"#Browse")) {
-#ifdef DEBUG
-	fprintf(stderr,"%s:%d unknown soapaction: \"%s\"\n",__FILE__,__LINE__,request->soapaction);
-#endif
-	GOTOERROR;
+#define DESCRIPTION_PROP_DIDL	0
+#define DATE_PROP_DIDL	1
+#define ARTIST_PROP_DIDL	2
+#define ALBUM_PROP_DIDL	3
+#define TRACK_PROP_DIDL	4
+#define RES_PROP_DIDL	5
+#define ALBUMART_PROP_DIDL	6
+#define BIT_PROP_DIDL(a)	(1<<(a))
+#define ALL_PROPS_DIDL	((1<<COUNT_PROPS_DIDL)-1)
+
+static unsigned int parse_filter(char *filter) {
+// returns a mask of the optional item properties to send, "" and "*" => all of them
+char *cursor=filter;
+unsigned int props=0;
+
+while (isspace(*cursor)) cursor++;
+if (!*cursor) return ALL_PROPS_DIDL;
+while (*cursor) {
+	unsigned int len;
+	while (isspace(*cursor) || (*cursor==',')) cursor++;
+	for (len=0;cursor[len] && (cursor[len]!=',') && !isspace(cursor[len]);len++);
+	if (!len) break;
+#define ISPROP(a) ((len==sizeof(a)-1) && !strncmp(cursor,a,len))
+	if (ISPROP("*")) return ALL_PROPS_DIDL;
+	if (ISPROP("dc:description")) props|=BIT_PROP_DIDL(DESCRIPTION_PROP_DIDL);
+	else if (ISPROP("dc:date")) props|=BIT_PROP_DIDL(DATE_PROP_DIDL);
+	else if (ISPROP("upnp:artist") || ISPROP("dc:creator")) props|=BIT_PROP_DIDL(ARTIST_PROP_DIDL);
+	else if (ISPROP("upnp:album")) props|=BIT_PROP_DIDL(ALBUM_PROP_DIDL);
+	else if (ISPROP("upnp:originalTrackNumber")) props|=BIT_PROP_DIDL(TRACK_PROP_DIDL);
+	else if (ISPROP("res") || !strncmp(cursor,"res@",4)) props|=BIT_PROP_DIDL(RES_PROP_DIDL);
+	else if (ISPROP("upnp:albumArtURI") || !strncmp(cursor,"upnp:albumArtURI@",17)) props|=BIT_PROP_DIDL(ALBUMART_PROP_DIDL);
+#undef ISPROP
+	cursor+=len;
+}
+return props;
+}
+
+static void addmeta_browse(struct replybuffer *rb, struct meta_file_shared *meta, unsigned int props) {
+if (props&BIT_PROP_DIDL(DESCRIPTION_PROP_DIDL)) {
+	addstring_replybuffer(rb,"&lt;dc:description&gt;");
+	addxmlstring_replybuffer(rb,meta->title); addstring_replybuffer(rb,"&lt;/dc:description&gt;");
+}
+if (props&BIT_PROP_DIDL(DATE_PROP_DIDL)) {
+	addstring_replybuffer(rb,"&lt;dc:date&gt;");
+	addxmlstring_replybuffer(rb,meta->date); addstring_replybuffer(rb,"&lt;/dc:date&gt;");
+}
+if (props&BIT_PROP_DIDL(ARTIST_PROP_DIDL)) {
+	addstring_replybuffer(rb,"&lt;upnp:artist&gt;");
+	addxmlstring_replybuffer(rb,meta->artist); addstring_replybuffer(rb,"&lt;/upnp:artist&gt;");
+}
+if (props&BIT_PROP_DIDL(ALBUM_PROP_DIDL)) {
+	addstring_replybuffer(rb,"&lt;upnp:album&gt;");
+	addxmlstring_replybuffer(rb,meta->album); addstring_replybuffer(rb,"&lt;/upnp:album&gt;");
+}
+if (props&BIT_PROP_DIDL(TRACK_PROP_DIDL)) {
+	addstring_replybuffer(rb,"&lt;upnp:originalTrackNumber&gt;");
+	adduint_replybuffer(rb,meta->tracknumber); addstring_replybuffer(rb,"&lt;/upnp:originalTrackNumber&gt;");
+}
+}
+
+static void addres_browse(struct replybuffer *rb, uint64_t size, struct meta_file_shared *meta) {
+// the start of <res, up to protocolInfo
+addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,size);
+addstring_replybuffer(rb,"\" duration=\"");
+if (meta->samples && meta->samplerate) {
+	uint64_t ms=(meta->samples*1000)/meta->samplerate;
+	addduration_replybuffer(rb,(unsigned int)(ms/1000),(unsigned int)(ms%1000));
+} else {
+	addduration_replybuffer(rb,meta->duration,0);
+}
+addstring_replybuffer(rb,"\" bitrate=\"");
+if (!meta->bitrate) addstring_replybuffer(rb,"100000");
+else adduint_replybuffer(rb,meta->bitrate);
+if (meta->channels) {
+	addstring_replybuffer(rb,"\" sampleFrequency=\""); adduint_replybuffer(rb,meta->samplerate);
+	addstring_replybuffer(rb,"\" nrAudioChannels=\""); adduint_replybuffer(rb,meta->channels);
+	if (meta->bitspersample) {
+		addstring_replybuffer(rb,"\" bitsPerSample=\""); adduint_replybuffer(rb,meta->bitspersample);
+	}
 }
-
-if (shared->options.ismergefiles) {
-	return mergefiles_browse(shared,rb);
 }
 
-// POST is in replybuffer.buff, 0-term
-(ignore)getbrowsevars(&browse_start,&browse_max,shared,(char *)rb->buff,request->postlen);
-
-(void)reset_replybuffer(rb);
-
-addstring_replybuffer(rb,"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n");
-addstring_replybuffer(rb,"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">");
-addstring_replybuffer(rb,"<s:Body><u:BrowseResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\"><Result>");
-
-addstring_replybuffer(rb,"&lt;DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" xmlns:pv=\"http://www.pv.com/pvns/\"&gt;");
-
-browse_limit=browse_start+browse_max;
-if (browse_limit>shared->max_files) browse_limit=shared->max_files;
-
-unsigned int idx;
-for (idx=browse_start;idx<browse_limit;idx++) {
-	struct file_shared *file;
+static char *getartprofile(struct meta_file_shared *meta) {
+// the smallest DLNA image profile the picture fits in, NULL => unknown or too big for any
+unsigned int w=meta->artwidth,h=meta->artheight;
 
-	file=shared->files[idx];
-	itemcount+=1;
-
-	if (file->type&MUSICMASK_TYPE_FILE_SHARED) {
-		char *prefix="null";
-		addstring_replybuffer(rb,"&lt;item id=\"");
-		adduint_replybuffer(rb,idx+1);
-		addstring_replybuffer(rb,"\" parentID=\"0\" restricted=\"1\"&gt;");
-		addstring_replybuffer(rb,"&lt;dc:title&gt;");
-		addxmlfilename_replybuffer(rb,idx,file->filename);
-		addstring_replybuffer(rb,"&lt;/dc:title&gt;");
-		addstring_replybuffer(rb,"&lt;upnp:class&gt;object.item.audioItem.musicTrack&lt;/upnp:class&gt;");
-		switch (file->type) {
-			case FLAC_TYPE_FILE_SHARED:
-				prefix="flac";
-				{
-					struct flacheader flacheader;
-					if (read_flacheader(&flacheader,file->filename)) {
-						log_shared(shared,1,"%s:%d error reading flacheader for %s\n",__FILE__,__LINE__,file->filename);
-						addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,file->size);
-						addstring_replybuffer(rb,"\" duration=\"1:00:00.000\" bitrate=\"100000\" protocolInfo=\"http-get:*:audio/x-flac:*\"&gt;");
+if (!w || !h) return NULL;
+if (meta->arttype==PNG_ARTTYPE_FLACHEADER) {
+	if ((w<=160) && (h<=160)) return "PNG_TN";
+	if ((w<=4096) && (h<=4096)) return "PNG_LRG";
+	return NULL;
+}
+if ((w<=160) && (h<=160)) return "JPEG_TN";
+if ((w<=640) && (h<=480)) return "JPEG_SM";
+if ((w<=1024) && (h<=768)) return "JPEG_MED";
+if ((w<=4096) && (h<=4096)) return "JPEG_LRG";
+return NULL;
+}
+
+static int additem_browse(struct shared *shared, struct replybuffer *rb, unsigned int idx, char *parentid,
+		unsigned int props) {
+// props is a mask of the optional properties, the same order as file->didlprops
+struct file_shared *file=shared->files[idx];
+int isres=props&BIT_PROP_DIDL(RES_PROP_DIDL);
+
+if (file->type&MUSICMASK_TYPE_FILE_SHARED) {
+	char *prefix="null";
+	addstring_replybuffer(rb,"&lt;item id=\"");
+	adduint_replybuffer(rb,idx+1);
+	addstring_replybuffer(rb,"\" parentID=\""); addstring_replybuffer(rb,parentid);
+	addstring_replybuffer(rb,"\" restricted=\"1\"&gt;");
+	addstring_replybuffer(rb,"&lt;dc:title&gt;");
+	addxmlfilename_replybuffer(rb,idx,file->filename);
+	addstring_replybuffer(rb,"&lt;/dc:title&gt;");
+	addstring_replybuffer(rb,"&lt;upnp:class&gt;object.item.audioItem.musicTrack&lt;/upnp:class&gt;");
+	switch (file->type) {
+		case FLAC_TYPE_FILE_SHARED:
+			prefix="flac";
+			{
+				struct meta_file_shared *meta=file->meta;
+				if (!meta) {
+					if (!isres) break;
+					addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,file->size);
+					addstring_replybuffer(rb,"\" duration=\"1:00:00.000\" bitrate=\"100000\" protocolInfo=\"http-get:*:audio/x-flac:*\"&gt;");
+				} else {
+					(void)addmeta_browse(rb,meta,props);
+					if (!isres) break;
+					(void)addres_browse(rb,file->size,meta);
+					if (meta->samplerate) {
+						addstring_replybuffer(rb,"\" protocolInfo=\"http-get:*:audio/x-flac:"SEEK_FEATURES_HTTPD"\"&gt;");
 					} else {
-						addstring_replybuffer(rb,"&lt;dc:description&gt;");
-							addxmlstring_replybuffer(rb,flacheader.title); addstring_replybuffer(rb,"&lt;/dc:description&gt;");
-						addstring_replybuffer(rb,"&lt;dc:date&gt;");
-							addxmlstring_replybuffer(rb,flacheader.date); addstring_replybuffer(rb,"&lt;/dc:date&gt;");
-						addstring_replybuffer(rb,"&lt;upnp:artist&gt;");
-							addxmlstring_replybuffer(rb,flacheader.artist); addstring_replybuffer(rb,"&lt;/upnp:artist&gt;");
-						addstring_replybuffer(rb,"&lt;upnp:album&gt;");
-							addxmlstring_replybuffer(rb,flacheader.album); addstring_replybuffer(rb,"&lt;/upnp:album&gt;");
-						addstring_replybuffer(rb,"&lt;upnp:originalTrackNumber&gt;");
-							adduint_replybuffer(rb,flacheader.tracknumber); addstring_replybuffer(rb,"&lt;/upnp:originalTrackNumber&gt;");
-						addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,file->size);
-						addstring_replybuffer(rb,"\" duration=\"");
-						addduration_replybuffer(rb,flacheader.duration);
-						addstring_replybuffer(rb,"\" bitrate=\"");
-						if (!flacheader.duration) addstring_replybuffer(rb,"100000");
-						else adduint_replybuffer(rb,8*(unsigned int)(file->size/(uint64_t)flacheader.duration));
 						addstring_replybuffer(rb,"\" protocolInfo=\"http-get:*:audio/x-flac:*\"&gt;");
 					}
 				}
-				break;
-			case WAV_TYPE_FILE_SHARED:
-				prefix="wav";
+			}
+			break;
+		case WAV_TYPE_FILE_SHARED:
+			prefix="wav";
+			if (file->meta) (void)addmeta_browse(rb,file->meta,props);
+			if (!isres) break;
+			if (!file->meta) {
 				addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,file->size);
 				addstring_replybuffer(rb,"\" duration=\"1:00:00.000\" bitrate=\"100000\" protocolInfo=\"http-get:*:audio/x-wav:*\"&gt;");
-				break;
-			case MP3_TYPE_FILE_SHARED:
-				prefix="mp3";
+			} else {
+				(void)addres_browse(rb,file->size,file->meta);
+				addstring_replybuffer(rb,"\" protocolInfo=\"http-get:*:audio/x-wav:"RANGE_FEATURES_HTTPD"\"&gt;");
+			}
+			break;
+		case MP3_TYPE_FILE_SHARED:
+			prefix="mp3";
+			if (file->meta) (void)addmeta_browse(rb,file->meta,props);
+			if (!isres) break;
+			if (!file->meta) {
 				addstring_replybuffer(rb,"&lt;res size=\""); adduint64_replybuffer(rb,file->size);
 				addstring_replybuffer(rb,"\" duration=\"1:00:00.000\" bitrate=\"100000\" protocolInfo=\"http-get:*:audio/mpeg:*\"&gt;");
-				break;
-		}
-		{
-			char *buff=(char *)shared->buff512;
-			uint32_t u32=shared->ipv4_interface;
-			snprintf(buff,512,"http://%u.%u.%u.%u:%u/%s.%u",
-				(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff,shared->tcp_port,
-				prefix,idx);
-			addstring_replybuffer(rb,buff);
+			} else {
+				(void)addres_browse(rb,file->size,file->meta);
+				addstring_replybuffer(rb,"\" protocolInfo=\"http-get:*:audio/mpeg:*\"&gt;");
+			}
+			break;
+	}
+	if (isres) {
+		char *buff=(char *)shared->buff512;
+		uint32_t u32=shared->ipv4_interface;
+		snprintf(buff,512,"http://%u.%u.%u.%u:%u/%s.%u",
+			(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff,shared->tcp_port,
+			prefix,idx);
+		addstring_replybuffer(rb,buff);
+		addstring_replybuffer(rb,"&lt;/res&gt;");
+	}
+	if ((props&BIT_PROP_DIDL(ALBUMART_PROP_DIDL)) && (file->type==FLAC_TYPE_FILE_SHARED) && file->meta && file->meta->artsize) {
+		char *buff=(char *)shared->buff512;
+		uint32_t u32=shared->ipv4_interface;
+		char *profile;
+		addstring_replybuffer(rb,"&lt;upnp:albumArtURI");
+		if ((profile=getartprofile(file->meta))) {
+			addstring_replybuffer(rb," dlna:profileID=\""); addstring_replybuffer(rb,profile);
+			addstring_replybuffer(rb,"\"");
 		}
-		addstring_replybuffer(rb,"&lt;/res&gt;&lt;/item&gt;");
-	} else if (file->type==VIDEO_TYPE_FILE_SHARED) {
-		addstring_replybuffer(rb,"&lt;item id=\"");
-		adduint_replybuffer(rb,idx+1);
-		addstring_replybuffer(rb,"\" parentID=\"0\" restricted=\"1\"&gt;");
-		addstring_replybuffer(rb,"&lt;dc:title&gt;");
-		addxmlfilename_replybuffer(rb,idx,file->filename);
-		addstring_replybuffer(rb,"&lt;/dc:title&gt;");
-		addstring_replybuffer(rb,"&lt;upnp:class&gt;object.item.videoItem&lt;/upnp:class&gt;");
+		addstring_replybuffer(rb," xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"&gt;");
+		// the mtime changes the url when the file changes, /art.N is cached for long
+		snprintf(buff,512,"http://%u.%u.%u.%u:%u/art.%u.%"PRIu64,
+			(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff,shared->tcp_port,
+			idx,file->mtime/1000000000);
+		addstring_replybuffer(rb,buff);
+		addstring_replybuffer(rb,"&lt;/upnp:albumArtURI&gt;");
+	}
+	addstring_replybuffer(rb,"&lt;/item&gt;");
+} else if (file->type==VIDEO_TYPE_FILE_SHARED) {
+	addstring_replybuffer(rb,"&lt;item id=\"");
+	adduint_replybuffer(rb,idx+1);
+	addstring_replybuffer(rb,"\" parentID=\""); addstring_replybuffer(rb,parentid);
+	addstring_replybuffer(rb,"\" restricted=\"1\"&gt;");
+	addstring_replybuffer(rb,"&lt;dc:title&gt;");
+	addxmlfilename_replybuffer(rb,idx,file->filename);
+	addstring_replybuffer(rb,"&lt;/dc:title&gt;");
+	addstring_replybuffer(rb,"&lt;upnp:class&gt;object.item.videoItem&lt;/upnp:class&gt;");
+	if (isres) {
+		char *buff=(char *)shared->buff512;
+		uint32_t u32=shared->ipv4_interface;
 		addstring_replybuffer(rb,"&lt;res size=\"");
 		adduint64_replybuffer(rb,file->size);
 		addstring_replybuffer(rb,"\" duration=\"5:00:00.000\" resolution=\"100x100\" protocolInfo=\"http-get:*:video/mp4:*\"&gt;");
-		{
-			char *buff=(char *)shared->buff512;
-			uint32_t u32=shared->ipv4_interface;
-			snprintf(buff,512,"http://%u.%u.%u.%u:%u/mp4.%u",
-				(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff,shared->tcp_port,
-				idx);
-			addstring_replybuffer(rb,buff);
-		}
-		addstring_replybuffer(rb,"&lt;/res&gt;&lt;/item&gt;");
-	} else {
-		GOTOERROR;
+		snprintf(buff,512,"http://%u.%u.%u.%u:%u/mp4.%u",
+			(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff,shared->tcp_port,
+			idx);
+		addstring_replybuffer(rb,buff);
+		addstring_replybuffer(rb,"&lt;/res&gt;");
 	}
+	addstring_replybuffer(rb,"&lt;/item&gt;");
+} else {
+	GOTOERROR;
+}
+return 0;
+error:
+	return -1;
 }
 
-addstring_replybuffer(rb,"&lt;/DIDL-Lite&gt;");
-addstring_replybuffer(rb,"</Result>");
-addstring_replybuffer(rb,"<NumberReturned>");
-adduint_replybuffer(rb,itemcount);
-addstring_replybuffer(rb,"</NumberReturned><TotalMatches>");
-adduint_replybuffer(rb,shared->max_files);
-addstring_replybuffer(rb,"</TotalMatches><UpdateID>0</UpdateID></u:BrowseResponse></s:Body></s:Envelope>\r\n");
-
+static void addcontainer_browse(struct shared *shared, struct replybuffer *rb, unsigned int idx) {
+struct container_shared *c=&shared->containers.list[idx];
+
+addstring_replybuffer(rb,"&lt;container id=\"");
+adduint_replybuffer(rb,getid_containers(shared,idx));
+addstring_replybuffer(rb,"\" parentID=\"");
+adduint_replybuffer(rb,c->parentid);
+addstring_replybuffer(rb,"\" restricted=\"1\" childCount=\"");
+adduint_replybuffer(rb,c->childcount);
+addstring_replybuffer(rb,"\"&gt;&lt;dc:title&gt;");
+addxmlstring_replybuffer(rb,c->title);
+addstring_replybuffer(rb,"&lt;/dc:title&gt;&lt;upnp:class&gt;");
+addstring_replybuffer(rb,c->upnpclass);
+addstring_replybuffer(rb,"&lt;/upnp:class&gt;&lt;/container&gt;");
+}
+
+static unsigned int getsize_browse(struct shared *shared, struct replybuffer *rb, unsigned int id) {
+// 0 => not cached
+if (id && (id<FIRSTID_CONTAINER_SHARED)) {
+	struct file_shared *file=shared->files[id-1];
+	unsigned int len,k;
+	if (!file->didl) return 0;
+	if (rb->browse.props==ALL_PROPS_DIDL) return file->didllen-1+rb->browse.parentidlen; // cached with parentID="0"
+	len=file->didlprops[0]+file->didllen-file->didlprops[COUNT_PROPS_DIDL];
+	for (k=0;k<COUNT_PROPS_DIDL;k++) {
+		if (rb->browse.props&BIT_PROP_DIDL(k)) len+=file->didlprops[k+1]-file->didlprops[k];
+	}
+	return len-1+rb->browse.parentidlen;
+} else {
+	struct container_shared *c;
+	if (!(c=find_containers(shared,id))) return 0;
+	if (!c->didl) return 0;
+	return c->didllen;
+}
+}
+
+static int addobject_browse(struct shared *shared, struct replybuffer *rb, unsigned int id) {
+if (id && (id<FIRSTID_CONTAINER_SHARED)) {
+	struct file_shared *file=shared->files[id-1];
+	unsigned int k,end;
+	if (!file->didl) return additem_browse(shared,rb,id-1,rb->browse.parentid,rb->browse.props);
+	addustring_replybuffer(rb,(unsigned char *)file->didl,file->didlparent);
+	addustring_replybuffer(rb,(unsigned char *)rb->browse.parentid,rb->browse.parentidlen);
+	if (rb->browse.props==ALL_PROPS_DIDL) {
+		addustring_replybuffer(rb,(unsigned char *)file->didl+file->didlparent+1,file->didllen-file->didlparent-1);
+		return 0;
+	}
+	addustring_replybuffer(rb,(unsigned char *)file->didl+file->didlparent+1,file->didlprops[0]-file->didlparent-1);
+	for (k=0;k<COUNT_PROPS_DIDL;k++) {
+		if (!(rb->browse.props&BIT_PROP_DIDL(k))) continue;
+		addustring_replybuffer(rb,(unsigned char *)file->didl+file->didlprops[k],file->didlprops[k+1]-file->didlprops[k]);
+	}
+	end=file->didlprops[COUNT_PROPS_DIDL];
+	addustring_replybuffer(rb,(unsigned char *)file->didl+end,file->didllen-end);
+} else {
+	struct container_shared *c;
+	if (!(c=find_containers(shared,id))) GOTOERROR;
+	if (!c->didl) (void)addcontainer_browse(shared,rb,c-shared->containers.list);
+	else addustring_replybuffer(rb,(unsigned char *)c->didl,c->didllen);
+}
 return 0;
 error:
 	return -1;
 }
 
-static int parserange(struct request *req, char *str) {
-uint64_t start;
+#define ENVELOPE_CONTENTDIR	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"\
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+#define DIDL_CONTENTDIR	"&lt;DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\" xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" xmlns:pv=\"http://www.pv.com/pvns/\"&gt;"
+#define PREFIX_BROWSE	ENVELOPE_CONTENTDIR\
+	"<s:Body><u:BrowseResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\"><Result>"\
+	DIDL_CONTENTDIR
+#define PREFIX_SEARCH	ENVELOPE_CONTENTDIR\
+	"<s:Body><u:SearchResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\"><Result>"\
+	DIDL_CONTENTDIR
+#define TAIL_BROWSE	"&lt;/DIDL-Lite&gt;</Result><NumberReturned>%u</NumberReturned><TotalMatches>%u</TotalMatches>"\
+	"<UpdateID>%u</UpdateID></u:%sResponse></s:Body></s:Envelope>\r\n"
+
+static void addupnperror_replybuffer(struct replybuffer *rb, unsigned int code, char *description) {
+// SOAP fault, 402 => Invalid Args, 701 => No such object
+(void)reset_replybuffer(rb);
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=500;
+rb->replycodemsg="Internal Server Error";
+snprintf(rb->contenttype,SIZE_CONTENTTYPE_REPLYBUFFER,"Content-Type: text/xml; charset=\"utf-8\"\r\n");
+addstring_replybuffer(rb,ENVELOPE_CONTENTDIR);
+addstring_replybuffer(rb,"<s:Body><s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"\
+		"<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>");
+adduint_replybuffer(rb,code);
+addstring_replybuffer(rb,"</errorCode><errorDescription>");
+addstring_replybuffer(rb,description);
+addstring_replybuffer(rb,"</errorDescription></UPnPError></detail></s:Fault></s:Body></s:Envelope>\r\n");
+}
+
+static inline unsigned int getchild_browse(struct replybuffer *rb, unsigned int idx) {
+if (rb->browse.isreverse) idx=rb->browse.childcount-1-idx;
+if (!rb->browse.children) return idx+1; // flat, all the files
+return rb->browse.children[idx];
+}
+
+static int settail_browse(struct replybuffer *rb, unsigned int itemcount) {
+int n;
+n=snprintf(rb->browse.tail,SIZE_TAIL_BROWSE,TAIL_BROWSE,itemcount,rb->browse.childcount,rb->browse.updateid,
+		rb->browse.action);
+if ((n<0)||(n>=SIZE_TAIL_BROWSE)) return -1;
+rb->browse.taillen=n;
+return 0;
+}
 
-while(isspace(*str)) str++;
-if (strncasecmp(str,"bytes=",6)) GOTOERROR;
-str+=6;
-start=slowtou64(str);
-str=strchr(str,'-');
-if (!str) GOTOERROR;
-str++;
-req->rangestart=start;
-if (*str) {
-	uint64_t limit;
-	limit=slowtou64(str);
-	if (limit<start) GOTOERROR;
-	limit++;
-	req->rangelimit=limit;
+static int setstream_browse(int *isstream_out, struct shared *shared, struct replybuffer *rb,
+		unsigned int start, unsigned int limit) {
+// if every item is cached, the page is copied to the socket a buffer at a time instead of built here
+uint64_t size;
+unsigned int idx;
+
+size=rb->browse.prefixlen;
+for (idx=start;idx<limit;idx++) {
+	unsigned int len;
+	len=getsize_browse(shared,rb,getchild_browse(rb,idx));
+	if (!len) {
+		*isstream_out=0;
+		return 0;
+	}
+	size+=len;
 }
+if (settail_browse(rb,limit-start)) GOTOERROR;
+size+=rb->browse.taillen;
+
+rb->browse.isstream=1;
+rb->browse.idx=start;
+rb->browse.limit=limit;
+rb->fullsize=size;
+*isstream_out=1;
 return 0;
 error:
 	return -1;
 }
 
-static struct file_shared *getfile(struct shared *shared, char *str) {
-struct file_shared *file;
-unsigned int u32;
-u32=slowtou(str);
-if (u32>=shared->max_files) GOTOERROR;
-file=shared->files[u32];
-return file;
+static unsigned int fill_browse(struct shared *shared, struct replybuffer *rb) {
+// copies as much of the rest of the page as fits into rb->buff, returns the length
+(void)reset_replybuffer(rb);
+if (!rb->browse.isprefixdone) {
+	addustring_replybuffer(rb,(unsigned char *)rb->browse.prefix,rb->browse.prefixlen);
+	rb->browse.isprefixdone=1;
+}
+while (rb->browse.idx<rb->browse.limit) {
+	unsigned int id;
+	id=getchild_browse(rb,rb->browse.idx);
+	if (getsize_browse(shared,rb,id)>rb->internal.left) return rb->bufflen-rb->internal.left;
+	(ignore)addobject_browse(shared,rb,id); // always cached, setstream_browse checked
+	rb->browse.idx+=1;
+}
+if (!rb->browse.istaildone) {
+	if (rb->browse.taillen>rb->internal.left) return rb->bufflen-rb->internal.left;
+	addustring_replybuffer(rb,(unsigned char *)rb->browse.tail,rb->browse.taillen);
+	rb->browse.istaildone=1;
+}
+return rb->bufflen-rb->internal.left;
+}
+
+static void setparent_browse(struct replybuffer *rb, unsigned int parentid) {
+snprintf(rb->browse.parentid,sizeof(rb->browse.parentid),"%u",parentid);
+rb->browse.parentidlen=strlen(rb->browse.parentid);
+}
+
+static int addpage_browse(struct shared *shared, struct replybuffer *rb, unsigned int start, unsigned int max) {
+// browse.children, childcount, parentid, prefix and action are set
+unsigned int idx,limit;
+
+limit=rb->browse.childcount;
+if (start>limit) start=limit;
+if (max<limit-start) limit=start+max;
+
+{
+	int isstream;
+	if (setstream_browse(&isstream,shared,rb,start,limit)) GOTOERROR;
+	if (isstream) return 0;
+}
+
+addustring_replybuffer(rb,(unsigned char *)rb->browse.prefix,rb->browse.prefixlen);
+for (idx=start;idx<limit;idx++) {
+	if (addobject_browse(shared,rb,getchild_browse(rb,idx))) GOTOERROR;
+}
+if (settail_browse(rb,limit-start)) GOTOERROR;
+addustring_replybuffer(rb,(unsigned char *)rb->browse.tail,rb->browse.taillen);
+return 0;
 error:
-	return NULL;
+	return -1;
 }
 
-static void add404_replybuffer(struct replybuffer *rb) {
-(void)reset_replybuffer(rb);
-rb->isrange=0; rb->isexternal=0;
-rb->replycode=404;
-rb->replycodemsg="Not Found";
-strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
-addstring_replybuffer(rb,"File not found");
-rb->fullsize=rb->bufflen-rb->internal.left;
+static int metadata_browse(struct shared *shared, struct replybuffer *rb, unsigned int id) {
+// BrowseMetadata, a page of just the object
+rb->browse.prefix=PREFIX_BROWSE;
+rb->browse.prefixlen=sizeof(PREFIX_BROWSE)-1;
+rb->browse.action="Browse";
+if (!id) { // the root's parentID is -1, the cached one has 0
+	struct container_shared *c;
+	unsigned int childcount=shared->live.count;
+	if (shared->options.iscontainers && (c=find_containers(shared,0))) {
+		childcount=c->childcount;
+		rb->browse.updateid=c->updateid;
+	}
+	addustring_replybuffer(rb,(unsigned char *)rb->browse.prefix,rb->browse.prefixlen);
+	addstring_replybuffer(rb,"&lt;container id=\"0\" parentID=\"-1\" restricted=\"1\" childCount=\"");
+	adduint_replybuffer(rb,childcount);
+	addstring_replybuffer(rb,"\"&gt;&lt;dc:title&gt;root&lt;/dc:title&gt;&lt;upnp:class&gt;object.container.storageFolder&lt;/upnp:class&gt;&lt;/container&gt;");
+	rb->browse.childcount=1;
+	if (settail_browse(rb,1)) GOTOERROR;
+	addustring_replybuffer(rb,(unsigned char *)rb->browse.tail,rb->browse.taillen);
+	return 0;
+}
+if (id<FIRSTID_CONTAINER_SHARED) {
+	if ((id>shared->max_files) || shared->files[id-1]->isremoved) {
+		(void)addupnperror_replybuffer(rb,701,"No such object");
+		return 0;
+	}
+	(void)setparent_browse(rb,shared->options.iscontainers?shared->containers.allid:0);
+} else {
+	struct container_shared *c;
+	if (!shared->options.iscontainers || !(c=find_containers(shared,id))) {
+		(void)addupnperror_replybuffer(rb,701,"No such object");
+		return 0;
+	}
+	rb->browse.updateid=c->updateid;
+}
+rb->browse.objectid=id;
+rb->browse.children=&rb->browse.objectid;
+rb->browse.childcount=1;
+return addpage_browse(shared,rb,0,1);
+error:
+	return -1;
 }
 
-static void add500_replybuffer(struct replybuffer *rb) {
-(void)reset_replybuffer(rb);
-rb->isrange=0; rb->isexternal=0;
-rb->replycode=500;
-rb->replycodemsg="Server Error";
-strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
-addstring_replybuffer(rb,"Internal server error");
-rb->fullsize=rb->bufflen-rb->internal.left;
+static int handle_browse(struct shared *shared, struct request *request, struct replybuffer *rb) {
+struct browsevars vars;
+unsigned int objectid;
+int sortkey,isreverse;
+
+if (shared->options.ismergefiles) {
+	return mergefiles_browse(shared,rb);
 }
 
-static int getrequest(int *istimeout_errorout, struct shared *shared, struct request *request, int fd, struct lineio *lineio,
-		time_t expires) {
-// lineio is using shared.buff512, don't use buff512 here
-int istimeouterror=0;
+// POST is in replybuffer.buff, 0-term
+(ignore)getbrowsevars(&vars,shared,"Browse",(char *)rb->buff,request->postlen);
+objectid=vars.objectid;
+(ignore)parse_sort(&sortkey,&isreverse,vars.sort);
 
-while (1) {
-	unsigned int linelen;
-	char *line;
-	line=(char *)gets_lineio(&istimeouterror,&linelen,lineio,fd,expires);
-	if (!line) {
-		if (istimeouterror) goto error;
-		GOTOERROR;
-	} else {
-		if (!linelen) GOTOERROR; // can't happen
-		linelen--;
-		line[linelen]=0;
-		if (linelen) {
-			linelen--;
-			if (line[linelen]=='\r') line[linelen]=0;
+(void)reset_replybuffer(rb);
+rb->browse.props=parse_filter(vars.filter);
+rb->browse.updateid=shared->updateid;
+if (vars.ismetadata) return metadata_browse(shared,rb,objectid);
+
+if (shared->options.iscontainers) {
+	struct container_shared *c;
+	if ((c=find_containers(shared,objectid))) {
+		rb->browse.children=c->children;
+		rb->browse.childcount=c->childcount;
+		rb->browse.updateid=c->updateid;
+		if ((sortkey>=0) && c->childcount) {
+			if (children_sort(&rb->browse.found,shared,c->children,c->childcount,sortkey,isreverse)) GOTOERROR;
+			rb->browse.children=rb->browse.found;
 		}
+	} else { // unknown or an item, nothing under it
+		rb->browse.children=&rb->browse.childcount;
+		rb->browse.childcount=0;
 	}
-	if (!line[0]) break;
-	
-	PACKET_DUMP("",line);
-	if (!memcmp("GET ",line,4)) {
-		char *linep4=line+4;
-#ifdef DEBUG
-		fprintf(stderr,"%s:%d %s\n",__FILE__,__LINE__,line);
-#endif
-		if (!strncmp(linep4,"/root.xml",9)) request->fileindex=ROOTXML_FILEINDEX_REQUEST;
-		else if (!strncmp(linep4,"/icon.png",9)) request->fileindex=ICONPNG_FILEINDEX_REQUEST;
-		else if (!strncmp(linep4,"/flac.",6)) {
-			request->fileindex=ONEFLAC_FILEINDEX_REQUEST;
-			request->file=getfile(shared,linep4+6);
-		} else if (!strncmp(linep4,"/wav.",5)) {
-			request->fileindex=ONEWAV_FILEINDEX_REQUEST;
-			request->file=getfile(shared,linep4+5);
-		} else if (!strncmp(linep4,"/mp3.",5)) {
-			request->fileindex=ONEMP3_FILEINDEX_REQUEST;
-			request->file=getfile(shared,linep4+5);
-		} else if (!strncmp(linep4,"/mp4.",5)) {
-			request->fileindex=ONEMP4_FILEINDEX_REQUEST;
-			request->file=getfile(shared,linep4+5);
-		} else if (!strncmp(linep4,"/contentdir.browse",18)) {
-			strcpy(request->soapaction,"#Browse");
-			request->fileindex=CONTENTDIR_FILEINDEX_REQUEST;
-		} else if (!strncmp(linep4,"/merge.",7)) {
-			request->fileindex=MERGE_FILEINDEX_REQUEST;
-		} else {
-			log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
-			GOTOERROR;
-		}
-	} else if (!memcmp("POST",line,4)) {
-		char *linep5=line+5;
-#ifdef DEBUG
-		fprintf(stderr,"%s:%d %s\n",__FILE__,__LINE__,line);
-#endif
-		if (!strncmp(linep5,"/ctl/ContentDir",15)) request->fileindex=CONTENTDIR_FILEINDEX_REQUEST;
-		else {
-			log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
-			GOTOERROR;
-		}
-	} else if (!strncasecmp("content-",line,8)) {
-		char *linep8=line+8;
-		if (!strncasecmp(linep8,"length:",7)) {
-			char *temp=linep8+7;
-			while (isspace(*temp)) temp++;
-			request->postlen=slowtou(temp);
-		} else if (!strncasecmp(linep8,"type:",5)) {
-// we should get text/xml for POST upnp requests, we could check that if we ever read it
-//			fprintf(stderr,"%s:%d content type: \"%s\"\n",__FILE__,__LINE__,linep8+5);
-		} else {
-			log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
-		}
-	} else if (!strncasecmp("host:",line,5)) {
-		// ignore host: hostname
-	} else if (!strncasecmp("accept:",line,7)) {
-		// ignore accept: */*
-	} else if (!strncasecmp("user-agent:",line,11)) {
-//		fprintf(stderr,"%s:%d user-agent: \"%s\"\n",__FILE__,__LINE__,line+11);
-	} else if (!strncasecmp("soapaction:",line,11)) {
-		char *temp;
-		for (temp=line+11;isspace(*temp);temp++);
-		strncpy(request->soapaction,temp,MAX_SOAPACTION_REQUEST);
-	} else if (!strncasecmp("range:",line,6)) {
-		request->isrange=1;
-		if (parserange(request,line+6)) GOTOERROR;
-	} else if (!strncasecmp("connection:",line,11)) {
-//		fprintf(stderr,"%s:%d connection: \"%s\"\n",__FILE__,__LINE__,line+11);
-	} else if (!strncasecmp("accept-encoding:",line,16)) {
-//		fprintf(stderr,"%s:%d accept-encoding: \"%s\"\n",__FILE__,__LINE__,line+16);
-	} else {
-		log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
+} else { // everything is under the root
+	objectid=0;
+	rb->browse.children=shared->live.ids;
+	rb->browse.childcount=shared->live.count;
+	if (sortkey>=0) {
+		rb->browse.children=shared->sort.order[sortkey];
+		rb->browse.isreverse=isreverse;
 	}
 }
-return 0;
+(void)setparent_browse(rb,objectid);
+rb->browse.prefix=PREFIX_BROWSE;
+rb->browse.prefixlen=sizeof(PREFIX_BROWSE)-1;
+rb->browse.action="Browse";
+
+return addpage_browse(shared,rb,vars.start,vars.max);
 error:
-	*istimeout_errorout=istimeouterror;
 	return -1;
 }
 
-int makereply(struct shared *shared, struct request *request, struct replybuffer *replybuffer) {
+static int handle_search(struct shared *shared, struct request *request, struct replybuffer *rb) {
+struct browsevars vars;
+int sortkey,isreverse,isinvalid;
 
-replybuffer->isrange=request->isrange;
-replybuffer->range.start=request->rangestart;
-replybuffer->range.limit=request->rangelimit;
+(ignore)getbrowsevars(&vars,shared,"Search",(char *)rb->buff,request->postlen);
+(ignore)parse_sort(&sortkey,&isreverse,vars.sort);
 
-switch (request->fileindex) {
-	case ROOTXML_FILEINDEX_REQUEST:
+(void)reset_replybuffer(rb);
+rb->browse.props=parse_filter(vars.filter);
+rb->browse.updateid=shared->updateid;
+
+if (find_search(&rb->browse.found,&rb->browse.childcount,&isinvalid,shared,vars.criteria,vars.objectid,
+		(sortkey>=0)?shared->sort.order[sortkey]:NULL)) GOTOERROR;
+if (isinvalid) { // a missing SearchCriteria isn't "*"
+	(void)addupnperror_replybuffer(rb,402,"Invalid Args");
+	return 0;
+}
+rb->browse.children=rb->browse.found;
+rb->browse.isreverse=isreverse;
+(void)setparent_browse(rb,vars.objectid);
+rb->browse.prefix=PREFIX_SEARCH;
+rb->browse.prefixlen=sizeof(PREFIX_SEARCH)-1;
+rb->browse.action="Search";
+
+return addpage_browse(shared,rb,vars.start,vars.max);
+error:
+	return -1;
+}
+
+static int handle_searchcaps(struct shared *shared, struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+addstring_replybuffer(rb,ENVELOPE_CONTENTDIR);
+addstring_replybuffer(rb,"<s:Body><u:GetSearchCapabilitiesResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">");
+addstring_replybuffer(rb,"<SearchCaps>" CAPS_SEARCH "</SearchCaps>");
+addstring_replybuffer(rb,"</u:GetSearchCapabilitiesResponse></s:Body></s:Envelope>\r\n");
+return 0;
+}
+
+static int handle_sortcaps(struct shared *shared, struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+addstring_replybuffer(rb,ENVELOPE_CONTENTDIR);
+addstring_replybuffer(rb,"<s:Body><u:GetSortCapabilitiesResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">");
+addstring_replybuffer(rb,"<SortCaps>" CAPS_SORT "</SortCaps>");
+addstring_replybuffer(rb,"</u:GetSortCapabilitiesResponse></s:Body></s:Envelope>\r\n");
+return 0;
+}
+
+static int handle_updateid(struct shared *shared, struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+addstring_replybuffer(rb,ENVELOPE_CONTENTDIR);
+addstring_replybuffer(rb,"<s:Body><u:GetSystemUpdateIDResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\"><Id>");
+adduint_replybuffer(rb,shared->updateid);
+addstring_replybuffer(rb,"</Id></u:GetSystemUpdateIDResponse></s:Body></s:Envelope>\r\n");
+return 0;
+}
+
+static int handle_contentdir(struct shared *shared, struct request *request, struct replybuffer *rb) {
+if (strstr(request->soapaction,"#Browse")) return handle_browse(shared,request,rb);
+if (strstr(request->soapaction,"#Search")) return handle_search(shared,request,rb);
+if (strstr(request->soapaction,"#GetSearchCapabilities")) return handle_searchcaps(shared,rb);
+if (strstr(request->soapaction,"#GetSortCapabilities")) return handle_sortcaps(shared,rb);
+if (strstr(request->soapaction,"#GetSystemUpdateID")) return handle_updateid(shared,rb);
+#ifdef DEBUG
+fprintf(stderr,"%s:%d unknown soapaction: \"%s\"\n",__FILE__,__LINE__,request->soapaction);
+#endif
+return -1;
+}
+
+static void markprops_didl(struct file_shared *file) {
+// finds where each optional property starts in the cached item, a missing one is empty
+static char *tags[COUNT_PROPS_DIDL]={"&lt;dc:description&gt;","&lt;dc:date&gt;","&lt;upnp:artist&gt;","&lt;upnp:album&gt;",
+		"&lt;upnp:originalTrackNumber&gt;","&lt;res ","&lt;upnp:albumArtURI "};
+unsigned int end;
+int k;
+
+end=file->didllen-(sizeof("&lt;/item&gt;")-1);
+file->didlprops[COUNT_PROPS_DIDL]=end;
+for (k=COUNT_PROPS_DIDL-1;k>=0;k--) {
+	char *tag;
+	tag=memmem(file->didl,end,tags[k],strlen(tags[k]));
+	file->didlprops[k]=tag?tag-file->didl:file->didlprops[k+1];
+}
+}
+
+int render_httpd(struct shared *shared) {
+// escape and format each item once, browse just copies them
+struct replybuffer rb;
+unsigned int idx;
+
+clear_replybuffer(&rb);
+if (init_replybuffer(&rb,SIZE_DIDL_HTTPD)) GOTOERROR;
+for (idx=0;idx<shared->max_files;idx++) {
+	struct file_shared *file=shared->files[idx];
+	unsigned int len;
+
+	unsigned char *parent;
+
+	if (file->didl || file->isremoved) continue;
+	(void)reset_replybuffer(&rb);
+	rb.iserror=0;
+	if (additem_browse(shared,&rb,idx,"0",ALL_PROPS_DIDL)) GOTOERROR;
+	if (rb.iserror) {
+		log_shared(shared,1,"%s:%d not caching browse item for \"%s\"\n",__FILE__,__LINE__,file->filename);
+		continue;
+	}
+	len=rb.bufflen-rb.internal.left;
+	if (!(parent=memmem(rb.buff,len,"parentID=\"",10))) GOTOERROR;
+	if (!(file->didl=(char *)memdup_blockmem(&shared->blockmem,rb.buff,len))) GOTOERROR;
+	file->didllen=len;
+	file->didlparent=parent+10-rb.buff;
+	markprops_didl(file);
+}
+for (idx=0;idx<shared->containers.count;idx++) {
+	struct container_shared *c=&shared->containers.list[idx];
+	unsigned int len;
+
+	if (c->didl) continue;
+	(void)reset_replybuffer(&rb);
+	rb.iserror=0;
+	(void)addcontainer_browse(shared,&rb,idx);
+	if (rb.iserror) continue;
+	len=rb.bufflen-rb.internal.left;
+	if (!(c->didl=(char *)memdup_blockmem(shared->derived,rb.buff,len))) GOTOERROR;
+	c->didllen=len;
+}
+free(rb.buff);
+return 0;
+error:
+	iffree(rb.buff);
+	return -1;
+}
+
+static int parserange(struct request *req, char *str) {
+// handles "bytes=a-b,c-,-n", sizes aren't known yet so this just records them
+unsigned int count=0;
+
+while(isspace(*str)) str++;
+if (strncasecmp(str,"bytes=",6)) GOTOERROR;
+str+=6;
+while (1) {
+	struct rangespec_request *spec;
+
+	while (isspace(*str)) str++;
+	if (!*str) break;
+	if (*str==',') { str++; continue; }
+	if (count==MAX_RANGES_HTTPD) GOTOERROR; // we'll send it all instead
+	spec=&req->ranges[count];
+	memset(spec,0,sizeof(struct rangespec_request));
+	if (*str=='-') {
+		str++;
+		if (!isdigit(*str)) GOTOERROR;
+		spec->issuffix=1;
+		spec->last=slowtou64(str);
+	} else {
+		if (!isdigit(*str)) GOTOERROR;
+		spec->first=slowtou64(str);
+		while (isdigit(*str)) str++;
+		while (isspace(*str)) str++;
+		if (*str!='-') GOTOERROR;
+		str++;
+		while (isspace(*str)) str++;
+		if (isdigit(*str)) {
+			spec->last=slowtou64(str);
+			if (spec->last<spec->first) GOTOERROR;
+		} else {
+			spec->isopen=1;
+		}
+	}
+	while (isdigit(*str)) str++;
+	while (isspace(*str)) str++;
+	if (*str && (*str!=',')) GOTOERROR;
+	count++;
+}
+if (!count) GOTOERROR;
+req->rangecount=count;
+req->isrange=1;
+return 0;
+error:
+	return -1;
+}
+
+static int parsenpt(uint64_t *ms_out, char **str_inout) {
+// "123.456" or "1:02:03.456", in ms
+char *str=*str_inout;
+uint64_t seconds=0,ms=0;
+unsigned int scale=100;
+
+if (!isdigit(*str)) GOTOERROR; // "now" isn't meaningful for files
+while (1) {
+	uint64_t part=0;
+	while (isdigit(*str)) { part=part*10+(*str-'0'); str++; }
+	if (*str!=':') {
+		seconds+=part;
+		break;
+	}
+	seconds=(seconds+part)*60;
+	str++;
+}
+if (*str=='.') {
+	for (str++;isdigit(*str);str++) {
+		ms+=(*str-'0')*scale;
+		scale/=10;
+	}
+}
+*ms_out=seconds*1000+ms;
+*str_inout=str;
+return 0;
+error:
+	return -1;
+}
+
+static int parsetimeseek(struct request *req, char *str) {
+// handles "npt=START-" and "npt=START-END"
+while (isspace(*str)) str++;
+if (strncasecmp(str,"npt=",4)) GOTOERROR;
+str+=4;
+if (parsenpt(&req->seekstart,&str)) GOTOERROR;
+if (*str!='-') GOTOERROR;
+str++;
+if (isdigit(*str)) {
+	if (parsenpt(&req->seekend,&str)) GOTOERROR;
+	if (req->seekend<=req->seekstart) GOTOERROR;
+	req->isseekend=1;
+}
+req->istimeseek=1;
+return 0;
+error:
+	return -1;
+}
+
+static struct file_shared *getfile(struct shared *shared, char *str) {
+struct file_shared *file;
+unsigned int u32;
+u32=slowtou(str);
+if (u32>=shared->max_files) GOTOERROR;
+file=shared->files[u32];
+if (file->isremoved) GOTOERROR;
+return file;
+error:
+	return NULL;
+}
+
+static void add404_replybuffer(struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=404;
+rb->replycodemsg="Not Found";
+strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
+addstring_replybuffer(rb,"File not found");
+rb->fullsize=rb->bufflen-rb->internal.left;
+}
+
+static void add500_replybuffer(struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=500;
+rb->replycodemsg="Server Error";
+strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
+addstring_replybuffer(rb,"Internal server error");
+rb->fullsize=rb->bufflen-rb->internal.left;
+}
+
+static void add416_replybuffer(struct replybuffer *rb) {
+rb->ranges.fullsize=rb->fullsize;
+(void)reset_replybuffer(rb);
+ifclose(rb->external.fd);
+rb->external.fd=-1;
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=416;
+rb->replycodemsg="Range Not Satisfiable";
+strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
+rb->fullsize=0;
+}
+
+static void add406_replybuffer(struct replybuffer *rb) {
+(void)reset_replybuffer(rb);
+ifclose(rb->external.fd);
+rb->external.fd=-1;
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=406;
+rb->replycodemsg="Not Acceptable";
+strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
+rb->fullsize=0;
+}
+
+static void add503_replybuffer(struct replybuffer *rb, unsigned int retryafter) {
+(void)reset_replybuffer(rb);
+rb->isrange=0; rb->isexternal=0;
+rb->replycode=503;
+rb->replycodemsg="Service Unavailable";
+rb->retryafter=retryafter;
+strcpy(rb->contenttype,"Content-Type: text/plain\r\n");
+rb->fullsize=0;
+}
+
+static void setranges_replybuffer(struct replybuffer *rb, struct request *request) {
+// resolves the requested ranges now that we know the size
+uint64_t fullsize=rb->fullsize;
+unsigned int ui,count=0;
+
+for (ui=0;ui<request->rangecount;ui++) {
+	struct rangespec_request *spec=&request->ranges[ui];
+	struct range_replybuffer *r;
+	uint64_t start,limit;
+
+	if (spec->issuffix) {
+		if (!spec->last) continue;
+		start=(spec->last<fullsize)?fullsize-spec->last:0;
+		limit=fullsize;
+	} else {
+		start=spec->first;
+		limit=(spec->isopen || (spec->last>=fullsize))?fullsize:spec->last+1;
+	}
+	if (start>=limit) continue; // start is past the end
+	if (count) { // merge overlapping or touching ascending ranges, players shouldn't send them but it's cheap
+		r=&rb->ranges.list[count-1];
+		if ((start>=r->start) && (start<=r->limit)) {
+			if (limit>r->limit) r->limit=limit;
+			continue;
+		}
+	}
+	r=&rb->ranges.list[count];
+	r->start=start;
+	r->limit=limit;
+	count++;
+}
+if (!count) {
+	(void)add416_replybuffer(rb);
+	return;
+}
+rb->isrange=1;
+rb->ranges.count=count;
+rb->ranges.fullsize=fullsize;
+}
+
+static void npt_replybuffer(char *buff, uint64_t ms) {
+snprintf(buff,32,"%"PRIu64".%03u",ms/1000,(unsigned int)(ms%1000));
+}
+
+static void settimeseek_replybuffer(struct replybuffer *rb, struct request *request) {
+// maps TimeSeekRange onto a byte range that starts and ends on frame boundaries
+struct meta_file_shared *meta=request->file->meta;
+struct stream_flacheader stream;
+uint64_t target,start,limit,sample,duration,endms;
+char startstr[32],endstr[32],durationstr[32];
+
+if (!meta || !meta->samplerate) {
+	(void)add406_replybuffer(rb);
+	return;
+}
+stream.samples=meta->samples;
+stream.filesize=rb->fullsize;
+stream.audiooffset=meta->audiooffset;
+stream.samplerate=meta->samplerate;
+stream.blocksize=meta->blocksize;
+stream.seekpoints=meta->seekpoints;
+stream.seekcount=meta->seekcount;
+
+duration=(meta->samples*1000)/meta->samplerate;
+target=(request->seekstart*meta->samplerate)/1000;
+if (target>=meta->samples) {
+	(void)add416_replybuffer(rb);
+	return;
+}
+if (seek_flacheader(&start,&sample,rb->external.fd,&stream,target)) {
+	(void)add406_replybuffer(rb);
+	return;
+}
+limit=rb->fullsize;
+endms=duration;
+if (request->isseekend && (request->seekend<duration)) {
+	uint64_t offset,endsample;
+	target=(request->seekend*meta->samplerate)/1000;
+	if (seek_flacheader(&offset,&endsample,rb->external.fd,&stream,target)) {
+		(void)add406_replybuffer(rb);
+		return;
+	}
+	if (next_flacheader(&limit,rb->external.fd,&stream,offset)) limit=rb->fullsize;
+	endms=request->seekend;
+}
+rb->isrange=1;
+rb->ranges.count=1;
+rb->ranges.list[0].start=start;
+rb->ranges.list[0].limit=limit;
+rb->ranges.fullsize=rb->fullsize;
+
+(void)npt_replybuffer(startstr,(sample*1000)/meta->samplerate);
+(void)npt_replybuffer(endstr,endms);
+(void)npt_replybuffer(durationstr,duration);
+snprintf(rb->headers,SIZE_HEADERS_REPLYBUFFER,"TimeSeekRange.dlna.org: npt=%s-%s/%s bytes=%"PRIu64"-%"PRIu64"/%"PRIu64"\r\n",
+		startstr,endstr,durationstr,start,limit-1,rb->fullsize);
+}
+
+static void addfeatures_replybuffer(struct replybuffer *rb, struct request *request) {
+// answers getcontentFeatures.dlna.org
+struct file_shared *file=request->file;
+char *features=RANGE_FEATURES_HTTPD;
+unsigned int len;
+
+if (!file || rb->replycode) return;
+if ((file->type==FLAC_TYPE_FILE_SHARED) && file->meta && file->meta->samplerate) features=SEEK_FEATURES_HTTPD;
+len=strlen(rb->headers);
+snprintf(rb->headers+len,SIZE_HEADERS_REPLYBUFFER-len,"contentFeatures.dlna.org: %s\r\n",features);
+}
+
+static void chompline(char *line, unsigned int linelen) {
+// linelen includes the \n
+linelen--;
+line[linelen]=0;
+if (linelen) {
+	linelen--;
+	if (line[linelen]=='\r') line[linelen]=0;
+}
+}
+
+static int parseline_request(struct shared *shared, struct request *request, char *line) {
+PACKET_DUMP("",line);
+if (!memcmp("GET ",line,4) || !memcmp("HEAD ",line,5)) {
+	char *path;
+	if (*line=='H') {
+		request->ishead=1;
+		path=line+5;
+	} else {
+		path=line+4;
+	}
+#ifdef DEBUG
+	fprintf(stderr,"%s:%d %s\n",__FILE__,__LINE__,line);
+#endif
+	if (strstr(path," HTTP/1.0")) request->isclose=1;
+	if (!strncmp(path,"/root.xml",9)) request->fileindex=ROOTXML_FILEINDEX_REQUEST;
+	else if (!strncmp(path,"/icon.png",9)) request->fileindex=ICONPNG_FILEINDEX_REQUEST;
+	else if (!strncmp(path,"/flac.",6)) {
+		request->fileindex=ONEFLAC_FILEINDEX_REQUEST;
+		request->file=getfile(shared,path+6);
+	} else if (!strncmp(path,"/wav.",5)) {
+		request->fileindex=ONEWAV_FILEINDEX_REQUEST;
+		request->file=getfile(shared,path+5);
+	} else if (!strncmp(path,"/mp3.",5)) {
+		request->fileindex=ONEMP3_FILEINDEX_REQUEST;
+		request->file=getfile(shared,path+5);
+	} else if (!strncmp(path,"/mp4.",5)) {
+		request->fileindex=ONEMP4_FILEINDEX_REQUEST;
+		request->file=getfile(shared,path+5);
+	} else if (!strncmp(path,"/art.",5)) {
+		request->fileindex=ART_FILEINDEX_REQUEST;
+		request->file=getfile(shared,path+5);
+	} else if (!strncmp(path,"/contentdir.browse",18)) {
+		strcpy(request->soapaction,"#Browse");
+		request->fileindex=CONTENTDIR_FILEINDEX_REQUEST;
+	} else if (!strncmp(path,"/merge.",7)) {
+		request->fileindex=MERGE_FILEINDEX_REQUEST;
+	} else {
+		log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
+		GOTOERROR;
+	}
+} else if (!memcmp("POST",line,4)) {
+	char *linep5=line+5;
+#ifdef DEBUG
+	fprintf(stderr,"%s:%d %s\n",__FILE__,__LINE__,line);
+#endif
+	if (strstr(linep5," HTTP/1.0")) request->isclose=1;
+	if (!strncmp(linep5,"/ctl/ContentDir",15)) request->fileindex=CONTENTDIR_FILEINDEX_REQUEST;
+	else {
+		log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
+		GOTOERROR;
+	}
+} else if (!strncasecmp("content-",line,8)) {
+	char *linep8=line+8;
+	if (!strncasecmp(linep8,"length:",7)) {
+		char *temp=linep8+7;
+		while (isspace(*temp)) temp++;
+		request->postlen=slowtou(temp);
+	} else if (!strncasecmp(linep8,"type:",5)) {
+// we should get text/xml for POST upnp requests, we could check that if we ever read it
+//			fprintf(stderr,"%s:%d content type: \"%s\"\n",__FILE__,__LINE__,linep8+5);
+	} else {
+		log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
+	}
+} else if (!strncasecmp("host:",line,5)) {
+	// ignore host: hostname
+} else if (!strncasecmp("accept:",line,7)) {
+	// ignore accept: */*
+} else if (!strncasecmp("user-agent:",line,11)) {
+//		fprintf(stderr,"%s:%d user-agent: \"%s\"\n",__FILE__,__LINE__,line+11);
+} else if (!strncasecmp("soapaction:",line,11)) {
+	char *temp;
+	for (temp=line+11;isspace(*temp);temp++);
+	strncpy(request->soapaction,temp,MAX_SOAPACTION_REQUEST);
+} else if (!strncasecmp("range:",line,6)) {
+	if (parserange(request,line+6)) { // a bad Range is ignored
+		log_shared(shared,1,"%s:%d ignoring range: %s\n",__FILE__,__LINE__,line);
+		request->isrange=0;
+	}
+} else if (!strncasecmp("timeseekrange.dlna.org:",line,23)) {
+	if (parsetimeseek(request,line+23)) { // a bad TimeSeekRange is ignored
+		log_shared(shared,1,"%s:%d ignoring time seek: %s\n",__FILE__,__LINE__,line);
+		request->istimeseek=0;
+		request->isseekend=0;
+	}
+} else if (!strncasecmp("getcontentfeatures.dlna.org:",line,28)) {
+	if (strchr(line+28,'1')) request->isfeatures=1;
+} else if (!strncasecmp("transfermode.dlna.org:",line,22)) {
+	// ignore transfermode.dlna.org: Streaming
+} else if (!strncasecmp("connection:",line,11)) {
+	if (strcasestr(line+11,"close")) request->isclose=1;
+	else if (strcasestr(line+11,"keep-alive")) request->isclose=0;
+} else if (!strncasecmp("accept-encoding:",line,16)) {
+//		fprintf(stderr,"%s:%d accept-encoding: \"%s\"\n",__FILE__,__LINE__,line+16);
+} else {
+	log_shared(shared,1,"%s:%d unhandled header: %s\n",__FILE__,__LINE__,line);
+}
+return 0;
+error:
+	return -1;
+}
+
+static int getrequest(int *istimeout_errorout, struct shared *shared, struct request *request, int fd, struct lineio *lineio,
+		time_t expires) {
+int istimeouterror=0;
+
+while (1) {
+	unsigned int linelen;
+	char *line;
+	line=(char *)gets_lineio(&istimeouterror,&linelen,lineio,fd,expires);
+	if (!line) {
+		if (istimeouterror) goto error;
+		GOTOERROR;
+	}
+	if (!linelen) GOTOERROR; // can't happen
+	(void)chompline(line,linelen);
+	if (!line[0]) break;
+	if (parseline_request(shared,request,line)) GOTOERROR;
+}
+return 0;
+error:
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+int makereply(struct shared *shared, struct request *request, struct replybuffer *replybuffer) {
+
+replybuffer->ishead=request->ishead;
+switch (request->fileindex) {
+	case ROOTXML_FILEINDEX_REQUEST:
 		if (make_rootxml(shared,replybuffer)) GOTOERROR;
 		replybuffer->fullsize=replybuffer->bufflen-replybuffer->internal.left;
 		break;
@@ -758,44 +1746,58 @@ switch (request->fileindex) {
 		replybuffer->fullsize=replybuffer->bufflen-replybuffer->internal.left;
 		break;
 	case CONTENTDIR_FILEINDEX_REQUEST:
-		if (handle_browse(shared,request,replybuffer)) GOTOERROR;
-		replybuffer->fullsize=replybuffer->bufflen-replybuffer->internal.left;
+		if (handle_contentdir(shared,request,replybuffer)) GOTOERROR;
+		if (!replybuffer->browse.isstream) replybuffer->fullsize=replybuffer->bufflen-replybuffer->internal.left;
 		break;
 	case ONEFLAC_FILEINDEX_REQUEST:
 		if (!request->file) {
 			(void)add404_replybuffer(replybuffer);
+		} else if (request->ishead) {
+			(void)addhead_replybuffer(replybuffer,request->file,"audio/x-flac");
 		} else {
-			if (addfile_replybuffer(replybuffer,request->file->filename,"audio/x-flac",
-					request->isrange,request->rangestart,request->rangelimit)) GOTOERROR;
+			if (addfile_replybuffer(replybuffer,shared,request->file->filename,"audio/x-flac")) GOTOERROR;
+			if (request->istimeseek && !replybuffer->replycode) {
+				(void)settimeseek_replybuffer(replybuffer,request);
+				request->isrange=0; // TimeSeekRange wins over Range
+			}
 		}
 		break;
 	case ONEWAV_FILEINDEX_REQUEST:
 		if (!request->file) {
 			(void)add404_replybuffer(replybuffer);
+		} else if (request->ishead) {
+			(void)addhead_replybuffer(replybuffer,request->file,"audio/x-wav");
 		} else {
-			if (addfile_replybuffer(replybuffer,request->file->filename,"audio/x-wav",
-					request->isrange,request->rangestart,request->rangelimit)) GOTOERROR;
+			if (addfile_replybuffer(replybuffer,shared,request->file->filename,"audio/x-wav")) GOTOERROR;
 		}
 		break;
 	case ONEMP3_FILEINDEX_REQUEST:
 		if (!request->file) {
 			(void)add404_replybuffer(replybuffer);
+		} else if (request->ishead) {
+			(void)addhead_replybuffer(replybuffer,request->file,"audio/mpeg");
 		} else {
-			if (addfile_replybuffer(replybuffer,request->file->filename,"audio/mpeg",
-					request->isrange,request->rangestart,request->rangelimit)) GOTOERROR;
+			if (addfile_replybuffer(replybuffer,shared,request->file->filename,"audio/mpeg")) GOTOERROR;
 		}
 		break;
 	case ONEMP4_FILEINDEX_REQUEST:
+		if (!request->file) {
+			(void)add404_replybuffer(replybuffer);
+		} else if (request->ishead) {
+			(void)addhead_replybuffer(replybuffer,request->file,"video/mp4");
+		} else {
+			if (addfile_replybuffer(replybuffer,shared,request->file->filename,"video/mp4")) GOTOERROR;
+		}
+		break;
+	case ART_FILEINDEX_REQUEST:
 		if (!request->file) {
 			(void)add404_replybuffer(replybuffer);
 		} else {
-			if (addfile_replybuffer(replybuffer,request->file->filename,"video/mp4",
-					request->isrange,request->rangestart,request->rangelimit)) GOTOERROR;
+			if (addart_replybuffer(replybuffer,shared,request->file)) GOTOERROR;
 		}
 		break;
 	case MERGE_FILEINDEX_REQUEST:
-		if (addmerge_replybuffer(shared,replybuffer,request->isrange,request->rangestart,request->rangelimit)) GOTOERROR;
-		replybuffer->fullsize=replybuffer->bufflen-replybuffer->internal.left;
+		if (addmerge_replybuffer(shared,replybuffer)) GOTOERROR;
 		break;
 	default:
 		(void)add404_replybuffer(replybuffer);
@@ -804,160 +1806,417 @@ switch (request->fileindex) {
 
 if (replybuffer->iserror) {
 	(void)add500_replybuffer(replybuffer);
+} else if (request->isrange && !replybuffer->replycode && !replybuffer->browse.isstream) {
+	(void)setranges_replybuffer(replybuffer,request);
 }
+if (request->isfeatures) (void)addfeatures_replybuffer(replybuffer,request);
 return 0;
 error:
 	return -1;
 }
 
-static int offsetfilename_readn(char *filename, uint64_t offset, unsigned char *dest, unsigned int n) {
-int fd=-1;
+struct mergecursor {
+	unsigned int idx; // index into shared->files
+	uint64_t fileoffset;
+	int fd; // open fd for shared->files[idx], -1 if not yet opened
+	int pipefds[2];
+	unsigned int inpipe; // only used by nbsend_mergecursor
+	int isnosplice;
+	struct readahead readahead; // for fd
+};
+
+static inline void clear_mergecursor(struct mergecursor *mc) {
+static struct mergecursor blank={.fd=-1,.pipefds[0]=-1,.pipefds[1]=-1,.readahead.fd=-1};
+*mc=blank;
+}
+
+static int init_mergecursor(struct mergecursor *mc, struct shared *shared, uint64_t offset) {
+unsigned int idx;
+
+for (idx=0;idx<shared->max_files;idx++) {
+	struct file_shared *file;
+	file=shared->files[idx];
+	if (offset<file->size) break;
+	offset-=file->size;
+}
+if (idx==shared->max_files) GOTOERROR;
+mc->idx=idx;
+mc->fileoffset=offset;
 
-if (0>(fd=open(filename,O_RDONLY))) GOTOERROR;
-if (offset) {
-	if (0>lseek(fd,offset,SEEK_SET)) GOTOERROR;
+if (pipe(mc->pipefds)) {
+	mc->pipefds[0]=mc->pipefds[1]=-1;
+	mc->isnosplice=1;
+} else {
+	(ignore)fcntl(mc->pipefds[1],F_SETPIPE_SZ,1024*1024); // fewer splice calls, if we're allowed
 }
-if (readn(fd,dest,n)) GOTOERROR;
-(ignore)close(fd);
 return 0;
 error:
-	ifclose(fd);
 	return -1;
 }
 
-static int merge_readn(struct shared *shared, uint64_t offset, unsigned char *dest, unsigned int destlen) {
-unsigned int idx,idxlimit,left;
+static void deinit_mergecursor(struct mergecursor *mc) {
+ifclose(mc->fd);
+ifclose(mc->pipefds[0]);
+ifclose(mc->pipefds[1]);
+}
+
+static struct file_shared *getfile_mergecursor(struct mergecursor *mc, struct shared *shared) {
+// returns the file under the cursor, with mc->fd open
+struct file_shared *file;
 
-idxlimit=shared->max_files;
-if (!idxlimit) GOTOERROR;
-idx=0;
-left=destlen;
 while (1) {
-	struct file_shared *file;
-	unsigned int n,fileremains;
+	if (mc->idx>=shared->max_files) GOTOERROR;
+	file=shared->files[mc->idx];
+	if (mc->fileoffset<file->size) break;
+	ifclose(mc->fd);
+	mc->fd=-1;
+	clear_readahead(&mc->readahead);
+	mc->idx+=1;
+	mc->fileoffset=0;
+}
+if (mc->fd<0) {
+	if (0>(mc->fd=open(file->filename,O_RDONLY))) GOTOERROR;
+}
+return file;
+error:
+	return NULL;
+}
 
-	file=shared->files[idx];
-	if (file->size<=offset) {
-		offset-=file->size;
-		idx++;
-		if (idx==idxlimit) GOTOERROR;
+static void readahead_mergecursor(struct mergecursor *mc, struct file_shared *file) {
+if (mc->readahead.fd<0) (void)start_readahead(&mc->readahead,mc->fd,mc->fileoffset,file->size);
+else (void)step_readahead(&mc->readahead,mc->fileoffset,file->size);
+}
+
+static int read_mergecursor(unsigned int *len_out, struct mergecursor *mc, struct shared *shared, unsigned char *dest,
+		unsigned int maxlen) {
+// reads up to maxlen, stopping at the end of the current file
+struct file_shared *file;
+uint64_t n;
+
+if (!(file=getfile_mergecursor(mc,shared))) GOTOERROR;
+n=file->size-mc->fileoffset;
+if (n>maxlen) n=maxlen;
+if (0>lseek(mc->fd,mc->fileoffset,SEEK_SET)) GOTOERROR;
+if (readn(mc->fd,dest,n)) GOTOERROR;
+mc->fileoffset+=n;
+*len_out=n;
+return 0;
+error:
+	return -1;
+}
+
+static int send_mergecursor(int *istimeout_errorout, struct mergecursor *mc, struct shared *shared, struct replybuffer *rb,
+		int fd_out, uint64_t len, time_t expires) {
+int istimeouterror=0;
+
+while (len) {
+	struct file_shared *file;
+	struct uring *ring;
+	uint64_t n;
+
+	if (mc->isnosplice) {
+		unsigned int got;
+		n=len;
+		if (n>rb->bufflen) n=rb->bufflen;
+		if (read_mergecursor(&got,mc,shared,rb->buff,n)) GOTOERROR;
+		if (timeout_writen(&istimeouterror,fd_out,rb->buff,got,expires)) GOTOERROR;
+		len-=got;
 		continue;
 	}
-	n=left;
-	fileremains=file->size-offset;
-	if (n>fileremains) n=fileremains;
-	if (offsetfilename_readn(file->filename,offset,dest,n)) GOTOERROR;
 
+	if (!(file=getfile_mergecursor(mc,shared))) GOTOERROR;
+	n=file->size-mc->fileoffset;
+	if (n>len) n=len;
+	(void)readahead_mergecursor(mc,file);
+	if ((ring=getring(shared))) {
+		if (stream_uring(&istimeouterror,ring,fd_out,mc->fd,mc->fileoffset,n,rb->buff,rb->bufflen,30,&mc->readahead)) GOTOERROR;
+	} else {
+		uint64_t offset;
+		int isunsupported=0;
+		offset=mc->fileoffset;
+		if (timeout_splice(&istimeouterror,&isunsupported,fd_out,mc->fd,&offset,n,mc->pipefds,expires)) {
+			if (!isunsupported) GOTOERROR;
+			log_shared(shared,1,"%s:%d splice unsupported, copying instead\n",__FILE__,__LINE__);
+			mc->isnosplice=1;
+			len-=offset-mc->fileoffset;
+			mc->fileoffset=offset;
+			continue;
+		}
+	}
+	mc->fileoffset+=n;
+	len-=n;
+}
+return 0;
+error:
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+static int nbsend_mergecursor(int *isagain_out, uint64_t *sent_out, struct mergecursor *mc, struct shared *shared,
+		int fd_out, uint64_t len) {
+// fd_out is nonblocking, len counts what's still in the pipe
+// returns 0 when len is sent or when splice turns out to be unsupported (mc->isnosplice is set)
+uint64_t sent=0;
+
+while (len) {
+	ssize_t k;
+	if (mc->inpipe) {
+		k=splice(mc->pipefds[0],NULL,fd_out,NULL,mc->inpipe,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (k<1) {
+			if (!k) GOTOERROR;
+			if (errno==EINTR) continue;
+			if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+				*sent_out=sent;
+				*isagain_out=1;
+				return -1;
+			}
+			GOTOERROR;
+		}
+		mc->inpipe-=k;
+		sent+=k;
+		len-=k;
+	} else {
+		struct file_shared *file;
+		loff_t offset;
+		uint64_t n;
+		if (!(file=getfile_mergecursor(mc,shared))) GOTOERROR;
+		n=file->size-mc->fileoffset;
+		if (n>len) n=len;
+		(void)readahead_mergecursor(mc,file);
+		offset=mc->fileoffset;
+		k=splice(mc->fd,&offset,mc->pipefds[1],NULL,n,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (k<1) {
+			if (!k) GOTOERROR;
+			if (errno==EINTR) continue;
+			if ((errno==EINVAL)||(errno==ENOSYS)) {
+				log_shared(shared,1,"%s:%d splice unsupported, copying instead\n",__FILE__,__LINE__);
+				mc->isnosplice=1;
+				break;
+			}
+			GOTOERROR;
+		}
+		mc->fileoffset=offset;
+		mc->inpipe=k;
+	}
+}
+*sent_out=sent;
+return 0;
+error:
+	*sent_out=sent;
+	*isagain_out=0;
+	return -1;
+}
+
+static int sendmerge(int *istimeout_errorout, struct shared *shared, struct replybuffer *rb, int fd_out,
+		uint64_t offset, uint64_t left) {
+struct mergecursor mergecursor;
+int istimeouterror=0;
+
+clear_mergecursor(&mergecursor);
+
+if (!left) return 0;
+if (init_mergecursor(&mergecursor,shared,offset)) GOTOERROR;
+while (left) {
+	uint64_t n;
+	n=left;
+	if (n>rb->bufflen) n=rb->bufflen;
+	if (send_mergecursor(&istimeouterror,&mergecursor,shared,rb,fd_out,n,time(NULL)+30)) {
+		if (istimeouterror) GOTOERROR;
+		GOTOERROR;
+	}
+#ifdef DEBUG
+	rb->debug.byteswritten+=n;
+#endif
 	left-=n;
-	if (!left) break;
-	idx++;
-	dest+=n;
-	offset=0;
 }
+deinit_mergecursor(&mergecursor);
 return 0;
 error:
+	deinit_mergecursor(&mergecursor);
+	*istimeout_errorout=istimeouterror;
 	return -1;
 }
 
-static int sendreply(int *istimeout_errorout, struct shared *shared, struct request *request, struct replybuffer *replybuffer,
-		int fd_in) {
-char datestr[30];
-char *buff;
+static int makepartheader_replybuffer(unsigned int *len_out, char *buff, unsigned int buffsize, struct replybuffer *rb,
+		unsigned int idx) {
+// for multipart/byteranges, idx==rb->ranges.count gives the closing boundary
+struct range_replybuffer *r;
 int len;
-int istimeouterror=0;
 
-buff=(char *)shared->buff512;
+if (idx==rb->ranges.count) {
+	len=snprintf(buff,buffsize,"\r\n--"BOUNDARY_HTTPD"--\r\n");
+} else {
+	r=&rb->ranges.list[idx];
+	len=snprintf(buff,buffsize,"\r\n--"BOUNDARY_HTTPD"\r\n"\
+			"%s"\
+			"Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64"\r\n"\
+			"\r\n",
+			rb->contenttype,
+			r->start,r->limit-1,rb->ranges.fullsize);
+}
+if ((len<0)||(len>=buffsize)) GOTOERROR;
+*len_out=len;
+return 0;
+error:
+	return -1;
+}
 
-(void)httpctime_misc(datestr,time(NULL));
+static int getcontentlength_replybuffer(uint64_t *len_out, struct replybuffer *rb) {
+uint64_t u64=0;
+unsigned int ui;
 
-if (replybuffer->isrange) {
-	if (replybuffer->range.start>replybuffer->fullsize) replybuffer->range.start=replybuffer->fullsize;
-	if (!replybuffer->range.limit) replybuffer->range.limit=replybuffer->fullsize;
-	else if (replybuffer->range.limit>replybuffer->fullsize) replybuffer->range.limit=replybuffer->fullsize;
+if (!rb->isrange) {
+	*len_out=rb->fullsize;
+	return 0;
+}
+if (rb->ranges.count==1) {
+	*len_out=rb->ranges.list[0].limit-rb->ranges.list[0].start;
+	return 0;
+}
+for (ui=0;ui<=rb->ranges.count;ui++) {
+	char buff[256];
+	unsigned int len;
+	if (makepartheader_replybuffer(&len,buff,256,rb,ui)) GOTOERROR;
+	u64+=len;
+	if (ui<rb->ranges.count) u64+=rb->ranges.list[ui].limit-rb->ranges.list[ui].start;
+}
+*len_out=u64;
+return 0;
+error:
+	return -1;
 }
 
+static int makeheader_replybuffer(unsigned int *len_out, char *buff, unsigned int buffsize, struct shared *shared,
+		struct replybuffer *replybuffer) {
+char datestr[30];
+char extrastr[80];
+char *connection,*contenttype;
+uint64_t contentlength;
+int len;
+
+(void)httpctime_misc(datestr,time(NULL));
+connection=(replybuffer->isclose)?"close":"keep-alive";
+if (getcontentlength_replybuffer(&contentlength,replybuffer)) GOTOERROR;
+contenttype=replybuffer->contenttype;
+extrastr[0]=0;
+
 if (replybuffer->replycode) {
-	len=snprintf(buff,512,"HTTP/1.1 %u %s\r\n"\
+	if (replybuffer->replycode==416) {
+		snprintf(extrastr,80,"Content-Range: bytes */%"PRIu64"\r\n",replybuffer->ranges.fullsize);
+	} else if (replybuffer->retryafter) {
+		snprintf(extrastr,80,"Retry-After: %u\r\n",replybuffer->retryafter);
+	}
+	len=snprintf(buff,buffsize,"HTTP/1.1 %u %s\r\n"\
+			"%s"\
 			"%s"\
-			"Connection: close\r\n"\
+			"Connection: %s\r\n"\
+			"Content-Length: %"PRIu64"\r\n"\
 			"Server: %s DLNADOC/1.50 UPnP/1.0 %s\r\n"\
 			"Date: %s\r\n"\
 			"EXT:\r\n"\
 			"\r\n",
 			replybuffer->replycode, replybuffer->replycodemsg,
-			replybuffer->contenttype,
+			contenttype,
+			extrastr,
+			connection,
+			contentlength,
 			shared->server.machine,shared->server.version,
 			datestr);
 } else if (replybuffer->isrange) {
-	if (replybuffer->range.start==replybuffer->fullsize) {
-		len=snprintf(buff,512,"HTTP/1.1 206 Partial Content\r\n"\
-				"%s"\
-				"Connection: close\r\n"\
-				"Content-Length: 0\r\n"\
-				"Server: %s DLNADOC/1.50 UPnP/1.0 %s\r\n"\
-				"Date: %s\r\n"\
-				"EXT:\r\n"\
-				"\r\n",
-				replybuffer->contenttype,
-				shared->server.machine,shared->server.version,
-				datestr);
+	if (replybuffer->ranges.count==1) {
+		struct range_replybuffer *r=&replybuffer->ranges.list[0];
+		snprintf(extrastr,80,"Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64"\r\n",
+				r->start,r->limit-1,replybuffer->ranges.fullsize);
 	} else {
-			len=snprintf(buff,512,"HTTP/1.1 206 Partial Content\r\n"\
-					"%s"\
-					"Connection: close\r\n"\
-					"Content-Length: %"PRIu64"\r\n"\
-					"Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64"\r\n"\
-					"Server: %s DLNADOC/1.50 UPnP/1.0 %s\r\n"\
-					"Date: %s\r\n"\
-					"EXT:\r\n"\
-					"\r\n",
-					replybuffer->contenttype,
-					replybuffer->range.limit-replybuffer->range.start,
-					replybuffer->range.start,replybuffer->range.limit-1,replybuffer->fullsize,
-					shared->server.machine,shared->server.version,
-					datestr);
+		contenttype="Content-Type: multipart/byteranges; boundary="BOUNDARY_HTTPD"\r\n";
 	}
+	len=snprintf(buff,buffsize,"HTTP/1.1 206 Partial Content\r\n"\
+			"%s"\
+			"%s"\
+			"%s"\
+			"Connection: %s\r\n"\
+			"Content-Length: %"PRIu64"\r\n"\
+			"Server: %s DLNADOC/1.50 UPnP/1.0 %s\r\n"\
+			"Date: %s\r\n"\
+			"EXT:\r\n"\
+			"\r\n",
+			contenttype,
+			extrastr,
+			replybuffer->headers,
+			connection,
+			contentlength,
+			shared->server.machine,shared->server.version,
+			datestr);
 } else {
-	len=snprintf(buff,512,"HTTP/1.1 200 OK\r\n"\
+	len=snprintf(buff,buffsize,"HTTP/1.1 200 OK\r\n"\
 			"%s"\
-			"Connection: close\r\n"\
+			"%s"\
+			"Connection: %s\r\n"\
 			"Content-Length: %"PRIu64"\r\n"\
 			"Server: %s DLNADOC/1.50 UPnP/1.0 %s\r\n"\
 			"Date: %s\r\n"\
 			"EXT:\r\n"\
 			"\r\n",
-			replybuffer->contenttype,
-			replybuffer->fullsize,
+			contenttype,
+			replybuffer->headers,
+			connection,
+			contentlength,
 			shared->server.machine,shared->server.version,
 			datestr);
 }
-if ((len<0)||(len>=512)) GOTOERROR;
-#ifdef DEBUG
-	if (!(replybuffer->debug.replyheader=strdup(buff))) GOTOERROR;
-#endif
-if (timeout_writen(&istimeouterror,fd_in,(unsigned char *)buff,len,time(NULL)+10)) {
-#ifdef DEBUG
-	fprintf(stderr,"%s:%d: %s\n",__FILE__,__LINE__,replybuffer->debug.replyheader);
-#endif
-	if (istimeouterror) GOTOERROR;
-	GOTOERROR;
+if ((len<0)||(len>=buffsize)) GOTOERROR;
+*len_out=len;
+return 0;
+error:
+	return -1;
 }
-UPACKET_DUMP(buff,len,"reply header");
+
+static int sendrange(int *istimeout_errorout, struct shared *shared, struct replybuffer *replybuffer, int fd_in,
+		uint64_t offset, uint64_t limit) {
+// sends [offset,limit) of the body
+int istimeouterror=0;
 
 if (replybuffer->external.fd>=0) {
+	struct readahead readahead;
+	struct uring *ring;
 	uint64_t left;
-	if (replybuffer->isrange) {
-		if (replybuffer->range.start) {
-			if (0>lseek(replybuffer->external.fd,replybuffer->range.start,SEEK_SET)) GOTOERROR;
+	int isunsupported=0;
+	offset+=replybuffer->external.offset;
+	limit+=replybuffer->external.offset;
+	clear_readahead(&readahead);
+	if (offset<limit) (void)start_readahead(&readahead,replybuffer->external.fd,offset,limit);
+	if ((offset<limit) && (ring=getring(shared))) { // overlaps disk reads with socket writes
+		if (stream_uring(&istimeouterror,ring,fd_in,replybuffer->external.fd,offset,limit-offset,
+				replybuffer->buff,replybuffer->bufflen,30,&readahead)) GOTOERROR;
+#ifdef DEBUG
+		replybuffer->debug.byteswritten+=limit-offset;
+#endif
+		offset=limit;
+	}
+	while (offset<limit) { // sendfile keeps the data in the kernel
+		uint64_t n;
+		n=limit-offset;
+		if (n>replybuffer->bufflen) n=replybuffer->bufflen;
+		(void)step_readahead(&readahead,offset,limit);
+		if (timeout_sendfile(&istimeouterror,&isunsupported,fd_in,replybuffer->external.fd,&offset,n,time(NULL)+30)) {
+			if (isunsupported) break;
+			if (istimeouterror) GOTOERROR;
+			GOTOERROR;
 		}
-		left=replybuffer->range.limit-replybuffer->range.start;
-	} else {
-		left=replybuffer->fullsize;
+#ifdef DEBUG
+		replybuffer->debug.byteswritten+=n;
+#endif
+	}
+	left=limit-offset;
+	if (left) {
+		log_shared(shared,1,"%s:%d sendfile unsupported, copying instead\n",__FILE__,__LINE__);
+		if (0>lseek(replybuffer->external.fd,offset,SEEK_SET)) GOTOERROR;
 	}
 	while (left) {
 		uint64_t n;
 		n=left;
 		if (n>replybuffer->bufflen) n=replybuffer->bufflen;
+		(void)step_readahead(&readahead,limit-left,limit);
 		if (readn(replybuffer->external.fd,replybuffer->buff,n)) GOTOERROR;
 
 		if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff,n,time(NULL)+30)) {
@@ -970,117 +2229,608 @@ if (replybuffer->external.fd>=0) {
 		left-=n;
 	}
 	upacket_dump(NULL,replybuffer->fullsize-replybuffer->offset,0,"reply",__FILE__,__LINE__);
-} else if (request->fileindex==MERGE_FILEINDEX_REQUEST) {
-	uint64_t left,offset;
+} else if (replybuffer->browse.isstream) { // never ranged, offset is 0
+	while (offset<limit) {
+		unsigned int n;
+		n=fill_browse(shared,replybuffer);
+		if (!n) GOTOERROR;
+		if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff,n,time(NULL)+30)) GOTOERROR;
+#ifdef DEBUG
+		replybuffer->debug.byteswritten+=n;
+#endif
+		offset+=n;
+	}
+} else if (replybuffer->isexternal) { // merge
+	if (sendmerge(&istimeouterror,shared,replybuffer,fd_in,offset,limit-offset)) {
+		if (istimeouterror) GOTOERROR;
+		GOTOERROR;
+	}
+} else {
+	if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff+offset,limit-offset,time(NULL)+30)) {
+		if (istimeouterror) GOTOERROR;
+		GOTOERROR;
+	}
+#ifdef DEBUG
+	replybuffer->debug.byteswritten+=limit-offset;
+#endif
+	upacket_dump(replybuffer->buff,responsesize,0,"reply",__FILE__,__LINE__);
+}
+return 0;
+error:
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+static int sendreply(int *istimeout_errorout, struct shared *shared, struct request *request, struct replybuffer *replybuffer,
+		int fd_in) {
+char *buff;
+unsigned int len;
+int istimeouterror=0;
+
+buff=(char *)shared->buff512;
+
+if (makeheader_replybuffer(&len,buff,512,shared,replybuffer)) GOTOERROR;
+#ifdef DEBUG
+	if (!(replybuffer->debug.replyheader=strdup(buff))) GOTOERROR;
+#endif
+if (timeout_writen(&istimeouterror,fd_in,(unsigned char *)buff,len,time(NULL)+10)) {
+#ifdef DEBUG
+	fprintf(stderr,"%s:%d: %s\n",__FILE__,__LINE__,replybuffer->debug.replyheader);
+#endif
+	if (istimeouterror) GOTOERROR;
+	GOTOERROR;
+}
+UPACKET_DUMP(buff,len,"reply header");
+
+if (replybuffer->ishead) {
+	// nothing else to send
+} else if (!replybuffer->isrange) {
+	if (sendrange(&istimeouterror,shared,replybuffer,fd_in,0,replybuffer->fullsize)) GOTOERROR;
+} else if (replybuffer->ranges.count==1) {
+	if (sendrange(&istimeouterror,shared,replybuffer,fd_in,
+			replybuffer->ranges.list[0].start,replybuffer->ranges.list[0].limit)) GOTOERROR;
+} else {
+	unsigned int ui;
+	for (ui=0;ui<=replybuffer->ranges.count;ui++) {
+		if (makepartheader_replybuffer(&len,buff,512,replybuffer,ui)) GOTOERROR;
+		if (timeout_writen(&istimeouterror,fd_in,(unsigned char *)buff,len,time(NULL)+30)) GOTOERROR;
+		if (ui==replybuffer->ranges.count) break;
+		if (sendrange(&istimeouterror,shared,replybuffer,fd_in,
+				replybuffer->ranges.list[ui].start,replybuffer->ranges.list[ui].limit)) GOTOERROR;
+	}
+}
+#ifdef DEBUG
+fprintf(stderr,"%s:%d reply finished pid:%d, %"PRIu64" bytes sent\n",__FILE__,__LINE__,getpid(),replybuffer->debug.byteswritten);
+#endif
+return 0;
+error:
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+static int handleclient(int *istimeout_errorout, int *iskeepalive_inout, struct shared *shared, struct replybuffer *replybuffer,
+		struct lineio *lineio, int fd_in) {
+// *iskeepalive_inout says if we'll allow another request, it's cleared if the client doesn't want one
+struct request request;
+time_t expires;
+int istimeouterror=0;
+
+clear_request(&request);
+
+expires=time(NULL)+30;
+
+if (getrequest(&istimeouterror,shared,&request,fd_in,lineio,expires)) {
+	if (istimeouterror) GOTOERROR;
+	GOTOERROR;
+}
+if (request.postlen) {
+	if (request.postlen>=replybuffer->bufflen) GOTOERROR; // reserve 1 for 0
+	if (getpost_lineio(&istimeouterror,lineio,fd_in,expires,replybuffer->buff,request.postlen)) {
+		if (istimeouterror) GOTOERROR;
+		GOTOERROR;
+	}
+	replybuffer->buff[request.postlen]=0;
+#ifdef DEBUG
+	if (!(request.debug.post=malloc(request.postlen+1))) GOTOERROR;
+	memcpy(request.debug.post,replybuffer->buff,request.postlen+1);
+#endif
+}
+
+#if 0
+#warning shorting flacs
+if (request.fileindex&ONEFLAC_FILEINDEX_REQUEST) {
+	fprintf(stderr,"%s:%d shorting response\n",__FILE__,__LINE__);
+	replybuffer->debug.isshortreply=1;
+}
+#endif
+if (makereply(shared,&request,replybuffer)) GOTOERROR;
+replybuffer->isclose=request.isclose || !*iskeepalive_inout;
+
+if (sendreply(&istimeouterror,shared,&request,replybuffer,fd_in)) {
+	if (istimeouterror) goto error;
+	GOTOERROR;
+}
+
+*iskeepalive_inout=!replybuffer->isclose;
+// deinit_request(&request);
+return 0;
+error:
+	// deinit_request(&request);
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+static int keepalive_handleclient(int *istimeout_errorout, struct shared *shared, struct replybuffer *replybuffer,
+		struct lineio *lineio, int fd_in) {
+// serves requests on one connection until the client closes, goes idle or uses up its requests
+unsigned int count;
+int istimeouterror=0;
+
+(void)reset_lineio(lineio);
+for (count=1;;count++) {
+	int iskeepalive,isready;
+
+	iskeepalive=(count<MAX_REQUESTS_KEEPALIVE_HTTPD);
+	if (handleclient(&istimeouterror,&iskeepalive,shared,replybuffer,lineio,fd_in)) {
+		if (istimeouterror) goto error;
+		GOTOERROR;
+	}
+	if (!iskeepalive) break;
+	(void)recycle_replybuffer(replybuffer);
+	if (waitidle_lineio(&isready,lineio,fd_in,time(NULL)+IDLE_SECONDS_KEEPALIVE_HTTPD)) GOTOERROR;
+	if (!isready) break;
+}
+return 0;
+error:
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+static int child_handleclient(int *istimeout_errorout, struct shared *shared, int fd_in) {
+struct replybuffer replybuffer;
+struct lineio lineio;
+unsigned char linebuff[SIZE_LINEBUFF_HTTPD]; // not buff512, sendreply uses that while pipelined requests wait here
+int istimeouterror=0;
+
+clear_replybuffer(&replybuffer);
+clear_lineio(&lineio);
+
+if (init_replybuffer(&replybuffer,1024*1024)) GOTOERROR; // larger than POST, larger than internal replies, not too large to timeout, too small means more io calls
+voidinit_lineio(&lineio,linebuff,SIZE_LINEBUFF_HTTPD);
+
+if (keepalive_handleclient(&istimeouterror,shared,&replybuffer,&lineio,fd_in)) {
+	if (istimeouterror) goto error;
+	GOTOERROR;
+}
+
+// deinit_replybuffer(&replybuffer);
+return 0;
+error:
+	// deinit_replybuffer(&replybuffer);
+	*istimeout_errorout=istimeouterror;
+	return -1;
+}
+
+struct client_httpd {
+	int fd;
+#define READHEADER_STATE_CLIENT	1
+#define READPOST_STATE_CLIENT	2
+#define SENDHEADER_STATE_CLIENT	3
+#define SENDBODY_STATE_CLIENT	4
+	int state;
+	time_t expires;
+	unsigned int requestcount;
+	int isidle; // => waiting for the first line of a kept-alive request
+	struct lineio lineio;
+	unsigned int postgot;
+	struct request request;
+	struct replybuffer replybuffer;
+#define INTERNAL_BODY_CLIENT	1
+#define FILE_BODY_CLIENT	2
+#define MERGE_BODY_CLIENT	3
+#define BROWSE_BODY_CLIENT	4
+	int bodytype;
+	uint64_t offset,limit; // body progress
+	unsigned int partidx; // multipart/byteranges, parts started so far
+	struct {
+		unsigned char *cursor;
+		unsigned int left;
+	} out;
+	int isnosendfile;
+	struct readahead readahead;
+	struct mergecursor mergecursor;
+	unsigned char linebuff[SIZE_LINEBUFF_HTTPD];
+	char header[512];
+};
+
+static void clear_client(struct client_httpd *client) {
+static struct client_httpd blank={.fd=-1};
+*client=blank;
+clear_lineio(&client->lineio);
+clear_request(&client->request);
+clear_replybuffer(&client->replybuffer);
+clear_readahead(&client->readahead);
+clear_mergecursor(&client->mergecursor);
+}
+
+void retire_client_httpd(struct client_httpd *client) {
+// closes a finished client but keeps its replybuffer, so accept_client_httpd can reuse it without another 1M
+unsigned char *buff=client->replybuffer.buff;
+unsigned int bufflen=client->replybuffer.bufflen;
+
+ifclose(client->fd);
+ifclose(client->replybuffer.external.fd);
+iffree(client->replybuffer.browse.found);
+deinit_mergecursor(&client->mergecursor);
+clear_client(client);
+client->replybuffer.buff=buff;
+client->replybuffer.bufflen=bufflen;
+(void)reset_replybuffer(&client->replybuffer);
+}
+
+void free_client_httpd(struct client_httpd *client) {
+if (!client) return;
+ifclose(client->fd);
+ifclose(client->replybuffer.external.fd);
+iffree(client->replybuffer.browse.found);
+iffree(client->replybuffer.buff);
+deinit_mergecursor(&client->mergecursor);
+free(client);
+}
+
+int getfd_client_httpd(struct client_httpd *client) {
+return client->fd;
+}
+
+int isbrowsing_client_httpd(struct client_httpd *client) {
+return client->replybuffer.browse.isstream;
+}
+
+int iswriting_client_httpd(struct client_httpd *client) {
+return client->state>=SENDHEADER_STATE_CLIENT;
+}
+
+int isexpired_client_httpd(struct client_httpd *client, time_t now) {
+return client->expires<=now;
+}
+
+static void nextrequest_client(struct client_httpd *client) {
+// keeps the lineio, it might hold pipelined requests
+deinit_mergecursor(&client->mergecursor);
+clear_mergecursor(&client->mergecursor);
+clear_request(&client->request);
+(void)recycle_replybuffer(&client->replybuffer);
+client->postgot=0;
+client->bodytype=0;
+client->offset=client->limit=0;
+client->partidx=0;
+clear_readahead(&client->readahead);
+client->state=READHEADER_STATE_CLIENT;
+client->isidle=1;
+client->expires=time(NULL)+IDLE_SECONDS_KEEPALIVE_HTTPD;
+}
+
+static int startreply_client(struct shared *shared, struct client_httpd *client) {
+struct replybuffer *rb=&client->replybuffer;
+unsigned int len;
+
+if (makereply(shared,&client->request,rb)) GOTOERROR;
+rb->isclose=client->request.isclose || (client->requestcount>=MAX_REQUESTS_KEEPALIVE_HTTPD);
+if (makeheader_replybuffer(&len,client->header,sizeof(client->header),shared,rb)) GOTOERROR;
+client->out.cursor=(unsigned char *)client->header;
+client->out.left=len;
+
+if (rb->ishead) {
+	client->offset=client->limit=0;
+} else if (!rb->isrange) {
+	client->offset=0;
+	client->limit=rb->fullsize;
+} else if (rb->ranges.count==1) {
+	client->offset=rb->ranges.list[0].start;
+	client->limit=rb->ranges.list[0].limit;
+} else { // nextpart_client fills these in
+	client->offset=client->limit=0;
+}
+if (rb->external.fd>=0) {
+	client->bodytype=FILE_BODY_CLIENT;
+} else if (rb->browse.isstream) {
+	client->bodytype=BROWSE_BODY_CLIENT;
+} else if (rb->isexternal) {
+	client->bodytype=MERGE_BODY_CLIENT;
+	if (client->offset<client->limit) {
+		if (init_mergecursor(&client->mergecursor,shared,client->offset)) GOTOERROR;
+	}
+} else {
+	client->bodytype=INTERNAL_BODY_CLIENT;
+}
+client->state=SENDHEADER_STATE_CLIENT;
+return 0;
+error:
+	return -1;
+}
+
+static int flushout_client(int *isagain_out, struct client_httpd *client) {
+while (client->out.left) {
+	ssize_t k;
+	k=write(client->fd,client->out.cursor,client->out.left);
+	if (k<1) {
+		if (!k) GOTOERROR;
+		if (errno==EINTR) continue;
+		if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+			*isagain_out=1;
+			return -1;
+		}
+		GOTOERROR;
+	}
+	client->out.cursor+=k;
+	client->out.left-=k;
+}
+return 0;
+error:
+	*isagain_out=0;
+	return -1;
+}
+
+static int nextpart_client(int *isdone_out, struct shared *shared, struct client_httpd *client) {
+// queues the next multipart/byteranges part header, then the closing boundary
+struct replybuffer *rb=&client->replybuffer;
+struct range_replybuffer *r;
+unsigned int len;
+
+if (rb->ishead || !rb->isrange || (rb->ranges.count==1) || (client->partidx>rb->ranges.count)) {
+	*isdone_out=1;
+	return 0;
+}
+if (makepartheader_replybuffer(&len,client->header,sizeof(client->header),rb,client->partidx)) GOTOERROR;
+client->out.cursor=(unsigned char *)client->header;
+client->out.left=len;
+if (client->partidx<rb->ranges.count) {
+	r=&rb->ranges.list[client->partidx];
+	client->offset=r->start;
+	client->limit=r->limit;
+	clear_readahead(&client->readahead); // a part can start before the last one ended
+	if (client->bodytype==MERGE_BODY_CLIENT) {
+		deinit_mergecursor(&client->mergecursor);
+		clear_mergecursor(&client->mergecursor);
+		if (init_mergecursor(&client->mergecursor,shared,client->offset)) GOTOERROR;
+	}
+}
+client->partidx+=1;
+return 0;
+error:
+	return -1;
+}
 
-	if (replybuffer->isrange) {
-		offset=replybuffer->range.start;
-		left=replybuffer->range.limit-replybuffer->range.start;
-	} else {
-		left=replybuffer->fullsize;
-		offset=0;
-	}
-	while (left) {
-		uint64_t n;
-		n=left;
-		if (n>replybuffer->bufflen) n=replybuffer->bufflen;
-		if (merge_readn(shared,offset,replybuffer->buff,n)) GOTOERROR;
+static int sendbody_client(int *isagain_out, struct shared *shared, struct client_httpd *client) {
+// returns 0 when the body is done
+struct replybuffer *rb=&client->replybuffer;
+int isagain=0;
+uint64_t base;
 
-		if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff,n,time(NULL)+30)) {
-			if (istimeouterror) GOTOERROR;
+while (1) {
+	if (client->out.left) {
+		if (flushout_client(&isagain,client)) {
+			if (isagain) goto again;
 			GOTOERROR;
 		}
-#ifdef DEBUG
-		replybuffer->debug.byteswritten+=n;
-#endif
-		left-=n;
-		offset+=n;
+		client->expires=time(NULL)+30;
 	}
-} else {
-	if (replybuffer->isrange) {
-		if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff+replybuffer->range.start,
-				replybuffer->range.limit-replybuffer->range.start,time(NULL)+30)) {
-			if (istimeouterror) GOTOERROR;
-			GOTOERROR;
-		}
-#ifdef DEBUG
-		replybuffer->debug.byteswritten+=replybuffer->range.limit-replybuffer->range.start;
-#endif
-	} else {
-		if (timeout_writen(&istimeouterror,fd_in,replybuffer->buff,replybuffer->fullsize,time(NULL)+30)) {
-			if (istimeouterror) GOTOERROR;
-			GOTOERROR;
-		}
-#ifdef DEBUG
-		replybuffer->debug.byteswritten+=replybuffer->fullsize;
-#endif
+	if (client->offset>=client->limit) {
+		int isdone=0;
+		if (nextpart_client(&isdone,shared,client)) GOTOERROR;
+		if (isdone) break;
+		continue;
+	}
+
+	switch (client->bodytype) {
+		case INTERNAL_BODY_CLIENT:
+			client->out.cursor=rb->buff+client->offset;
+			client->out.left=client->limit-client->offset;
+			client->offset=client->limit;
+			break;
+		case FILE_BODY_CLIENT:
+			base=rb->external.offset;
+			if (client->readahead.fd<0) {
+				(void)start_readahead(&client->readahead,rb->external.fd,base+client->offset,base+client->limit);
+			} else {
+				(void)step_readahead(&client->readahead,base+client->offset,base+client->limit);
+			}
+			if (!client->isnosendfile) {
+				off_t offset;
+				uint64_t n;
+				ssize_t k;
+				offset=base+client->offset;
+				n=client->limit-client->offset;
+				if (n>rb->bufflen) n=rb->bufflen;
+				k=sendfile(client->fd,rb->external.fd,&offset,n);
+				if (k<1) {
+					if (!k) GOTOERROR;
+					if (errno==EINTR) continue;
+					if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) goto again;
+					if ((errno==EINVAL)||(errno==ENOSYS)||(errno==EOPNOTSUPP)) {
+						log_shared(shared,1,"%s:%d sendfile unsupported, copying instead\n",__FILE__,__LINE__);
+						client->isnosendfile=1;
+						continue;
+					}
+					GOTOERROR;
+				}
+				client->offset=offset-base;
+				client->expires=time(NULL)+30;
+			} else {
+				uint64_t n;
+				ssize_t k;
+				n=client->limit-client->offset;
+				if (n>rb->bufflen) n=rb->bufflen;
+				k=pread(rb->external.fd,rb->buff,n,base+client->offset);
+				if (k<1) GOTOERROR;
+				client->out.cursor=rb->buff;
+				client->out.left=k;
+				client->offset+=k;
+			}
+			break;
+		case MERGE_BODY_CLIENT:
+			if (!client->mergecursor.isnosplice) {
+				uint64_t sent=0;
+				int r;
+				r=nbsend_mergecursor(&isagain,&sent,&client->mergecursor,shared,client->fd,client->limit-client->offset);
+				client->offset+=sent;
+				if (sent) client->expires=time(NULL)+30;
+				if (r) {
+					if (isagain) goto again;
+					GOTOERROR;
+				}
+			} else {
+				unsigned int got;
+				uint64_t n;
+				n=client->limit-client->offset;
+				if (n>rb->bufflen) n=rb->bufflen;
+				if (read_mergecursor(&got,&client->mergecursor,shared,rb->buff,n)) GOTOERROR;
+				client->out.cursor=rb->buff;
+				client->out.left=got;
+				client->offset+=got;
+			}
+			break;
+		case BROWSE_BODY_CLIENT:
+			{
+				unsigned int n;
+				n=fill_browse(shared,rb);
+				if (!n) GOTOERROR;
+				client->out.cursor=rb->buff;
+				client->out.left=n;
+				client->offset+=n;
+			}
+			break;
+		default: GOTOERROR;
 	}
-	upacket_dump(replybuffer->buff,responsesize,0,"reply",__FILE__,__LINE__);
 }
-#ifdef DEBUG
-fprintf(stderr,"%s:%d reply finished pid:%d, %"PRIu64" bytes sent\n",__FILE__,__LINE__,getpid(),replybuffer->debug.byteswritten);
-#endif
 return 0;
+again:
+	*isagain_out=1;
+	return -1;
 error:
-	*istimeout_errorout=istimeouterror;
+	*isagain_out=0;
 	return -1;
 }
 
-static int child_handleclient(int *istimeout_errorout, struct shared *shared, int fd_in) {
-struct replybuffer replybuffer;
-struct request request;
-struct lineio lineio;
-time_t expires;
-int istimeouterror=0;
-
-clear_replybuffer(&replybuffer);
-clear_request(&request);
-clear_lineio(&lineio);
-
-if (init_replybuffer(&replybuffer,1024*1024)) GOTOERROR; // larger than POST, larger than internal replies, not too large to timeout, too small means more io calls
-voidinit_lineio(&lineio,shared->buff512,512);
-
-expires=time(NULL)+30;
+int step_client_httpd(int *isdone_out, struct shared *shared, struct client_httpd *client) {
+// client->fd is nonblocking, this returns when we'd block, *isdone_out is set when the client can be freed
+int isagain=0;
 
-if (getrequest(&istimeouterror,shared,&request,fd_in,&lineio,expires)) {
-	if (istimeouterror) GOTOERROR;
-	GOTOERROR;
+while (1) switch (client->state) {
+	case READHEADER_STATE_CLIENT:
+		{
+			unsigned int linelen;
+			char *line;
+			line=(char *)nbgets_lineio(&isagain,&linelen,&client->lineio,client->fd);
+			if (!line) {
+				if (isagain) return 0;
+				GOTOERROR;
+			}
+			if (client->isidle) {
+				client->isidle=0;
+				client->expires=time(NULL)+30;
+			}
+			(void)chompline(line,linelen);
+			if (!line[0]) {
+				client->state=READPOST_STATE_CLIENT;
+				break;
+			}
+			if (parseline_request(shared,&client->request,line)) GOTOERROR;
+		}
+		break;
+	case READPOST_STATE_CLIENT:
+		if (client->request.postlen) {
+			struct replybuffer *rb=&client->replybuffer;
+			if (client->request.postlen>=rb->bufflen) GOTOERROR; // reserve 1 for 0
+			if (nbgetpost_lineio(&isagain,&client->postgot,&client->lineio,client->fd,rb->buff,client->request.postlen)) {
+				if (isagain) return 0;
+				GOTOERROR;
+			}
+			rb->buff[client->request.postlen]=0;
+		}
+		client->requestcount+=1;
+		if (startreply_client(shared,client)) GOTOERROR;
+		client->expires=time(NULL)+10;
+		break;
+	case SENDHEADER_STATE_CLIENT:
+		if (flushout_client(&isagain,client)) {
+			if (isagain) return 0;
+			GOTOERROR;
+		}
+		client->state=SENDBODY_STATE_CLIENT;
+		client->expires=time(NULL)+30;
+		break;
+	case SENDBODY_STATE_CLIENT:
+		if (sendbody_client(&isagain,shared,client)) {
+			if (isagain) return 0;
+			GOTOERROR;
+		}
+		if (client->replybuffer.isclose) {
+			*isdone_out=1;
+			return 0;
+		}
+		(void)nextrequest_client(client);
+		break;
+	default: GOTOERROR;
 }
-if (request.postlen) {
-	if (request.postlen>=replybuffer.bufflen) GOTOERROR; // reserve 1 for 0
-	if (getpost_lineio(&istimeouterror,&lineio,fd_in,expires,replybuffer.buff,request.postlen)) {
-		if (istimeouterror) GOTOERROR;
-		GOTOERROR;
-	}
-	replybuffer.buff[request.postlen]=0;
-#ifdef DEBUG
-	if (!(request.debug.post=malloc(request.postlen+1))) GOTOERROR;
-	memcpy(request.debug.post,replybuffer.buff,request.postlen+1);
-#endif
+error:
+	return -1;
 }
 
-#if 0
-#warning shorting flacs
-if (request.fileindex&ONEFLAC_FILEINDEX_REQUEST) {
-	fprintf(stderr,"%s:%d shorting response\n",__FILE__,__LINE__);
-	replybuffer.debug.isshortreply=1;
+static int checkpeer(struct shared *shared, struct sockaddr_in *sa) {
+uint32_t u32=sa->sin_addr.s_addr;
+if (shared->target.ipv4 && (shared->target.ipv4!=u32)) {
+	log_shared(shared,1,"%s:%d rejecting connection from %u.%u.%u.%u\n",__FILE__,__LINE__,
+			(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff);
+	return -1;
+}
+log_shared(shared,1,"%s:%d got connection from %u.%u.%u.%u\n",__FILE__,__LINE__,
+		(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff);
+return 0;
 }
-#endif
-if (makereply(shared,&request,&replybuffer)) GOTOERROR;
 
-if (sendreply(&istimeouterror,shared,&request,&replybuffer,fd_in)) {
-	if (istimeouterror) goto error;
-	GOTOERROR;
+struct client_httpd *accept_client_httpd(int *isagain_out, int *isfull_out, struct client_httpd *spare, struct shared *shared) {
+// returns NULL with *isagain_out set when there's nothing left to accept
+// *isfull_out is also set if we're out of fds, the connection is still waiting
+// spare is a retired client to reuse, NULL => malloc one; it's returned or left with the caller
+struct client_httpd *client=NULL;
+struct sockaddr_in sa;
+socklen_t ssa;
+int fd=-1;
+
+ssa=sizeof(sa);
+fd=accept4(shared->tcp_socket,(struct sockaddr*)&sa,&ssa,SOCK_NONBLOCK|SOCK_CLOEXEC);
+if (0>fd) {
+	*isagain_out=1; // EAGAIN or we're out of fds, either way stop accepting for now
+	if ((errno==EMFILE)||(errno==ENFILE)||(errno==ENOBUFS)||(errno==ENOMEM)) *isfull_out=1;
+	return NULL;
+}
+if (ssa!=sizeof(sa)) GOTOERROR;
+if (checkpeer(shared,&sa)) {
+	close(fd);
+	return NULL;
 }
 
-// deinit_request(&request);
-// deinit_replybuffer(&replybuffer);
-return 0;
+if (spare) {
+	client=spare;
+} else {
+	if (!(client=malloc(sizeof(struct client_httpd)))) GOTOERROR;
+	clear_client(client);
+}
+client->fd=fd; fd=-1;
+client->state=READHEADER_STATE_CLIENT;
+client->expires=time(NULL)+30;
+voidinit_lineio(&client->lineio,client->linebuff,SIZE_LINEBUFF_HTTPD);
+(void)reset_lineio(&client->lineio);
+if (!client->replybuffer.buff) {
+	if (init_replybuffer(&client->replybuffer,1024*1024)) GOTOERROR;
+}
+return client;
 error:
-	// deinit_request(&request);
-	// deinit_replybuffer(&replybuffer);
-	*istimeout_errorout=istimeouterror;
-	return -1;
+	ifclose(fd);
+	if (client==spare) retire_client_httpd(client);
+	else free_client_httpd(client);
+	return NULL;
 }
 
 static void cancelchild(struct shared *shared, pid_t pid) {
@@ -1116,37 +2866,273 @@ for (ui=0;ui<shared->children.max;ui++) {
 }
 }
 
+static int cancelworker(struct shared *shared, pid_t pid) {
+unsigned int ui;
+for (ui=0;ui<shared->workers.count;ui++) {
+	struct oneworker_shared *ows;
+	ows=&shared->workers.list[ui];
+	if (ows->pid==pid) {
+		log_shared(shared,0,"%s:%d worker %u (pid:%d) exited\n",__FILE__,__LINE__,ui,pid);
+		ows->pid=0;
+		return 1;
+	}
+}
+return 0;
+}
+
 void reap_httpd(struct shared *shared) {
 while (1) {
 	pid_t r;
 	r=waitpid(-1,NULL,WNOHANG);
 	if (r<=0) break;
+	if (cancelworker(shared,r)) continue;
 	(void)cancelchild(shared,r);
 }
 }
 
-int acceptclient_httpd(struct shared *shared) {
-struct sockaddr_in sa;
-socklen_t ssa;
-int fd=-1;
-pid_t pid;
+static volatile sig_atomic_t isstale_global; // SIGUSR1, the parent has started a replacement
 
-if (shared->children.count==shared->children.max) GOTOERROR; // misconfig
+static void stale_signal_handler(int ign) {
+isstale_global=1;
+}
 
-ssa=sizeof(sa);
-fd=accept(shared->tcp_socket,(struct sockaddr*)&sa,&ssa);
-if (0>fd) return 0;
-if (ssa!=sizeof(sa)) GOTOERROR;
+static void worker_main(struct shared *shared, unsigned int idx) {
+// SIGUSR1 is only let in while waiting, a client that's been accepted is always finished
+struct replybuffer replybuffer;
+struct lineio lineio;
+unsigned char linebuff[SIZE_LINEBUFF_HTTPD];
+struct sigaction action;
+sigset_t stalemask,waitmask;
+unsigned int ui;
+int fd_listen;
+
+(ignore)signal(SIGTERM,SIG_DFL);
+(ignore)signal(SIGINT,SIG_DFL);
+(ignore)signal(SIGCHLD,SIG_DFL);
+memset(&action,0,sizeof(action));
+action.sa_handler=stale_signal_handler; // no SA_RESTART, the wait has to return
+if (sigaction(SIGUSR1,&action,NULL)) GOTOERROR;
+(ignore)sigemptyset(&stalemask);
+(ignore)sigaddset(&stalemask,SIGUSR1);
+if (sigprocmask(SIG_BLOCK,&stalemask,&waitmask)) GOTOERROR;
+(ignore)sigdelset(&waitmask,SIGUSR1);
+
+fd_listen=shared->workers.list[idx].fd;
+for (ui=0;ui<shared->workers.count;ui++) {
+	if (ui==idx) continue;
+	ifclose(shared->workers.list[ui].fd);
+}
+(void)afterfork_shared(shared);
+(void)readyring_httpd(shared);
+
+if (shared->options.iseventloop) {
+	struct eventloop eventloop;
+	clear_eventloop(&eventloop);
+	shared->tcp_socket=fd_listen;
+	shared->options.isnodiscovery=1; // the parent answers ssdp
+	if (init_eventloop(&eventloop,shared)) GOTOERROR;
+	eventloop.sigmask=&waitmask;
+	while (1) {
+		if (isstale_global) {
+			(void)unlisten_eventloop(&eventloop,shared);
+			if (!eventloop.clientcount) _exit(0);
+		}
+		if (step_eventloop(&eventloop,shared,60)) GOTOERROR;
+	}
+}
 
-uint32_t u32=sa.sin_addr.s_addr;
-if (shared->target.ipv4 && (shared->target.ipv4!=u32)) {
-	log_shared(shared,1,"%s:%d rejecting connection from %u.%u.%u.%u\n",__FILE__,__LINE__,
-			(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff);
+clear_replybuffer(&replybuffer);
+clear_lineio(&lineio);
+if (init_replybuffer(&replybuffer,1024*1024)) GOTOERROR;
+voidinit_lineio(&lineio,linebuff,SIZE_LINEBUFF_HTTPD);
+{ // another worker can take the connection between ppoll and accept
+	int flags;
+	flags=fcntl(fd_listen,F_GETFL);
+	if (flags<0) GOTOERROR;
+	if (fcntl(fd_listen,F_SETFL,flags|O_NONBLOCK)) GOTOERROR;
+}
+
+while (!isstale_global) {
+	struct sockaddr_in sa;
+	struct pollfd pollfd;
+	socklen_t ssa;
+	int fd,istimeout;
+
+	pollfd.fd=fd_listen;
+	pollfd.events=POLLIN;
+	if (0>ppoll(&pollfd,1,NULL,&waitmask)) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	ssa=sizeof(sa);
+	fd=accept(fd_listen,(struct sockaddr*)&sa,&ssa);
+	if (0>fd) {
+		if (errno==EINTR) continue;
+		if (errno==EAGAIN) continue;
+		if (errno==ECONNABORTED) continue;
+		GOTOERROR;
+	}
+	if ((ssa!=sizeof(sa)) || checkpeer(shared,&sa)) {
+		close(fd);
+		continue;
+	}
+	if (keepalive_handleclient(&istimeout,shared,&replybuffer,&lineio,fd)) {
+		if (istimeout) {
+//			fprintf(stderr,"%s:%d client timed out\n",__FILE__,__LINE__);
+		}
+	}
 	close(fd);
-	return 0;
+	(void)recycle_replybuffer(&replybuffer);
+}
+_exit(0);
+error:
+	log_shared(shared,0,"%s:%d worker %u exiting on error\n",__FILE__,__LINE__,idx);
+	_exit(1);
+}
+
+int startworkers_httpd(struct shared *shared) {
+// starts any workers that aren't running, the parent calls this after reaping
+unsigned int ui;
+shared->workers.isdelayed=0;
+for (ui=0;ui<shared->workers.count;ui++) {
+	struct oneworker_shared *ows;
+	time_t now;
+	pid_t pid;
+
+	ows=&shared->workers.list[ui];
+	if (ows->pid) continue;
+	now=time(NULL);
+	if (ows->started+1>=now) { // don't spin if a worker keeps dying, the parent still has ssdp to answer
+		shared->workers.isdelayed=1;
+		continue;
+	}
+	pid=fork();
+	if (pid<0) GOTOERROR;
+	if (!pid) {
+		(void)worker_main(shared,ui);
+		_exit(0);
+	}
+	ows->pid=pid;
+	ows->started=now;
+}
+return 0;
+error:
+	return -1;
+}
+
+int restartworkers_httpd(struct shared *shared) {
+// the files changed, each worker gets a replacement on the same listener and the old one exits once it's idle
+unsigned int ui;
+for (ui=0;ui<shared->workers.count;ui++) {
+	struct oneworker_shared *ows;
+	ows=&shared->workers.list[ui];
+	if (!ows->pid) continue;
+	(ignore)kill(ows->pid,SIGUSR1);
+	ows->pid=0; // reap_httpd won't recognize it, that's fine
+	ows->started=0;
+}
+return startworkers_httpd(shared);
+}
+
+void stopworkers_httpd(struct shared *shared) {
+unsigned int ui;
+for (ui=0;ui<shared->workers.count;ui++) {
+	struct oneworker_shared *ows;
+	ows=&shared->workers.list[ui];
+	if (ows->pid) (ignore)kill(ows->pid,SIGTERM);
+}
+}
+
+static int inlinehead(int *ishandled_out, struct shared *shared, int fd) {
+// answers a HEAD for a file without forking, if the whole request has already arrived
+// only what we can answer from the catalog is handled, anything else is left in the socket for a child
+char buff[SIZE_LINEBUFF_HTTPD];
+unsigned char textbuff[64];
+struct replybuffer replybuffer;
+struct request request;
+char *line,*end;
+unsigned int len;
+int istimeout;
+ssize_t k;
+
+*ishandled_out=0;
+k=recv(fd,buff,SIZE_LINEBUFF_HTTPD-1,MSG_PEEK|MSG_DONTWAIT);
+if ((k<5) || memcmp(buff,"HEAD ",5)) return 0;
+buff[k]=0;
+if (!(end=strstr(buff,"\r\n\r\n"))) return 0;
+end+=4;
+
+clear_request(&request);
+line=buff;
+while (1) {
+	char *next;
+	next=strchr(line,'\n');
+	if (!next) break;
+	next++;
+	(void)chompline(line,next-line);
+	if (!line[0]) break;
+	if (parseline_request(shared,&request,line)) return 0; // let the child complain
+	line=next;
+}
+switch (request.fileindex) {
+	case ONEFLAC_FILEINDEX_REQUEST: case ONEWAV_FILEINDEX_REQUEST: case ONEMP3_FILEINDEX_REQUEST:
+	case ONEMP4_FILEINDEX_REQUEST: case MERGE_FILEINDEX_REQUEST: case ART_FILEINDEX_REQUEST:
+		break;
+	default: return 0;
+}
+if (0>recv(fd,buff,end-buff,0)) GOTOERROR; // it's already here, this won't block
+
+clear_replybuffer(&replybuffer);
+replybuffer.buff=textbuff;
+replybuffer.bufflen=sizeof(textbuff);
+(void)reset_replybuffer(&replybuffer);
+if (makereply(shared,&request,&replybuffer)) GOTOERROR;
+replybuffer.isclose=1; // the next request needs a child anyway
+if (makeheader_replybuffer(&len,(char *)shared->buff512,512,shared,&replybuffer)) GOTOERROR;
+*ishandled_out=1;
+if (timeout_writen(&istimeout,fd,shared->buff512,len,time(NULL)+2)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int ischeap(int fd) {
+// peeks at the request line, everything but a stream is cheap
+char buff[32];
+ssize_t k;
+
+k=recv(fd,buff,sizeof(buff)-1,MSG_PEEK|MSG_DONTWAIT);
+if (k<=0) return 0; // we can't tell yet
+buff[k]=0;
+if (!strncmp(buff,"POST ",5)) return 1;
+if (!strncmp(buff,"GET /root.xml",13)) return 1;
+if (!strncmp(buff,"GET /icon.png",13)) return 1;
+if (!strncmp(buff,"GET /contentdir.",16)) return 1;
+if (!strncmp(buff,"GET /art.",9)) return 1; // a small image, players ask for a page of them at once
+return 0;
+}
+
+static void sendbusy(struct shared *shared, int fd) {
+unsigned char textbuff[16];
+struct replybuffer replybuffer;
+char junk[SIZE_LINEBUFF_HTTPD];
+unsigned int len;
+int istimeout;
+
+log_shared(shared,1,"%s:%d too busy, sending 503\n",__FILE__,__LINE__);
+clear_replybuffer(&replybuffer);
+replybuffer.buff=textbuff;
+replybuffer.bufflen=sizeof(textbuff);
+(void)add503_replybuffer(&replybuffer,RETRYAFTER_SECONDS_HTTPD);
+replybuffer.isclose=1;
+if (makeheader_replybuffer(&len,(char *)shared->buff512,512,shared,&replybuffer)) return;
+(ignore)recv(fd,junk,sizeof(junk),MSG_DONTWAIT); // unread data would make close() send a reset
+(ignore)timeout_writen(&istimeout,fd,shared->buff512,len,time(NULL)+1);
 }
-log_shared(shared,1,"%s:%d got connection from %u.%u.%u.%u\n",__FILE__,__LINE__,
-		(u32)&0xff, (u32>>8)&0xff, (u32>>16)&0xff, (u32>>24)&0xff);
+
+static int forkchild(struct shared *shared, int fd) {
+// closes fd in the parent
+pid_t pid;
 
 pid=fork();
 if (!pid) {
@@ -1160,30 +3146,115 @@ if (!pid) {
 //	close(fd);
 	_exit(0);
 }
-close(fd);fd=-1;
+if (pid<0) {
+	log_shared(shared,0,"%s:%d fork failed\n",__FILE__,__LINE__);
+	(void)sendbusy(shared,fd);
+	close(fd);
+	return 0;
+}
+close(fd);
+(void)handoffring(shared);
 #if 0
 	fprintf(stderr,"%s:%d starting child pid:%d\n",__FILE__,__LINE__,pid);
 #endif
 (void)addchild(shared,pid);
+return 0;
+}
+
+static int canfork(struct shared *shared, int ischeap) {
+unsigned int max=shared->children.max;
+if (!ischeap && (max>1)) max--; // keep a child free so browsing works while streams are maxed
+return shared->children.count<max;
+}
+
+static void removepending(struct shared *shared, unsigned int idx) {
+shared->pending.count-=1;
+memmove(shared->pending.list+idx,shared->pending.list+idx+1,(shared->pending.count-idx)*sizeof(struct onepending_shared));
+}
+
+int checkpending_httpd(struct shared *shared) {
+// starts children for waiting connections, cheap ones first, then sheds any that waited too long
+time_t now;
+unsigned int ui;
+
+while (shared->pending.count) {
+	int fd;
+	for (ui=0;ui<shared->pending.count;ui++) {
+		if (shared->pending.list[ui].ischeap && canfork(shared,1)) break;
+	}
+	if (ui==shared->pending.count) {
+		for (ui=0;ui<shared->pending.count;ui++) {
+			if (!shared->pending.list[ui].ischeap && canfork(shared,0)) break;
+		}
+		if (ui==shared->pending.count) break;
+	}
+	fd=shared->pending.list[ui].fd;
+	(void)removepending(shared,ui);
+	if (forkchild(shared,fd)) GOTOERROR;
+}
+
+now=time(NULL);
+ui=0;
+while (ui<shared->pending.count) {
+	struct onepending_shared *ops=&shared->pending.list[ui];
+	if (ops->expires>now) {
+		ui++;
+		continue;
+	}
+	(void)sendbusy(shared,ops->fd);
+	close(ops->fd);
+	(void)removepending(shared,ui);
+}
+return 0;
+error:
+	return -1;
+}
+
+int acceptclient_httpd(struct shared *shared) {
+// this never blocks, if every child is busy the connection waits in shared->pending
+struct onepending_shared *ops;
+struct sockaddr_in sa;
+socklen_t ssa;
+int fd=-1;
 
 (void)reap_httpd(shared);
+
+ssa=sizeof(sa);
+fd=accept(shared->tcp_socket,(struct sockaddr*)&sa,&ssa);
+if (0>fd) return 0;
+if (ssa!=sizeof(sa)) GOTOERROR;
+
+if (checkpeer(shared,&sa)) {
+	close(fd);
+	return 0;
+}
+
+{
+	int ishandled;
+	if (inlinehead(&ishandled,shared,fd) || ishandled) {
+		close(fd);
+		return 0;
+	}
+}
+
+if (shared->pending.count==shared->pending.max) {
+	if (canfork(shared,ischeap(fd))) return forkchild(shared,fd); // a cheap one can pass a queue of streams
+	(void)sendbusy(shared,fd);
+	close(fd);
+	return 0;
+}
+ops=&shared->pending.list[shared->pending.count];
+ops->fd=fd;
+ops->ischeap=ischeap(fd);
+ops->expires=time(NULL)+WAIT_SECONDS_PENDING_HTTPD;
+shared->pending.count+=1;
 #ifdef DEBUG
 if (shared->children.max==shared->children.count) {
-	fprintf(stderr,"%s:%d maximum children are running, blocking for waitpid\n",__FILE__,__LINE__);
+	fprintf(stderr,"%s:%d maximum children are running, connection is pending\n",__FILE__,__LINE__);
 }
 #endif
-while (shared->children.max==shared->children.count) {
-	pid_t r;
-	r=waitpid(-1,NULL,0);
-	if (r<=0) {
-		if (!r) continue;
-		if (errno==EINTR) continue;
-		GOTOERROR;
-	}
-	(void)cancelchild(shared,r);
-}
 
-return 0;
+return checkpending_httpd(shared);
 error:
 	ifclose(fd);
 	return -1;
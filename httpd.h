@@ -1,4 +1,20 @@
 
 int getsocket_httpd(struct shared *shared);
+int render_httpd(struct shared *shared);
 void reap_httpd(struct shared *shared);
 int acceptclient_httpd(struct shared *shared);
+int checkpending_httpd(struct shared *shared);
+int startworkers_httpd(struct shared *shared);
+int restartworkers_httpd(struct shared *shared);
+void stopworkers_httpd(struct shared *shared);
+void readyring_httpd(struct shared *shared);
+
+struct client_httpd;
+struct client_httpd *accept_client_httpd(int *isagain_out, int *isfull_out, struct client_httpd *spare, struct shared *shared);
+int step_client_httpd(int *isdone_out, struct shared *shared, struct client_httpd *client);
+int getfd_client_httpd(struct client_httpd *client);
+int iswriting_client_httpd(struct client_httpd *client);
+int isbrowsing_client_httpd(struct client_httpd *client);
+int isexpired_client_httpd(struct client_httpd *client, time_t now);
+void retire_client_httpd(struct client_httpd *client);
+void free_client_httpd(struct client_httpd *client);
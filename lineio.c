@@ -25,6 +25,8 @@
 #include <sys/socket.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 // #define DEBUG
 #include "common/conventions.h"
 #include "misc.h"
@@ -73,6 +75,7 @@ if (linelen) {
 	*len_out=linelen;
 	return ret;
 }
+if (!lineio->unreadcount) (void)reset_lineio(lineio); // after a request, start again at the front
 dest=lineio->cursor+lineio->unreadcount;
 while (1) {
 	if (!lineio->towritecount) {
@@ -150,3 +153,145 @@ error:
 	return -1;
 }
 
+
+unsigned char *nbgets_lineio(int *isagain_out, unsigned int *len_out, struct lineio *lineio, int fd) {
+// like gets_lineio but fd is nonblocking, returns NULL with *isagain_out set if we need to wait
+unsigned char *ret,*dest;
+unsigned int linelen;
+
+linelen=checkunread(lineio);
+if (linelen) {
+	ret=lineio->cursor;
+	lineio->cursor+=linelen;
+	lineio->unreadcount-=linelen;
+	*len_out=linelen;
+	return ret;
+}
+if (!lineio->unreadcount) (void)reset_lineio(lineio);
+dest=lineio->cursor+lineio->unreadcount;
+while (1) {
+	ssize_t k;
+	if (!lineio->towritecount) {
+		if (lineio->unreadcount==lineio->bufflen) { // we're full
+			GOTOERROR;
+		}
+		memmove(lineio->buff,lineio->cursor,lineio->unreadcount);
+		lineio->towritecount=lineio->bufflen-lineio->unreadcount;
+		lineio->cursor=lineio->buff;
+		dest=lineio->cursor+lineio->unreadcount;
+	}
+	k=read(fd,dest,lineio->towritecount);
+	if (k<1) {
+		if (!k) GOTOERROR;
+		if (errno==EINTR) continue;
+		if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+			*isagain_out=1;
+			return NULL;
+		}
+		GOTOERROR;
+	}
+	lineio->towritecount-=k;
+	{
+		unsigned char *temp;
+		unsigned int ui;
+		temp=dest;
+		for (ui=0;ui<k;ui++) {
+			if (*temp=='\n') {
+				linelen=lineio->unreadcount+ui+1;
+				ret=lineio->cursor;
+				lineio->cursor+=linelen;
+				lineio->unreadcount+=k-linelen;
+				*len_out=linelen;
+				return ret;
+			}
+			temp++;
+		}
+	}
+	lineio->unreadcount+=k;
+	dest+=k;
+}
+error:
+	*isagain_out=0;
+	return NULL;
+}
+
+int nbgetpost_lineio(int *isagain_out, unsigned int *got_inout, struct lineio *lineio, int fd,
+		unsigned char *dest, unsigned int destlen) {
+// *got_inout should start at 0 and is kept between calls
+unsigned int got;
+
+got=*got_inout;
+if (lineio->unreadcount && (got<destlen)) {
+	unsigned int ui;
+	ui=destlen-got;
+	if (ui>lineio->unreadcount) ui=lineio->unreadcount;
+	memcpy(dest+got,lineio->cursor,ui);
+	lineio->cursor+=ui;
+	lineio->unreadcount-=ui;
+	got+=ui;
+}
+while (got<destlen) {
+	ssize_t k;
+	k=read(fd,dest+got,destlen-got);
+	if (k<1) {
+		if (!k) GOTOERROR;
+		if (errno==EINTR) continue;
+		if ((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+			*got_inout=got;
+			*isagain_out=1;
+			return -1;
+		}
+		GOTOERROR;
+	}
+	got+=k;
+}
+*got_inout=got;
+return 0;
+error:
+	*isagain_out=0;
+	return -1;
+}
+
+int waitidle_lineio(int *isready_out, struct lineio *lineio, int fd, time_t expires) {
+// waits for the start of another request on a kept-alive connection
+// *isready_out is 0 if we timed out or the peer closed, neither is an error
+struct pollfd pollfd;
+unsigned char ch;
+
+if (lineio->unreadcount) { // pipelined
+	*isready_out=1;
+	return 0;
+}
+pollfd.fd=fd;
+pollfd.events=POLLIN;
+while (1) {
+	time_t now;
+	ssize_t k;
+	int r;
+
+	now=time(NULL);
+	if (expires<=now) {
+		*isready_out=0;
+		return 0;
+	}
+	r=poll(&pollfd,1,(expires-now)*1000);
+	if (r<0) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	if (!r) continue;
+	k=recv(fd,&ch,1,MSG_PEEK);
+	if (k<0) {
+		if (errno==EINTR) continue;
+		if (errno==ECONNRESET) break;
+		GOTOERROR;
+	}
+	if (!k) break;
+	*isready_out=1;
+	return 0;
+}
+*isready_out=0;
+return 0;
+error:
+	return -1;
+}
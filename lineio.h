@@ -13,3 +13,7 @@ void voidinit_lineio(struct lineio *lineio, unsigned char *buffer, unsigned int
 void reset_lineio(struct lineio *lineio);
 unsigned char *gets_lineio(int *istimeout_errorout, unsigned int *len_out, struct lineio *lineio, int fd, time_t expires);
 int getpost_lineio(int *istimeout_errorout, struct lineio *lineio, int fd, time_t expires, unsigned char *dest, unsigned int destlen);
+unsigned char *nbgets_lineio(int *isagain_out, unsigned int *len_out, struct lineio *lineio, int fd);
+int nbgetpost_lineio(int *isagain_out, unsigned int *got_inout, struct lineio *lineio, int fd,
+		unsigned char *dest, unsigned int destlen);
+int waitidle_lineio(int *isready_out, struct lineio *lineio, int fd, time_t expires);
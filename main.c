@@ -32,8 +32,14 @@
 #include "shared.h"
 #include "ssdp.h"
 #include "files.h"
+#include "containers.h"
+#include "search.h"
+#include "sort.h"
+#include "scan.h"
+#include "watch.h"
 #include "httpd.h"
 #include "options.h"
+#include "eventloop.h"
 
 static int isquit_global;
 
@@ -44,9 +50,9 @@ static void chld_signal_handler(int ign) {
 }
 
 static int step_mainloop(struct shared *shared, unsigned int seconds) {
-struct pollfd pollfds[2];
+struct pollfd pollfds[3];
 int r;
-int numpfds=1;
+int numpfds=1,watchidx=-1;
 
 pollfds[0].fd=shared->tcp_socket;
 pollfds[0].events=POLLIN;
@@ -56,18 +62,40 @@ if (!shared->options.isnodiscovery) {
 	pollfds[1].fd=shared->udp_socket;
 	pollfds[1].events=POLLIN;
 }
+if (shared->watch.fd>=0) {
+	watchidx=numpfds;
+	pollfds[numpfds].fd=shared->watch.fd;
+	pollfds[numpfds].events=POLLIN;
+	numpfds+=1;
+}
+if (shared->pending.count) seconds=1; // to shed connections that wait too long
 
 r=poll(pollfds,numpfds,seconds*1000);
 if (r<0) {
 	if (errno!=EINTR) GOTOERROR;
 	(void)reap_httpd(shared);
-} else if (r) {
+} else if (!r) {
+	(void)reap_httpd(shared);
+} else {
 	if (pollfds[0].revents&POLLIN) {
 		if (acceptclient_httpd(shared)) GOTOERROR;
 	}
-	if (pollfds[1].revents&POLLIN) {
+	if (!shared->options.isnodiscovery && (pollfds[1].revents&POLLIN)) {
 		if (checkclient_ssdp(shared)) GOTOERROR;
 	}
+	if ((watchidx>=0) && (pollfds[watchidx].revents&POLLIN)) {
+		if (read_watch(shared)) GOTOERROR;
+	}
+}
+// every time around, steady SSDP traffic would otherwise keep the queue from expiring
+if (shared->pending.count) {
+	(void)reap_httpd(shared);
+	if (checkpending_httpd(shared)) GOTOERROR;
+}
+// a worker can die while we're outside poll, then its SIGCHLD doesn't interrupt it
+if (shared->workers.count && !isquit_global) {
+	(void)reap_httpd(shared);
+	if (startworkers_httpd(shared)) GOTOERROR;
 }
 
 return 0;
@@ -78,10 +106,12 @@ error:
 int main(int argc, char **argv) {
 struct interfaces interfaces;
 struct shared shared;
+struct eventloop eventloop;
 time_t nextalive=0;
 
 clear_interfaces(&interfaces);
 clear_shared(&shared);
+clear_eventloop(&eventloop);
 
 if (argc<2) {
 	printusage_options();
@@ -99,9 +129,22 @@ if (shared.isquit) _exit(0);
 if (shared.options.isnodiscovery && shared.options.isnoadvertising) {
 	log_shared(&shared,1,"%s:%d warning: both SSDP discovery and advertising are disabled.\n",__FILE__,__LINE__);
 }
+if (shared.options.iswatch && shared.options.ismergefiles) {
+	log_shared(&shared,0,"%s:%d warning: --watch doesn't work with --mergefiles, ignoring it\n",__FILE__,__LINE__);
+	shared.options.iswatch=0;
+}
 if (allocs_shared(&shared)) GOTOERROR;
 if (init_interfaces(&interfaces)) GOTOERROR;
+if (shared.options.iswatch) {
+	if (init_watch(&shared)) GOTOERROR; // before the scan, it adds the watches
+}
+if (expand_scan(&shared)) GOTOERROR;
 if (init_files(&shared)) GOTOERROR;
+if (shared.options.iscontainers) {
+	if (init_containers(&shared)) GOTOERROR;
+}
+if (init_search(&shared)) GOTOERROR;
+if (init_sort(&shared)) GOTOERROR;
 {
 	uint32_t u32;
 	if (getipv4multicastip_interfaces(&u32,&interfaces)) GOTOERROR;
@@ -113,6 +156,7 @@ if (init_files(&shared)) GOTOERROR;
 }
 if (getsocket_ssdp(&shared)) GOTOERROR;
 if (getsocket_httpd(&shared)) GOTOERROR;
+if (render_httpd(&shared)) GOTOERROR; // needs the address and port
 
 if (shared.options.isbackground) {
 	pid_t pid;
@@ -126,7 +170,18 @@ if (shared.options.isbackground) {
 (ignore)signal(SIGCHLD,chld_signal_handler);
 (ignore)signal(SIGPIPE,SIG_IGN);
 
+if (shared.workers.count) {
+	if (startworkers_httpd(&shared)) GOTOERROR;
+	log_shared(&shared,1,"%s:%d started %u workers\n",__FILE__,__LINE__,shared.workers.count);
+} else {
+	if (shared.options.iseventloop) {
+		if (init_eventloop(&eventloop,&shared)) GOTOERROR;
+	}
+	(void)readyring_httpd(&shared); // forked children take it with them, see forkchild
+}
+
 while (!isquit_global && !shared.isquit) {
+	unsigned int seconds=60*5;
 	time_t now;
 
 	now=time(NULL);
@@ -139,10 +194,24 @@ while (!isquit_global && !shared.isquit) {
 		}
 		nextalive=now+60*5; // don't try again for at least 5 minutes
 	}
+	if (isready_watch(&shared,now)) {
+// the in-process eventloop copies browse replies straight out of shared, wait for them to finish
+		if (!shared.options.iseventloop || shared.workers.count || !isbrowsing_eventloop(&eventloop)) {
+			if (update_watch(&shared)) GOTOERROR;
+		}
+	}
+	if (shared.watch.isdirty) seconds=1;
+	if (shared.workers.isdelayed) seconds=1;
 		
-	if (step_mainloop(&shared,60*5)) GOTOERROR;
+	if (shared.options.iseventloop && !shared.workers.count) {
+		if (step_eventloop(&eventloop,&shared,seconds)) GOTOERROR;
+	} else {
+		if (step_mainloop(&shared,seconds)) GOTOERROR;
+	}
 }
 
+(void)stopworkers_httpd(&shared);
+
 if (!shared.options.isnoadvertising) {
 	log_shared(&shared,1,"%s:%d sending byebye messages\n",__FILE__,__LINE__);
 	if (byebyes_send_ssdp(&shared)) GOTOERROR;
@@ -150,10 +219,12 @@ if (!shared.options.isnoadvertising) {
 	if (byebyes_send_ssdp(&shared)) GOTOERROR;
 }
 
+deinit_eventloop(&eventloop);
 deinit_shared(&shared);
 // deinit_interfaces(&interfaces);
 return 0;
 error:
+	deinit_eventloop(&eventloop);
 	deinit_shared(&shared);
 	deinit_interfaces(&interfaces);
 	return -1;
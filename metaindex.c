@@ -0,0 +1,369 @@
+/*
+ * metaindex.c - keep parsed file metadata on disk between runs
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+#include "flacheader.h"
+
+#include "metaindex.h"
+
+/*
+ * The index is a cache, in host byte order:
+ *   header, entries sorted by path, flac seekpoints, then 0-terminated strings.
+ * String offsets are from the start of the file. Offset "strings" always holds an empty string.
+ * An entry's seekpoints are counted from the first one.
+ * Anything that doesn't look right is ignored and the index is rewritten.
+ */
+
+#define MAGIC_METAINDEX	"qdlnaix6"
+
+struct header_metaindex {
+	char magic[8];
+	uint32_t count;
+	uint32_t entrysize;
+	uint64_t points;
+	uint64_t pointcount;
+	uint64_t strings;
+	uint64_t size;
+};
+
+#define PARSED_FLAG_METAINDEX	1
+#define META_FLAG_METAINDEX	2
+
+struct entry_metaindex {
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t samples,audiooffset;
+	uint64_t artoffset;
+	uint32_t path;
+	uint32_t title,artist,album,date,genre;
+	uint32_t tracknumber,duration,bitrate;
+	uint32_t flags;
+	uint32_t samplerate,blocksize;
+	uint32_t seekpoint,seekcount;
+	uint32_t artsize,arttype;
+	uint32_t channels,bitspersample;
+	uint32_t artwidth,artheight;
+};
+
+static int verify(unsigned char *map, uint64_t mapsize) {
+struct header_metaindex *header;
+struct entry_metaindex *entries;
+uint64_t strings;
+uint32_t ui;
+
+if (mapsize<sizeof(struct header_metaindex)) return -1;
+header=(struct header_metaindex *)map;
+if (memcmp(header->magic,MAGIC_METAINDEX,8)) return -1;
+if (header->entrysize!=sizeof(struct entry_metaindex)) return -1;
+if (header->size!=mapsize) return -1;
+strings=header->strings;
+if (header->points!=sizeof(struct header_metaindex)+(uint64_t)header->count*sizeof(struct entry_metaindex)) return -1;
+if (header->pointcount>0xffffffff) return -1;
+if (strings!=header->points+header->pointcount*sizeof(struct seekpoint_flacheader)) return -1;
+if (strings>=mapsize) return -1;
+if (mapsize>0xffffffff) return -1;
+if (map[strings]) return -1;
+if (map[mapsize-1]) return -1; // every string is terminated
+entries=(struct entry_metaindex *)(map+sizeof(struct header_metaindex));
+for (ui=0;ui<header->count;ui++) {
+	struct entry_metaindex *e=entries+ui;
+	if ((e->path<strings)||(e->path>=mapsize)) return -1;
+	if ((e->title<strings)||(e->title>=mapsize)) return -1;
+	if ((e->artist<strings)||(e->artist>=mapsize)) return -1;
+	if ((e->album<strings)||(e->album>=mapsize)) return -1;
+	if ((e->date<strings)||(e->date>=mapsize)) return -1;
+	if ((e->genre<strings)||(e->genre>=mapsize)) return -1;
+	if ((uint64_t)e->seekpoint+e->seekcount>header->pointcount) return -1;
+	if (ui && (0<=strcmp((char *)map+entries[ui-1].path,(char *)map+e->path))) return -1;
+}
+return 0;
+}
+
+int load_metaindex(struct shared *shared) {
+char *filename=shared->options.indexfile;
+unsigned char *map=MAP_FAILED;
+struct stat statbuf;
+int fd=-1;
+
+fd=open(filename,O_RDONLY);
+if (fd<0) {
+	if (errno==ENOENT) return 0;
+	log_shared(shared,0,"%s:%d error opening index \"%s\" (%s)\n",__FILE__,__LINE__,filename,strerror(errno));
+	GOTOERROR;
+}
+if (fstat(fd,&statbuf)) GOTOERROR;
+if (!statbuf.st_size) {
+	close(fd);
+	return 0;
+}
+map=mmap(NULL,statbuf.st_size,PROT_READ,MAP_SHARED,fd,0);
+if (map==MAP_FAILED) GOTOERROR;
+close(fd); fd=-1;
+
+if (verify(map,statbuf.st_size)) {
+	log_shared(shared,0,"%s:%d ignoring damaged index \"%s\"\n",__FILE__,__LINE__,filename);
+	munmap(map,statbuf.st_size);
+	return 0;
+}
+(void)madvise(map,statbuf.st_size,MADV_RANDOM);
+shared->index.map=map;
+shared->index.mapsize=statbuf.st_size;
+return 0;
+error:
+	ifclose(fd);
+	ifmunmap(map,statbuf.st_size);
+	return -1;
+}
+
+static struct entry_metaindex *findentry(struct shared *shared, char *path) {
+unsigned char *map=shared->index.map;
+struct header_metaindex *header=(struct header_metaindex *)map;
+struct entry_metaindex *entries;
+uint32_t lo,hi;
+
+if (!map) return NULL;
+entries=(struct entry_metaindex *)(map+sizeof(struct header_metaindex));
+lo=0; hi=header->count;
+while (lo<hi) {
+	uint32_t mid=lo+(hi-lo)/2;
+	int r;
+	r=strcmp(path,(char *)map+entries[mid].path);
+	if (!r) return entries+mid;
+	if (r<0) hi=mid;
+	else lo=mid+1;
+}
+return NULL;
+}
+
+int lookup_metaindex(int *isfound_out, struct shared *shared, struct file_shared *file, struct meta_file_shared *meta) {
+// strings point into the map, which is shared with every child
+struct entry_metaindex *e;
+char *map=(char *)shared->index.map;
+
+e=findentry(shared,file->filename);
+if ( (!e) || (e->size!=file->size) || (e->mtime!=file->mtime) || !(e->flags&PARSED_FLAG_METAINDEX) ) {
+	*isfound_out=0;
+	return 0;
+}
+if (e->flags&META_FLAG_METAINDEX) {
+	meta->title=map+e->title;
+	meta->artist=map+e->artist;
+	meta->album=map+e->album;
+	meta->date=map+e->date;
+	meta->genre=map+e->genre;
+	meta->tracknumber=e->tracknumber;
+	meta->duration=e->duration;
+	meta->bitrate=e->bitrate;
+	meta->samples=e->samples;
+	meta->samplerate=e->samplerate;
+	meta->channels=e->channels;
+	meta->bitspersample=e->bitspersample;
+	meta->blocksize=e->blocksize;
+	meta->audiooffset=e->audiooffset;
+	meta->artoffset=e->artoffset;
+	meta->artsize=e->artsize;
+	meta->arttype=e->arttype;
+	meta->artwidth=e->artwidth;
+	meta->artheight=e->artheight;
+	if (e->seekcount) {
+		struct header_metaindex *header=(struct header_metaindex *)map;
+		meta->seekpoints=(struct seekpoint_flacheader *)(map+header->points)+e->seekpoint;
+		meta->seekcount=e->seekcount;
+	}
+	file->meta=meta;
+}
+file->isparsed=1;
+*isfound_out=1;
+return 0;
+}
+
+static int cmp_files(const void *a, const void *b) {
+struct file_shared * const *fa=a;
+struct file_shared * const *fb=b;
+return strcmp((*fa)->filename,(*fb)->filename);
+}
+
+static uint64_t sizeofstring(char *str) {
+if (!*str) return 0;
+return strlen(str)+1;
+}
+
+static uint32_t addstring(uint64_t *offset_inout, uint64_t strings, char *str) {
+uint64_t offset=*offset_inout;
+if (!*str) return strings;
+*offset_inout=offset+strlen(str)+1;
+return offset;
+}
+
+static int writestring(FILE *fout, char *str) {
+if (!*str) return 0;
+if (1!=fwrite(str,strlen(str)+1,1,fout)) return -1;
+return 0;
+}
+
+int save_metaindex(struct shared *shared) {
+char *filename=shared->options.indexfile;
+struct file_shared **sorted=NULL;
+struct header_metaindex header;
+char *tempname=NULL;
+FILE *fout=NULL;
+uint64_t offset,pointcount=0;
+unsigned int ui,count=0;
+
+if (!(sorted=malloc(shared->max_files*sizeof(struct file_shared *)))) GOTOERROR;
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	if (file->isremoved) continue;
+	sorted[count]=file;
+	count+=1;
+}
+qsort(sorted,count,sizeof(struct file_shared *),cmp_files);
+{ // the same file can be listed twice
+
+	unsigned int uj=0;
+	for (ui=0;ui<count;ui++) {
+		if (uj && !strcmp(sorted[uj-1]->filename,sorted[ui]->filename)) continue;
+		sorted[uj]=sorted[ui];
+		uj+=1;
+	}
+	count=uj;
+}
+
+if (!(tempname=malloc(strlen(filename)+5))) GOTOERROR;
+sprintf(tempname,"%s.new",filename);
+if (!(fout=fopen(tempname,"w"))) {
+	log_shared(shared,0,"%s:%d error writing index \"%s\" (%s)\n",__FILE__,__LINE__,tempname,strerror(errno));
+	GOTOERROR;
+}
+
+memset(&header,0,sizeof(header));
+memcpy(header.magic,MAGIC_METAINDEX,8);
+header.count=count;
+header.entrysize=sizeof(struct entry_metaindex);
+for (ui=0;ui<count;ui++) {
+	if (sorted[ui]->meta) pointcount+=sorted[ui]->meta->seekcount;
+}
+header.points=sizeof(struct header_metaindex)+(uint64_t)count*sizeof(struct entry_metaindex);
+header.pointcount=pointcount;
+header.strings=header.points+pointcount*sizeof(struct seekpoint_flacheader);
+offset=header.strings+1;
+for (ui=0;ui<count;ui++) {
+	struct file_shared *file=sorted[ui];
+	offset+=sizeofstring(file->filename);
+	if (file->meta) {
+		offset+=sizeofstring(file->meta->title);
+		offset+=sizeofstring(file->meta->artist);
+		offset+=sizeofstring(file->meta->album);
+		offset+=sizeofstring(file->meta->date);
+		offset+=sizeofstring(file->meta->genre);
+	}
+}
+header.size=offset;
+if (header.size>0xffffffff) {
+	log_shared(shared,0,"%s:%d too much metadata for an index\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (1!=fwrite(&header,sizeof(header),1,fout)) GOTOERROR;
+
+offset=header.strings+1;
+pointcount=0;
+for (ui=0;ui<count;ui++) {
+	struct file_shared *file=sorted[ui];
+	struct meta_file_shared *meta=file->meta;
+	struct entry_metaindex e;
+	memset(&e,0,sizeof(e));
+	e.size=file->size;
+	e.mtime=file->mtime;
+	e.path=addstring(&offset,header.strings,file->filename);
+	e.title=e.artist=e.album=e.date=e.genre=header.strings;
+	if (file->isparsed) e.flags|=PARSED_FLAG_METAINDEX;
+	if (meta) {
+		e.flags|=META_FLAG_METAINDEX;
+		e.title=addstring(&offset,header.strings,meta->title);
+		e.artist=addstring(&offset,header.strings,meta->artist);
+		e.album=addstring(&offset,header.strings,meta->album);
+		e.date=addstring(&offset,header.strings,meta->date);
+		e.genre=addstring(&offset,header.strings,meta->genre);
+		e.tracknumber=meta->tracknumber;
+		e.duration=meta->duration;
+		e.bitrate=meta->bitrate;
+		e.samples=meta->samples;
+		e.samplerate=meta->samplerate;
+		e.channels=meta->channels;
+		e.bitspersample=meta->bitspersample;
+		e.blocksize=meta->blocksize;
+		e.audiooffset=meta->audiooffset;
+		e.seekpoint=pointcount;
+		e.seekcount=meta->seekcount;
+		pointcount+=meta->seekcount;
+		e.artoffset=meta->artoffset;
+		e.artsize=meta->artsize;
+		e.arttype=meta->arttype;
+		e.artwidth=meta->artwidth;
+		e.artheight=meta->artheight;
+	}
+	if (1!=fwrite(&e,sizeof(e),1,fout)) GOTOERROR;
+}
+for (ui=0;ui<count;ui++) {
+	struct meta_file_shared *meta=sorted[ui]->meta;
+	if (!meta || !meta->seekcount) continue;
+	if (1!=fwrite(meta->seekpoints,meta->seekcount*sizeof(struct seekpoint_flacheader),1,fout)) GOTOERROR;
+}
+
+if (EOF==fputc(0,fout)) GOTOERROR;
+for (ui=0;ui<count;ui++) {
+	struct file_shared *file=sorted[ui];
+	struct meta_file_shared *meta=file->meta;
+	if (writestring(fout,file->filename)) GOTOERROR;
+	if (meta) {
+		if (writestring(fout,meta->title)) GOTOERROR;
+		if (writestring(fout,meta->artist)) GOTOERROR;
+		if (writestring(fout,meta->album)) GOTOERROR;
+		if (writestring(fout,meta->date)) GOTOERROR;
+		if (writestring(fout,meta->genre)) GOTOERROR;
+	}
+}
+if (fclose(fout)) {
+	fout=NULL;
+	GOTOERROR;
+}
+fout=NULL;
+// the old file stays mapped until we exit
+if (rename(tempname,filename)) GOTOERROR;
+free(tempname);
+free(sorted);
+return 0;
+error:
+	if (fout) { fclose(fout); (ignore)unlink(tempname); }
+	iffree(tempname);
+	iffree(sorted);
+	return -1;
+}
@@ -0,0 +1,3 @@
+int load_metaindex(struct shared *shared);
+int lookup_metaindex(int *isfound_out, struct shared *shared, struct file_shared *file, struct meta_file_shared *meta);
+int save_metaindex(struct shared *shared);
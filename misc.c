@@ -16,6 +16,7 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -25,6 +26,8 @@
 #include <errno.h>
 #include <poll.h>
 #include <time.h>
+#include <sys/sendfile.h>
+#include <sys/types.h>
 #if 0
 #ifdef DEBUG
 #undef DEBUG
@@ -259,6 +262,122 @@ error:
 	return -1;
 }
 
+int timeout_sendfile(int *istimeout_errorout, int *isunsupported_errorout, int fd_out, int fd_in, uint64_t *offset_inout,
+		unsigned int len, time_t expires) {
+// on unsupported, *offset_inout is left after whatever was sent so the caller can fall back
+struct pollfd pollfd;
+int istimeout=0,isunsupported=0;
+off_t offset;
+
+if (!len) return 0;
+
+offset=*offset_inout;
+pollfd.fd=fd_out;
+pollfd.events=POLLOUT;
+while (1) {
+	time_t now;
+	int r;
+
+	now=time(NULL);
+	if (expires <= now) {
+		istimeout=1;
+		GOTOERROR;
+	}
+	r=poll(&pollfd,1,(expires-now)*1000);
+	if (r<0) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	if (r && (pollfd.revents&POLLOUT)) {
+		ssize_t k;
+		k=sendfile(fd_out,fd_in,&offset,len);
+		if (k<1) {
+			if (k<0) {
+				if (errno==EINTR) continue;
+				if ((errno==EINVAL)||(errno==ENOSYS)||(errno==EOPNOTSUPP)) isunsupported=1;
+			}
+			GOTOERROR;
+		}
+		len-=k;
+		if (!len) break;
+	}
+}
+*offset_inout=offset;
+return 0;
+error:
+	*offset_inout=offset;
+	*istimeout_errorout=istimeout;
+	*isunsupported_errorout=isunsupported;
+	return -1;
+}
+
+int timeout_splice(int *istimeout_errorout, int *isunsupported_errorout, int fd_out, int fd_in, uint64_t *offset_inout,
+		unsigned int len, int *pipefds, time_t expires) {
+// moves fd_in -> pipefds -> fd_out, the pipe is empty on success
+// on unsupported, the pipe is empty and *offset_inout is left after whatever was sent
+struct pollfd pollfd;
+int istimeout=0,isunsupported=0;
+unsigned int inpipe=0;
+loff_t offset;
+
+if (!len) return 0;
+
+offset=*offset_inout;
+pollfd.fd=fd_out;
+pollfd.events=POLLOUT;
+while (1) {
+	time_t now;
+	ssize_t k;
+	int r;
+
+	if (len) {
+		k=splice(fd_in,&offset,pipefds[1],NULL,len,SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (k<1) {
+			if (!k) GOTOERROR; // file is shorter than expected
+			if (errno==EINTR) continue;
+			if (errno!=EAGAIN) { // EAGAIN => pipe is full
+				if (!inpipe && ((errno==EINVAL)||(errno==ENOSYS))) isunsupported=1;
+				GOTOERROR;
+			}
+		} else {
+			len-=k;
+			inpipe+=k;
+		}
+	}
+	if (!inpipe) {
+		if (!len) break;
+		continue;
+	}
+
+	now=time(NULL);
+	if (expires <= now) {
+		istimeout=1;
+		GOTOERROR;
+	}
+	r=poll(&pollfd,1,(expires-now)*1000);
+	if (r<0) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	if (r && (pollfd.revents&POLLOUT)) {
+		k=splice(pipefds[0],NULL,fd_out,NULL,inpipe,SPLICE_F_MOVE);
+		if (k<1) {
+			if ((k<0) && (errno==EINTR)) continue;
+			GOTOERROR;
+		}
+		inpipe-=k;
+		if (!inpipe && !len) break;
+	}
+}
+*offset_inout=offset;
+return 0;
+error:
+	*offset_inout=offset;
+	*istimeout_errorout=istimeout;
+	*isunsupported_errorout=isunsupported;
+	return -1;
+}
+
 int timeout_readpacket(int *istimeout_errorout, int fd, unsigned char *msg, unsigned int len, time_t expires) {
 struct pollfd pollfd;
 int istimeout=0;
@@ -314,3 +433,55 @@ memcpy(dest+17,src+11,8);
 memcpy(dest+26,"GMT",3);
 }
 
+void clear_readahead(struct readahead *ra) {
+static struct readahead blank={.fd=-1};
+*ra=blank;
+}
+
+static uint64_t getms(void) {
+struct timespec ts;
+if (clock_gettime(CLOCK_MONOTONIC,&ts)) return 0;
+return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+#define MIN_WINDOW_READAHEAD	(256*1024)
+#define MAX_WINDOW_READAHEAD	(16*1024*1024)
+#define SECONDS_READAHEAD	4
+
+void start_readahead(struct readahead *ra, int fd, uint64_t offset, uint64_t limit) {
+// the kernel's own readahead is small, this asks for a window sized to how fast the client drains
+ra->fd=fd;
+ra->hinted=offset;
+ra->window=MIN_WINDOW_READAHEAD;
+ra->sampleoffset=offset;
+ra->samplems=getms();
+(ignore)posix_fadvise(fd,offset,limit-offset,POSIX_FADV_SEQUENTIAL);
+(void)step_readahead(ra,offset,limit);
+}
+
+void step_readahead(struct readahead *ra, uint64_t offset, uint64_t limit) {
+// call with the send cursor as it moves
+uint64_t ms,end;
+
+if (ra->fd<0) return;
+ms=getms();
+if (offset<ra->sampleoffset) { // moved back, start a new sample
+	ra->sampleoffset=offset;
+	ra->samplems=ms;
+} else if (ms>=ra->samplems+250) {
+	uint64_t window;
+	window=(offset-ra->sampleoffset)*1000/(ms-ra->samplems)*SECONDS_READAHEAD;
+	if (window<MIN_WINDOW_READAHEAD) window=MIN_WINDOW_READAHEAD;
+	else if (window>MAX_WINDOW_READAHEAD) window=MAX_WINDOW_READAHEAD;
+	ra->window=window;
+	ra->sampleoffset=offset;
+	ra->samplems=ms;
+}
+if ((ra->hinted<offset) || (ra->hinted>offset+ra->window)) ra->hinted=offset; // moved, like a new range
+if (ra->hinted>=limit) return;
+if (ra->hinted>=offset+ra->window/2) return; // we'll ask in bigger pieces
+end=offset+ra->window;
+if (end>limit) end=limit;
+(ignore)posix_fadvise(ra->fd,ra->hinted,end-ra->hinted,POSIX_FADV_WILLNEED);
+ra->hinted=end;
+}
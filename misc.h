@@ -1,3 +1,11 @@
+struct readahead {
+	int fd;
+	uint64_t hinted; // WILLNEED has been sent for everything before this
+	uint64_t window; // how far ahead of the cursor to keep, follows the client's rate
+	uint64_t sampleoffset,samplems;
+};
+H_CLEARFUNC(readahead);
+
 
 unsigned int slowtou(char *str);
 uint64_t slowtou64(char *str);
@@ -6,5 +14,11 @@ int readn(int fd, unsigned char *msg, unsigned int len);
 int writen(int fd, unsigned char *msg, unsigned int len);
 int timeout_readn(int *istimeout_errorout, int fd, unsigned char *msg, unsigned int len, time_t expires);
 int timeout_writen(int *istimeout_errorout, int fd, unsigned char *msg, unsigned int len, time_t expires);
+int timeout_sendfile(int *istimeout_errorout, int *isunsupported_errorout, int fd_out, int fd_in, uint64_t *offset_inout,
+		unsigned int len, time_t expires);
+int timeout_splice(int *istimeout_errorout, int *isunsupported_errorout, int fd_out, int fd_in, uint64_t *offset_inout,
+		unsigned int len, int *pipefds, time_t expires);
 int timeout_readpacket(int *istimeout_errorout, int fd, unsigned char *msg, unsigned int len, time_t expires);
 void httpctime_misc(char *dest, time_t t);
+void start_readahead(struct readahead *ra, int fd, uint64_t offset, uint64_t limit);
+void step_readahead(struct readahead *ra, uint64_t offset, uint64_t limit);
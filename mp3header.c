@@ -0,0 +1,484 @@
+/*
+ * mp3header.c - read mp3 tags and duration
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "misc.h"
+
+#include "mp3header.h"
+
+/*
+ * Tags come from ID3v2 at the start of the file, with ID3v1 at the end filling in what's missing.
+ * ID3v2 frames we don't use, APIC pictures in particular, are skipped by offset without being read.
+ * The duration comes from the Xing/Info or VBRI header in the first MPEG frame. Without one, the
+ * frame headers are walked to the end of the audio, which reads the file once. The results are
+ * kept in the catalog and index=FILE.
+ */
+
+#define SIZE_WINDOW_MP3HEADER	(1024*64)
+#define MAX_TEXT_MP3HEADER	1024
+#define MAX_SYNCSEARCH_MP3HEADER	(1024*64)
+#define KEY_MP3HEADER(h)	((((h)[1]&0x1e)<<8)|((h)[2]&0x0c)) // version, layer and sample rate
+
+struct window {
+	int fd;
+	uint64_t offset; // of buffer[0] in the file
+	unsigned int len; // valid bytes in buffer
+	unsigned char buffer[SIZE_WINDOW_MP3HEADER];
+};
+
+struct mpegframe {
+	unsigned int version; // 3 => MPEG1, 2 => MPEG2, 0 => MPEG2.5
+	unsigned int layer;
+	unsigned int bitrate,samplerate,channels;
+	unsigned int samples; // per frame
+	unsigned int size; // bytes, with the header
+};
+
+static const unsigned short bitrates_global[5][16]={
+	{0,32,64,96,128,160,192,224,256,288,320,352,384,416,448,0}, // MPEG1 layer 1
+	{0,32,48,56,64,80,96,112,128,160,192,224,256,320,384,0}, // MPEG1 layer 2
+	{0,32,40,48,56,64,80,96,112,128,160,192,224,256,320,0}, // MPEG1 layer 3
+	{0,32,48,56,64,80,96,112,128,144,160,176,192,224,256,0}, // MPEG2 and 2.5 layer 1
+	{0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0}}; // MPEG2 and 2.5 layers 2 and 3
+static const unsigned int samplerates_global[3]={44100,48000,32000};
+
+static char *genres_global[]={"Blues","Classic Rock","Country","Dance","Disco","Funk","Grunge","Hip-Hop","Jazz",
+	"Metal","New Age","Oldies","Other","Pop","R&B","Rap","Reggae","Rock","Techno","Industrial","Alternative","Ska",
+	"Death Metal","Pranks","Soundtrack","Euro-Techno","Ambient","Trip-Hop","Vocal","Jazz+Funk","Fusion","Trance",
+	"Classical","Instrumental","Acid","House","Game","Sound Clip","Gospel","Noise","AlternRock","Bass","Soul","Punk",
+	"Space","Meditative","Instrumental Pop","Instrumental Rock","Ethnic","Gothic","Darkwave","Techno-Industrial",
+	"Electronic","Pop-Folk","Eurodance","Dream","Southern Rock","Comedy","Cult","Gangsta","Top 40","Christian Rap",
+	"Pop/Funk","Jungle","Native American","Cabaret","New Wave","Psychadelic","Rave","Showtunes","Trailer","Lo-Fi",
+	"Tribal","Acid Punk","Acid Jazz","Polka","Retro","Musical","Rock & Roll","Hard Rock"};
+#define COUNT_GENRES_MP3HEADER	(sizeof(genres_global)/sizeof(char *))
+
+static unsigned int charstouint2(unsigned char *c) {
+return (c[0]<<24)|(c[1]<<16)|(c[2]<<8)|c[3];
+}
+
+static unsigned int charstouintr(unsigned char *c) {
+return (c[3]<<24)|(c[2]<<16)|(c[1]<<8)|c[0];
+}
+
+static unsigned int syncsafe(unsigned char *c) {
+return ((c[0]&0x7f)<<21)|((c[1]&0x7f)<<14)|((c[2]&0x7f)<<7)|(c[3]&0x7f);
+}
+
+static int preadall(int fd, unsigned char *dest, unsigned int len, uint64_t offset, unsigned int *got_out) {
+// *got_out is short only at the end of the file
+unsigned int got=0;
+while (got<len) {
+	ssize_t k;
+	k=pread(fd,dest+got,len-got,offset+got);
+	if (k<0) GOTOERROR;
+	if (!k) break;
+	got+=k;
+}
+*got_out=got;
+return 0;
+error:
+	return -1;
+}
+
+static int get_window(unsigned char **data_out, struct window *w, uint64_t offset, unsigned int len) {
+// len<=SIZE_WINDOW_MP3HEADER, -1 if the file is shorter
+if ((offset<w->offset) || (offset+len>w->offset+w->len)) {
+	if (preadall(w->fd,w->buffer,SIZE_WINDOW_MP3HEADER,offset,&w->len)) GOTOERROR;
+	w->offset=offset;
+	if (len>w->len) goto error;
+}
+*data_out=w->buffer+(offset-w->offset);
+return 0;
+error:
+	return -1;
+}
+
+static int pututf8(char *dest, unsigned int *len_inout, unsigned int cp) {
+// -1 => dest is full
+unsigned int len=*len_inout;
+unsigned int n;
+
+n=(cp<0x80)?1:((cp<0x800)?2:((cp<0x10000)?3:4));
+if (len+n>MAXSTR_MP3HEADER) return -1;
+switch (n) {
+	case 1: dest[len]=cp; break;
+	case 2: dest[len]=0xc0|(cp>>6); dest[len+1]=0x80|(cp&0x3f); break;
+	case 3: dest[len]=0xe0|(cp>>12); dest[len+1]=0x80|((cp>>6)&0x3f); dest[len+2]=0x80|(cp&0x3f); break;
+	default: dest[len]=0xf0|(cp>>18); dest[len+1]=0x80|((cp>>12)&0x3f); dest[len+2]=0x80|((cp>>6)&0x3f);
+			dest[len+3]=0x80|(cp&0x3f); break;
+}
+*len_inout=len+n;
+return 0;
+}
+
+static void copytext(char *dest, unsigned char *data, unsigned int len) {
+// the first string of an ID3v2 text frame, as UTF-8
+unsigned int ui,n=0;
+
+if (!len) return;
+switch (data[0]) {
+	case 0: // ISO-8859-1
+		for (ui=1;(ui<len) && data[ui];ui++) {
+			if (pututf8(dest,&n,data[ui])) break;
+		}
+		break;
+	case 3: // UTF-8
+		for (ui=1;(ui<len) && data[ui] && (n<MAXSTR_MP3HEADER);ui++) dest[n++]=data[ui];
+		if ((ui<len) && data[ui]) { // cut short, don't leave half a character
+			while (n && ((dest[n-1]&0xc0)==0x80)) n--;
+			if (n && (dest[n-1]&0x80)) n--;
+		}
+		break;
+	case 1: // UTF-16 with a BOM
+	case 2: // UTF-16BE
+		{
+			int isle=0;
+			ui=1;
+			if ((data[0]==1) && (len>=3)) {
+				if ((data[1]==0xff) && (data[2]==0xfe)) { isle=1; ui=3; }
+				else if ((data[1]==0xfe) && (data[2]==0xff)) ui=3;
+			}
+			for (;ui+1<len;ui+=2) {
+				unsigned int cp;
+				cp=isle?(data[ui]|(data[ui+1]<<8)):((data[ui]<<8)|data[ui+1]);
+				if (!cp) break;
+				if ((cp>=0xd800) && (cp<0xdc00) && (ui+3<len)) {
+					unsigned int low;
+					low=isle?(data[ui+2]|(data[ui+3]<<8)):((data[ui+2]<<8)|data[ui+3]);
+					if ((low>=0xdc00) && (low<0xe000)) {
+						cp=0x10000+((cp-0xd800)<<10)+(low-0xdc00);
+						ui+=2;
+					}
+				}
+				if (pututf8(dest,&n,cp)) break;
+			}
+		}
+		break;
+}
+dest[n]='\0';
+}
+
+static void copylatin1(char *dest, unsigned char *data, unsigned int len) {
+// ID3v1 fields are padded with spaces or zeros
+unsigned int ui,n=0;
+while (len && ((data[len-1]==' ') || !data[len-1])) len--;
+for (ui=0;(ui<len) && data[ui];ui++) {
+	if (pututf8(dest,&n,data[ui])) break;
+}
+dest[n]='\0';
+}
+
+static void fixgenre(char *genre) {
+// "(17)", "17" and "(17)Rock" are ID3v1 genre numbers
+char *cursor=genre;
+unsigned int number=0;
+
+if (*cursor=='(') cursor++;
+if (!isdigit(*cursor)) return;
+for (;isdigit(*cursor);cursor++) number=number*10+(*cursor-'0');
+if (*genre=='(') {
+	if (*cursor!=')') return;
+	cursor++;
+	if (*cursor) {
+		memmove(genre,cursor,strlen(cursor)+1);
+		return;
+	}
+} else if (*cursor) {
+	return; // "2Pac"
+}
+if (number<COUNT_GENRES_MP3HEADER) strcpy(genre,genres_global[number]);
+else genre[0]='\0';
+}
+
+static unsigned int unsync(unsigned char *data, unsigned int len) {
+// undoes ID3v2 unsynchronisation in place, FF 00 => FF
+unsigned int ui,uj=0;
+for (ui=0;ui<len;ui++) {
+	data[uj++]=data[ui];
+	if ((data[ui]==0xff) && (ui+1<len) && !data[ui+1]) ui++;
+}
+return uj;
+}
+
+static int parseid3v2(struct mp3header *dest, struct window *w, uint64_t *offset_inout) {
+// 1 => there was a tag at *offset_inout, it's moved past it
+unsigned char *data;
+uint64_t offset=*offset_inout,end;
+unsigned int version,flags;
+
+if (get_window(&data,w,offset,10)) return 0;
+if (memcmp(data,"ID3",3)) return 0;
+version=data[3];
+flags=data[5];
+if ((version<2) || (version>4) || (data[4]==0xff)) return 0;
+end=offset+10+syncsafe(data+6);
+*offset_inout=(flags&0x10)?end+10:end; // a v2.4 footer
+offset+=10;
+if (flags&0x40) {
+	if (version==2) return 1; // compressed, there's nothing we can read
+	if (get_window(&data,w,offset,4)) return 1;
+	offset+=(version==3)?4+charstouint2(data):syncsafe(data); // an extended header
+}
+
+while (1) {
+	unsigned char text[MAX_TEXT_MP3HEADER];
+	char track[MAXSTR_MP3HEADER+1];
+	unsigned int hlen,len,format=0,skip=0;
+	char id[5],*field=NULL;
+	int isunsync;
+
+	hlen=(version==2)?6:10;
+	if (offset+hlen>end) break;
+	if (get_window(&data,w,offset,hlen)) break;
+	if (!data[0]) break; // padding
+	if (version==2) {
+		memcpy(id,data,3); id[3]='\0';
+		len=(data[3]<<16)|(data[4]<<8)|data[5];
+	} else {
+		memcpy(id,data,4); id[4]='\0';
+		len=(version==4)?syncsafe(data+4):charstouint2(data+4);
+		format=data[9];
+	}
+	offset+=hlen;
+	if (len>end-offset) break;
+
+	if (!strcmp(id,"TIT2") || !strcmp(id,"TT2")) field=dest->title;
+	else if (!strcmp(id,"TPE1") || !strcmp(id,"TP1")) field=dest->artist;
+	else if (!strcmp(id,"TALB") || !strcmp(id,"TAL")) field=dest->album;
+	else if (!strcmp(id,"TCON") || !strcmp(id,"TCO")) field=dest->genre;
+	else if (!strcmp(id,"TDRC")) field=dest->date;
+	else if (!strcmp(id,"TYER") || !strcmp(id,"TYE")) { if (!*dest->date) field=dest->date; }
+	else if (!strcmp(id,"TRCK") || !strcmp(id,"TRK")) field=track;
+	isunsync=flags&0x80;
+	if (version==3) {
+		if (format&0xc0) field=NULL; // compressed or encrypted
+		if (format&0x20) skip+=1;
+	} else if (version==4) {
+		if (format&0x0c) field=NULL; // compressed or encrypted
+		if (format&0x40) skip+=1;
+		if (format&0x01) skip+=4;
+		if (format&0x02) isunsync=1;
+	}
+	if (field && (len>skip)) {
+		unsigned int n;
+		n=len-skip;
+		if (n>MAX_TEXT_MP3HEADER) n=MAX_TEXT_MP3HEADER;
+		if (get_window(&data,w,offset+skip,n)) break;
+		memcpy(text,data,n);
+		if (isunsync) n=unsync(text,n);
+		copytext(field,text,n);
+		if (field==track) dest->tracknumber=slowtou(track);
+	}
+	offset+=len; // everything else, APIC included, is skipped without reading it
+}
+return 1;
+}
+
+static void parseid3v1(struct mp3header *dest, struct window *w, uint64_t *end_inout) {
+// fills in what ID3v2 didn't have, and moves the end of the audio back
+unsigned char *data;
+
+if (*end_inout<128) return;
+if (get_window(&data,w,*end_inout-128,128)) return;
+if (memcmp(data,"TAG",3)) return;
+*end_inout-=128;
+if (!*dest->title) copylatin1(dest->title,data+3,30);
+if (!*dest->artist) copylatin1(dest->artist,data+33,30);
+if (!*dest->album) copylatin1(dest->album,data+63,30);
+if (!*dest->date) copylatin1(dest->date,data+93,4);
+if (!dest->tracknumber && !data[125]) dest->tracknumber=data[126]; // ID3v1.1
+if (!*dest->genre && (data[127]<COUNT_GENRES_MP3HEADER)) strcpy(dest->genre,genres_global[data[127]]);
+}
+
+static void skipape(struct window *w, uint64_t start, uint64_t *end_inout) {
+// an APEv2 tag at the end of the audio
+unsigned char *data;
+uint64_t len;
+
+if (*end_inout<start+32) return;
+if (get_window(&data,w,*end_inout-32,32)) return;
+if (memcmp(data,"APETAGEX",8)) return;
+len=charstouintr(data+12); // with the footer
+if (charstouintr(data+20)&0x80000000) len+=32; // a header too
+if (len>*end_inout-start) return;
+*end_inout-=len;
+}
+
+static int parseframe(struct mpegframe *f, unsigned char *h) {
+// 1 => h is a frame header we can use
+unsigned int version,layer,index,srindex,table,ispadded;
+
+if ((h[0]!=0xff) || ((h[1]&0xe0)!=0xe0)) return 0;
+version=(h[1]>>3)&3;
+layer=4-((h[1]>>1)&3);
+if ((version==1) || (layer==4)) return 0; // reserved
+index=h[2]>>4;
+if (!index || (index==15)) return 0; // free format isn't handled
+srindex=(h[2]>>2)&3;
+if (srindex==3) return 0;
+if ((h[3]&3)==2) return 0; // reserved emphasis
+table=(version==3)?layer-1:((layer==1)?3:4);
+ispadded=(h[2]>>1)&1;
+f->version=version;
+f->layer=layer;
+f->bitrate=bitrates_global[table][index]*1000;
+f->samplerate=samplerates_global[srindex]>>((version==3)?0:((version==2)?1:2));
+f->channels=((h[3]>>6)==3)?1:2;
+f->samples=(layer==1)?384:(((layer==3) && (version!=3))?576:1152);
+if (layer==1) f->size=(12*f->bitrate/f->samplerate+ispadded)*4;
+else f->size=(f->samples/8)*f->bitrate/f->samplerate+ispadded;
+return 1;
+}
+
+static int findfirst(uint64_t *offset_out, struct mpegframe *f, struct window *w, uint64_t offset, uint64_t end) {
+// 1 => found a frame header that's followed by another like it
+uint64_t limit;
+
+limit=offset+MAX_SYNCSEARCH_MP3HEADER;
+if (limit>end) limit=end;
+for (;offset+4<=limit;offset++) {
+	struct mpegframe next;
+	unsigned char *data;
+	unsigned int key;
+	if (get_window(&data,w,offset,4)) break;
+	if (!parseframe(f,data)) continue;
+	key=KEY_MP3HEADER(data);
+	if (offset+f->size+4<=end) {
+		if (get_window(&data,w,offset+f->size,4)) continue;
+		if (!parseframe(&next,data) || (KEY_MP3HEADER(data)!=key)) continue;
+	} else if (offset+f->size!=end) {
+		continue; // a lone frame has to end the audio
+	}
+	*offset_out=offset;
+	return 1;
+}
+return 0;
+}
+
+static int readvbr(uint64_t *frames_out, uint64_t *bytes_out, struct window *w, uint64_t offset, struct mpegframe *f) {
+// 1 => the first frame is a Xing/Info or VBRI header with a frame count, bytes can be 0
+unsigned char *data;
+unsigned int side;
+
+if (f->version==3) side=(f->channels==1)?17:32;
+else side=(f->channels==1)?9:17;
+if (!get_window(&data,w,offset+4+side,16) && (!memcmp(data,"Xing",4) || !memcmp(data,"Info",4))) {
+	unsigned int flags;
+	flags=charstouint2(data+4);
+	if (!(flags&1)) return 0;
+	*frames_out=charstouint2(data+8);
+	*bytes_out=(flags&2)?charstouint2(data+12):0;
+	return 1;
+}
+if (!get_window(&data,w,offset+36,18) && !memcmp(data,"VBRI",4)) {
+	*bytes_out=charstouint2(data+10);
+	*frames_out=charstouint2(data+14);
+	return 1;
+}
+return 0;
+}
+
+static uint64_t countframes(struct window *w, unsigned char *first, uint64_t offset, uint64_t end) {
+// walks the frame headers, junk between frames is skipped a byte at a time
+unsigned int key=KEY_MP3HEADER(first);
+uint64_t frames=0;
+
+while (offset+4<=end) {
+	struct mpegframe f;
+	unsigned char *data;
+	if (get_window(&data,w,offset,4)) break;
+	if (parseframe(&f,data) && (KEY_MP3HEADER(data)==key) && (f.size<=end-offset)) {
+		frames+=1;
+		offset+=f.size;
+	} else {
+		offset+=1;
+	}
+}
+return frames;
+}
+
+static int readheaderfromfile(struct mp3header *dest, char *filename) {
+struct window *w=NULL;
+struct mpegframe f;
+struct stat statbuf;
+uint64_t offset=0,end,first,frames=0,bytes=0;
+int istag=0;
+
+if (!(w=malloc(sizeof(struct window)))) GOTOERROR;
+w->offset=w->len=0;
+w->fd=open(filename,O_RDONLY|O_CLOEXEC);
+if (w->fd<0) GOTOERROR;
+if (fstat(w->fd,&statbuf)) GOTOERROR;
+
+while (parseid3v2(dest,w,&offset)) istag=1;
+end=statbuf.st_size;
+if (offset>end) offset=end;
+(void)parseid3v1(dest,w,&end);
+if (end!=(uint64_t)statbuf.st_size) istag=1;
+(void)skipape(w,offset,&end);
+if (*dest->genre) (void)fixgenre(dest->genre);
+dest->audiooffset=offset;
+
+if (!findfirst(&first,&f,w,offset,end)) {
+	if (!istag) goto error; // not an mp3
+} else {
+	uint64_t samples;
+	dest->audiooffset=first;
+	dest->samplerate=f.samplerate;
+	dest->channels=f.channels;
+	if (!readvbr(&frames,&bytes,w,first,&f)) {
+		unsigned char header[4];
+		unsigned char *data;
+		if (get_window(&data,w,first,4)) GOTOERROR;
+		memcpy(header,data,4);
+		frames=countframes(w,header,first,end);
+	}
+	if (!bytes) bytes=end-first;
+	samples=frames*f.samples;
+	dest->frames=frames;
+	dest->duration=(unsigned int)(samples/f.samplerate);
+	if (samples) dest->bitrate=(unsigned int)((bytes*8*f.samplerate)/samples);
+}
+
+close(w->fd);
+free(w);
+return 0;
+error:
+	if (w) {
+		ifclose(w->fd);
+		free(w);
+	}
+	return -1;
+}
+
+int read_mp3header(struct mp3header *dest, char *filename) {
+memset(dest,0,sizeof(struct mp3header));
+if (readheaderfromfile(dest,filename)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
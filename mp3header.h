@@ -0,0 +1,19 @@
+#define MAXSTR_MP3HEADER	256
+
+struct mp3header {
+	char title[MAXSTR_MP3HEADER+1]; // UTF-8
+	char artist[MAXSTR_MP3HEADER+1];
+	char album[MAXSTR_MP3HEADER+1];
+	char date[MAXSTR_MP3HEADER+1];
+	char genre[MAXSTR_MP3HEADER+1];
+	unsigned int tracknumber;
+
+	unsigned int duration; // in seconds, 0 => dunno
+	unsigned int bitrate; // average, bits per second, 0 => dunno
+	unsigned int samplerate;
+	unsigned int channels;
+	uint64_t frames; // MPEG frames, not counting a Xing or VBRI frame
+	uint64_t audiooffset; // first frame, after any ID3v2 tags
+};
+
+int read_mp3header(struct mp3header *dest, char *filename);
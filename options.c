@@ -60,6 +60,19 @@ shared->server.instance=slowtou(str);
 static void addchildren(struct shared *shared, char *str) {
 shared->children.max=slowtou(str);
 }
+static void addworkers(struct shared *shared, char *str) {
+shared->workers.count=slowtou(str);
+}
+static void addbacklog(struct shared *shared, char *str) {
+shared->pending.backlog=slowtou(str);
+}
+static void addpending(struct shared *shared, char *str) {
+shared->pending.max=slowtou(str);
+}
+
+static void addscanthreads(struct shared *shared, char *str) {
+shared->options.scanthreads=slowtou(str);
+}
 
 static int allocfiles(struct shared *shared, int max) {
 struct file_shared **files;
@@ -78,6 +91,10 @@ if (!(file=ALLOC_blockmem(&shared->blockmem,struct file_shared))) GOTOERROR;
 file->size=0;
 if (!(file->filename=align64_strdup_blockmem(&shared->blockmem,filename))) GOTOERROR;
 file->type=0;
+file->mtime=0;
+file->isparsed=0;
+file->meta=NULL;
+file->didl=NULL;
 shared->files[index]=file;
 return 0;
 error:
@@ -85,10 +102,15 @@ error:
 }
 
 void printusage_options(void) {
-fputs("Usage: quickdlna [FILE]..[FILE] [option]..[option] [flag]..[flag]\n",stdout);
+fputs("Usage: quickdlna [FILE|DIR]..[FILE|DIR] [option]..[option] [flag]..[flag]\n",stdout);
 fputs("Options:\n",stdout);
 fputs("   instance=INT     : allows multiple copies, given different values\n",stdout);
 fputs("   children=INT     : allow this many simultaneous requests\n",stdout);
+fputs("   workers=INT      : prefork this many long-lived workers instead\n",stdout);
+fputs("   backlog=INT      : let the kernel queue this many connections\n",stdout);
+fputs("   pending=INT      : hold this many connections while children are busy\n",stdout);
+fputs("   index=FILE       : keep file metadata in FILE between runs\n",stdout);
+fputs("   scanthreads=INT  : read directories with this many threads\n",stdout);
 fputs("   targetip=IPV4    : instead of multicast, send only to the given IP\n",stdout);
 fputs("   name=STRING      : use XX as the server name\n",stdout);
 fputs("   machine=STRING   : use XX as the server type\n",stdout);
@@ -103,6 +125,10 @@ fputs("   --verbose        : print extra messages\n",stdout);
 fputs("   --syslog         : print messages to syslog\n",stdout);
 fputs("   --background     : run in background, enables --syslog\n",stdout);
 fputs("   --mergefiles     : merge all files into one, should be flacs\n",stdout);
+fputs("   --eventloop      : serve all requests from one process, without forking\n",stdout);
+fputs("   --iouring        : read files with io_uring, if the kernel supports it\n",stdout);
+fputs("   --containers     : browse by artist, album, genre and folder\n",stdout);
+fputs("   --watch          : follow changes under directory arguments\n",stdout);
 }
 
 int init_options(struct shared *shared, int argc, char **argv) {
@@ -125,6 +151,16 @@ for (idx=1;idx<argc;idx++) {
 		(void)addinstance(shared,arg+9);
 	} else if (!strncmp(arg,"children=",9)) {
 		(void)addchildren(shared,arg+9);
+	} else if (!strncmp(arg,"workers=",8)) {
+		(void)addworkers(shared,arg+8);
+	} else if (!strncmp(arg,"backlog=",8)) {
+		(void)addbacklog(shared,arg+8);
+	} else if (!strncmp(arg,"pending=",8)) {
+		(void)addpending(shared,arg+8);
+	} else if (!strncmp(arg,"scanthreads=",12)) {
+		(void)addscanthreads(shared,arg+12);
+	} else if (!strncmp(arg,"index=",6)) {
+		shared->options.indexfile=arg+6;
 	} else if (!strncmp(arg,"--",2)) {
 		if (!strcmp(arg,"--help")) {
 			printusage_options();
@@ -146,6 +182,14 @@ for (idx=1;idx<argc;idx++) {
 			shared->options.isbackground=1;
 		} else if (!strcmp(arg,"--mergefiles")) {
 			shared->options.ismergefiles=1;
+		} else if (!strcmp(arg,"--eventloop")) {
+			shared->options.iseventloop=1;
+		} else if (!strcmp(arg,"--iouring")) {
+			shared->options.isiouring=1;
+		} else if (!strcmp(arg,"--containers")) {
+			shared->options.iscontainers=1;
+		} else if (!strcmp(arg,"--watch")) {
+			shared->options.iswatch=1;
 		} else {
 			log_shared(shared,0,"%s:%d unknown argument \"%s\"\n",__FILE__,__LINE__,arg);
 			GOTOERROR;
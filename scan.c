@@ -0,0 +1,383 @@
+/*
+ * scan.c - find files under directory arguments
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+#include "files.h"
+#include "watch.h"
+
+#include "scan.h"
+
+/*
+ * Each directory argument is walked by scanthreads threads sharing one queue of directories. A
+ * thread reads a directory with getdents64, queues the subdirectories and keeps the names with
+ * our extensions, statx'ing only those. d_type saves a stat for everything else. Each thread keeps
+ * its own list, and they're merged and sorted by path at the end so the order doesn't depend on
+ * the timing. watch.c uses the same walk for directories that change, one level at a time.
+ */
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct dir_scan {
+	struct dir_scan *next;
+	char *path;
+};
+
+struct queue_scan {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct dir_scan *first;
+	unsigned int busy; // threads reading a directory, they can add more
+	int iserror;
+	int isrecursive; // => queue subdirectories
+	struct shared *shared;
+};
+
+struct thread_scan {
+	pthread_t thread;
+	int isstarted;
+	struct queue_scan *queue;
+	struct blockmem blockmem; // paths
+	struct found_scan *found; // realloc'd
+	unsigned int count,max;
+	struct watched_scan {
+		int wd;
+		char *path;
+	} *watched; // realloc'd, with --watch
+	unsigned int watchedcount,watchedmax,unwatched;
+	int iserror;
+#define SIZE_DENTS_SCAN	(32*1024)
+	unsigned char dents[SIZE_DENTS_SCAN];
+};
+
+static int adddir(struct thread_scan *t, char *path) {
+struct dir_scan *dir;
+if (!(dir=ALLOC_blockmem(&t->blockmem,struct dir_scan))) GOTOERROR;
+dir->path=path;
+pthread_mutex_lock(&t->queue->mutex);
+dir->next=t->queue->first;
+t->queue->first=dir;
+pthread_cond_signal(&t->queue->cond);
+pthread_mutex_unlock(&t->queue->mutex);
+return 0;
+error:
+	return -1;
+}
+
+static int addfound(struct thread_scan *t, char *path, int type, struct statx *stx) {
+struct found_scan *f;
+if (t->count==t->max) {
+	unsigned int max=t->max?t->max*2:1024;
+	if (!(f=realloc(t->found,max*sizeof(struct found_scan)))) GOTOERROR;
+	t->found=f;
+	t->max=max;
+}
+f=t->found+t->count;
+f->path=path;
+f->type=type;
+f->size=stx->stx_size;
+f->mtime=(uint64_t)stx->stx_mtime.tv_sec*1000000000+stx->stx_mtime.tv_nsec;
+t->count+=1;
+return 0;
+error:
+	return -1;
+}
+
+static int addwatched(struct thread_scan *t, char *dirpath) {
+// inotify_add_watch on a directory we've already opened, the result is copied after the threads join
+struct watched_scan *w;
+int wd;
+if (0>(wd=inotify_add_watch(t->queue->shared->watch.fd,dirpath,MASK_WATCH))) {
+	t->unwatched+=1;
+	return 0;
+}
+if (t->watchedcount==t->watchedmax) {
+	unsigned int max=t->watchedmax?t->watchedmax*2:64;
+	if (!(w=realloc(t->watched,max*sizeof(struct watched_scan)))) GOTOERROR;
+	t->watched=w;
+	t->watchedmax=max;
+}
+w=t->watched+t->watchedcount;
+w->wd=wd;
+w->path=dirpath;
+t->watchedcount+=1;
+return 0;
+error:
+	return -1;
+}
+
+static char *joinpath(struct thread_scan *t, char *dir, unsigned int dirlen, char *name, unsigned int namelen) {
+char *path;
+if (dirlen && (dir[dirlen-1]=='/')) dirlen-=1; // "/"
+if (!(path=alloc_blockmem(&t->blockmem,dirlen+namelen+2))) return NULL;
+memcpy(path,dir,dirlen);
+path[dirlen]='/';
+memcpy(path+dirlen+1,name,namelen+1);
+return path;
+}
+
+static int walkdir(struct thread_scan *t, char *dirpath) {
+struct shared *shared=t->queue->shared;
+unsigned int dirlen;
+int fd=-1;
+
+dirlen=strlen(dirpath);
+if (0>(fd=open(dirpath,O_RDONLY|O_DIRECTORY|O_CLOEXEC))) {
+	if (t->queue->isrecursive) log_shared(shared,0,"%s:%d warning: couldn't open directory \"%s\"\n",__FILE__,__LINE__,dirpath);
+	return 0; // watch.c rescans directories that are gone
+}
+if (shared->watch.fd>=0) {
+	if (addwatched(t,dirpath)) GOTOERROR;
+}
+while (1) {
+	long n,offset;
+	n=syscall(SYS_getdents64,fd,t->dents,SIZE_DENTS_SCAN);
+	if (n<=0) {
+		if (n<0) log_shared(shared,0,"%s:%d warning: couldn't read directory \"%s\"\n",__FILE__,__LINE__,dirpath);
+		break;
+	}
+	for (offset=0;offset<n;) {
+		struct linux_dirent64 *d=(struct linux_dirent64 *)(t->dents+offset);
+		unsigned int namelen;
+		int type;
+		char *path;
+
+		offset+=d->d_reclen;
+		if (d->d_name[0]=='.') continue; // ".", ".." and hidden files
+		namelen=strlen(d->d_name);
+		if (d->d_type==DT_DIR) {
+			if (!t->queue->isrecursive) continue;
+			if (!(path=joinpath(t,dirpath,dirlen,d->d_name,namelen))) GOTOERROR;
+			if (adddir(t,path)) GOTOERROR;
+			continue;
+		}
+		if ((d->d_type!=DT_REG) && (d->d_type!=DT_LNK) && (d->d_type!=DT_UNKNOWN)) continue;
+		type=gettype_files(d->d_name,namelen);
+		if (!type && (d->d_type!=DT_UNKNOWN)) continue;
+		{
+			struct statx stx;
+			if (statx(fd,d->d_name,AT_NO_AUTOMOUNT,STATX_TYPE|STATX_SIZE|STATX_MTIME,&stx)) continue; // e.g. a dangling link
+			if (S_ISDIR(stx.stx_mode)) {
+				if (d->d_type!=DT_UNKNOWN) continue; // don't follow links to directories, they can loop
+				if (!t->queue->isrecursive) continue;
+				if (!(path=joinpath(t,dirpath,dirlen,d->d_name,namelen))) GOTOERROR;
+				if (adddir(t,path)) GOTOERROR;
+				continue;
+			}
+			if (!type || !S_ISREG(stx.stx_mode)) continue;
+			if (!(path=joinpath(t,dirpath,dirlen,d->d_name,namelen))) GOTOERROR;
+			if (addfound(t,path,type,&stx)) GOTOERROR;
+		}
+	}
+}
+close(fd);
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+static void *thread_scan(void *arg) {
+struct thread_scan *t=(struct thread_scan *)arg;
+struct queue_scan *queue=t->queue;
+
+pthread_mutex_lock(&queue->mutex);
+while (1) {
+	struct dir_scan *dir;
+	while (!queue->first && queue->busy && !queue->iserror) pthread_cond_wait(&queue->cond,&queue->mutex);
+	if (!queue->first || queue->iserror) break;
+	dir=queue->first;
+	queue->first=dir->next;
+	queue->busy+=1;
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (walkdir(t,dir->path)) t->iserror=1;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->busy-=1;
+	if (t->iserror) queue->iserror=1;
+	if ((!queue->first && !queue->busy) || queue->iserror) pthread_cond_broadcast(&queue->cond);
+}
+pthread_mutex_unlock(&queue->mutex);
+return NULL;
+}
+
+static void freethreads(struct thread_scan *threads, unsigned int threadcount, struct queue_scan *queue) {
+unsigned int ui;
+if (threads) {
+	for (ui=0;ui<threadcount;ui++) {
+		iffree(threads[ui].found);
+		iffree(threads[ui].watched);
+		deinit_blockmem(&threads[ui].blockmem);
+	}
+	free(threads);
+}
+pthread_cond_destroy(&queue->cond);
+pthread_mutex_destroy(&queue->mutex);
+}
+
+static int cmp_found(const void *a, const void *b) {
+return strcmp(((struct found_scan *)a)->path,((struct found_scan *)b)->path);
+}
+
+int find_scan(struct found_scan **found_out, unsigned int *count_out, struct shared *shared, struct blockmem *blockmem,
+		char *root, int isrecursive) {
+// *found_out is malloc'd, paths are in blockmem; with --watch, every directory read is watched
+struct queue_scan queue;
+struct thread_scan *threads=NULL;
+struct found_scan *found=NULL;
+unsigned int ui,count=0,threadcount,unwatched=0;
+
+threadcount=shared->options.scanthreads;
+if (!threadcount || !isrecursive) threadcount=1;
+queue.first=NULL;
+queue.busy=0;
+queue.iserror=0;
+queue.isrecursive=isrecursive;
+queue.shared=shared;
+pthread_mutex_init(&queue.mutex,NULL);
+pthread_cond_init(&queue.cond,NULL);
+
+if (!(threads=calloc(threadcount,sizeof(struct thread_scan)))) GOTOERROR;
+for (ui=0;ui<threadcount;ui++) {
+	threads[ui].queue=&queue;
+	if (init_blockmem(&threads[ui].blockmem,0)) GOTOERROR;
+}
+if (adddir(&threads[0],root)) GOTOERROR;
+for (ui=0;ui<threadcount;ui++) {
+	if (pthread_create(&threads[ui].thread,NULL,thread_scan,&threads[ui])) {
+		if (!ui) GOTOERROR; // with one thread we still finish
+		break;
+	}
+	threads[ui].isstarted=1;
+}
+for (ui=0;ui<threadcount;ui++) {
+	if (threads[ui].isstarted) (ignore)pthread_join(threads[ui].thread,NULL);
+}
+if (queue.iserror) GOTOERROR;
+
+for (ui=0;ui<threadcount;ui++) count+=threads[ui].count;
+if (!(found=malloc((count+1)*sizeof(struct found_scan)))) GOTOERROR;
+count=0;
+for (ui=0;ui<threadcount;ui++) {
+	struct thread_scan *t=&threads[ui];
+	unsigned int uj;
+	for (uj=0;uj<t->count;uj++) {
+		found[count]=t->found[uj];
+		if (!(found[count].path=align64_strdup_blockmem(blockmem,t->found[uj].path))) GOTOERROR;
+		count+=1;
+	}
+	for (uj=0;uj<t->watchedcount;uj++) {
+		if (setdir_watch(shared,t->watched[uj].wd,t->watched[uj].path)) GOTOERROR;
+	}
+	unwatched+=t->unwatched;
+}
+if (unwatched) {
+	log_shared(shared,0,"%s:%d warning: couldn't watch %u directories under \"%s\", see fs.inotify.max_user_watches\n",
+			__FILE__,__LINE__,unwatched,root);
+}
+qsort(found,count,sizeof(struct found_scan),cmp_found);
+*found_out=found;
+*count_out=count;
+freethreads(threads,threadcount,&queue);
+return 0;
+error:
+	iffree(found);
+	freethreads(threads,threadcount,&queue);
+	return -1;
+}
+
+int expand_scan(struct shared *shared) {
+// replaces directory arguments with the files under them
+struct file_shared **files=NULL;
+unsigned int ui,count=0,max;
+int isdirs=0;
+
+max=shared->max_files;
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	struct statx stx;
+	struct found_scan *found=NULL;
+	unsigned int foundcount,uj,len;
+
+	if (statx(AT_FDCWD,file->filename,0,STATX_TYPE,&stx) || !S_ISDIR(stx.stx_mode)) {
+		if (isdirs) files[count]=file;
+		count+=1;
+		continue;
+	}
+	len=strlen(file->filename);
+	while ((len>1) && (file->filename[len-1]=='/')) file->filename[--len]=0;
+	if (find_scan(&found,&foundcount,shared,&shared->blockmem,file->filename,1)) GOTOERROR;
+	log_shared(shared,1,"%s:%d found %u files under \"%s\"\n",__FILE__,__LINE__,foundcount,file->filename);
+	max+=foundcount;
+	if (!isdirs) {
+		struct file_shared **newfiles;
+		if (!(newfiles=malloc((max+1)*sizeof(struct file_shared *)))) { free(found); GOTOERROR; }
+		memcpy(newfiles,shared->files,count*sizeof(struct file_shared *));
+		files=newfiles;
+		isdirs=1;
+	} else {
+		struct file_shared **newfiles;
+		if (!(newfiles=realloc(files,(max+1)*sizeof(struct file_shared *)))) { free(found); GOTOERROR; }
+		files=newfiles;
+	}
+	for (uj=0;uj<foundcount;uj++) {
+		struct file_shared *f;
+		if (!(f=CALLOC_blockmem(&shared->blockmem,struct file_shared))) { free(found); GOTOERROR; }
+		f->filename=found[uj].path;
+		f->type=found[uj].type;
+		f->size=found[uj].size;
+		f->mtime=found[uj].mtime;
+		files[count++]=f;
+	}
+	free(found);
+}
+if (!isdirs) return 0;
+if (!count) {
+	log_shared(shared,0,"%s:%d no files found\n",__FILE__,__LINE__);
+	GOTOERROR;
+}
+if (!(shared->files=ALLOC2_blockmem(&shared->blockmem,struct file_shared *,count))) GOTOERROR;
+memcpy(shared->files,files,count*sizeof(struct file_shared *));
+shared->max_files=count;
+free(files);
+return 0;
+error:
+	iffree(files);
+	return -1;
+}
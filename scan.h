@@ -0,0 +1,9 @@
+struct found_scan {
+	char *path;
+	int type;
+	uint64_t size,mtime;
+};
+
+int find_scan(struct found_scan **found_out, unsigned int *count_out, struct shared *shared, struct blockmem *blockmem,
+		char *root, int isrecursive);
+int expand_scan(struct shared *shared);
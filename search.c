@@ -0,0 +1,544 @@
+/*
+ * search.c - answer ContentDirectory Search from a word index
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+#include "containers.h"
+
+#include "search.h"
+
+/*
+ * Every word of every title, artist, album and genre is a token. A token's postings are
+ * (fileindex<<4)|fields, sorted by fileindex. "contains" matches the words of the value
+ * as prefixes of tokens, so "beat" finds "Beatles". Results are bitmaps over the files.
+ */
+
+#define TITLE_FIELD_SEARCH	1
+#define ARTIST_FIELD_SEARCH	2
+#define ALBUM_FIELD_SEARCH	4
+#define GENRE_FIELD_SEARCH	8
+#define MASK_FIELD_SEARCH	15
+#define SHIFT_FIELD_SEARCH	4
+
+#define MUSIC_CLASS_SEARCH	"object.item.audioItem.musicTrack"
+#define VIDEO_CLASS_SEARCH	"object.item.videoItem"
+
+struct triple {
+	uint32_t word; // offset into words
+	uint32_t idx;
+	uint32_t fields;
+};
+
+struct build {
+	char *words;
+	unsigned int wordslen,wordsmax;
+	struct triple *triples;
+	unsigned int count,max;
+};
+
+static char *words_global; // for qsort
+
+static inline int iswordchar(unsigned char c) {
+return isalnum(c) || (c&128); // utf8 stays in words
+}
+
+static int addword(struct build *b, unsigned char *word, unsigned int len, uint32_t idx, uint32_t fields) {
+unsigned int ui;
+if (b->wordslen+len+1>b->wordsmax) {
+	unsigned int max=(b->wordsmax+len+1)*2;
+	char *temp;
+	if (!(temp=realloc(b->words,max))) GOTOERROR;
+	b->words=temp;
+	b->wordsmax=max;
+}
+if (b->count==b->max) {
+	unsigned int max=b->max*2+64;
+	struct triple *temp;
+	if (!(temp=realloc(b->triples,max*sizeof(struct triple)))) GOTOERROR;
+	b->triples=temp;
+	b->max=max;
+}
+b->triples[b->count].word=b->wordslen;
+b->triples[b->count].idx=idx;
+b->triples[b->count].fields=fields;
+b->count+=1;
+for (ui=0;ui<len;ui++) b->words[b->wordslen++]=tolower(word[ui]);
+b->words[b->wordslen++]=0;
+return 0;
+error:
+	return -1;
+}
+
+static int addwords(struct build *b, char *str, uint32_t idx, uint32_t fields) {
+unsigned char *cursor=(unsigned char *)str;
+while (1) {
+	unsigned char *word;
+	while (*cursor && !iswordchar(*cursor)) cursor++;
+	if (!*cursor) break;
+	word=cursor;
+	while (iswordchar(*cursor)) cursor++;
+	if (addword(b,word,cursor-word,idx,fields)) GOTOERROR;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int cmp_triple(const void *va, const void *vb) {
+const struct triple *a=va,*b=vb;
+int r;
+if ((r=strcmp(words_global+a->word,words_global+b->word))) return r;
+if (a->idx!=b->idx) return (a->idx<b->idx)?-1:1;
+return 0;
+}
+
+static char *gettitle(struct file_shared *file) {
+// basename() can modify its argument
+static char buff[512];
+char *slash;
+slash=strrchr(file->filename,'/');
+if (!slash) return file->filename;
+strncpy(buff,slash+1,sizeof(buff)-1);
+buff[sizeof(buff)-1]=0;
+return buff;
+}
+
+int init_search(struct shared *shared) {
+struct build b;
+struct token_search *tokens;
+uint32_t *postings;
+unsigned int ui,tokencount=0,postingcount=0;
+
+memset(&b,0,sizeof(b));
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	if (file->isremoved) continue;
+	if (addwords(&b,gettitle(file),ui,TITLE_FIELD_SEARCH)) GOTOERROR;
+	if (file->meta) {
+		if (addwords(&b,file->meta->title,ui,TITLE_FIELD_SEARCH)) GOTOERROR;
+		if (addwords(&b,file->meta->artist,ui,ARTIST_FIELD_SEARCH)) GOTOERROR;
+		if (addwords(&b,file->meta->album,ui,ALBUM_FIELD_SEARCH)) GOTOERROR;
+		if (addwords(&b,file->meta->genre,ui,GENRE_FIELD_SEARCH)) GOTOERROR;
+	}
+}
+words_global=b.words;
+qsort(b.triples,b.count,sizeof(struct triple),cmp_triple);
+
+for (ui=0;ui<b.count;ui++) {
+	struct triple *t=b.triples+ui;
+	if (!ui || strcmp(b.words+t[-1].word,b.words+t->word)) {
+		tokencount++;
+		postingcount++;
+	} else if (t[-1].idx!=t->idx) postingcount++;
+}
+if (!(tokens=ALLOC2_blockmem(shared->derived,struct token_search,tokencount+1))) GOTOERROR;
+if (!(postings=ALLOC2_blockmem(shared->derived,uint32_t,postingcount+1))) GOTOERROR;
+tokencount=postingcount=0;
+for (ui=0;ui<b.count;ui++) {
+	struct triple *t=b.triples+ui;
+	if (!ui || strcmp(b.words+t[-1].word,b.words+t->word)) {
+		struct token_search *token=tokens+tokencount;
+		if (!(token->word=strdup_blockmem(shared->derived,b.words+t->word))) GOTOERROR;
+		token->first=postingcount;
+		token->count=1;
+		tokencount++;
+		postings[postingcount++]=(t->idx<<SHIFT_FIELD_SEARCH)|t->fields;
+	} else if (t[-1].idx!=t->idx) {
+		tokens[tokencount-1].count+=1;
+		postings[postingcount++]=(t->idx<<SHIFT_FIELD_SEARCH)|t->fields;
+	} else {
+		postings[postingcount-1]|=t->fields;
+	}
+}
+shared->search.tokens=tokens;
+shared->search.tokencount=tokencount;
+shared->search.postings=postings;
+log_shared(shared,1,"%s:%d indexed %u words for search\n",__FILE__,__LINE__,tokencount);
+iffree(b.words);
+iffree(b.triples);
+return 0;
+error:
+	iffree(b.words);
+	iffree(b.triples);
+	return -1;
+}
+
+struct query {
+	struct shared *shared;
+	char *cursor;
+	unsigned int words; // uint64_t per bitmap
+};
+
+static inline void setbit(uint64_t *bitmap, unsigned int idx) {
+bitmap[idx>>6]|=(uint64_t)1<<(idx&63);
+}
+static inline int isbit(uint64_t *bitmap, unsigned int idx) {
+return (bitmap[idx>>6]>>(idx&63))&1;
+}
+
+static void fill(uint64_t *bitmap, struct query *q) {
+unsigned int max=q->shared->max_files;
+memset(bitmap,0xff,q->words*sizeof(uint64_t));
+if (max&63) bitmap[q->words-1]=((uint64_t)1<<(max&63))-1;
+}
+static void invert(uint64_t *bitmap, struct query *q) {
+unsigned int ui,max=q->shared->max_files;
+for (ui=0;ui<q->words;ui++) bitmap[ui]=~bitmap[ui];
+if (max&63) bitmap[q->words-1]&=((uint64_t)1<<(max&63))-1;
+}
+
+static void skipspace(struct query *q) {
+while (isspace(*q->cursor)) q->cursor++;
+}
+
+static int isword(struct query *q, char *word) {
+// matches a keyword that isn't the start of a longer word
+unsigned int len=strlen(word);
+skipspace(q);
+if (strncasecmp(q->cursor,word,len)) return 0;
+if (iswordchar(q->cursor[len])) return 0;
+q->cursor+=len;
+return 1;
+}
+
+static void getword(char *dest, unsigned int destsize, struct query *q) {
+// property or operator, up to the next space or paren
+unsigned int len=0;
+skipspace(q);
+while (*q->cursor && !isspace(*q->cursor) && (*q->cursor!='(') && (*q->cursor!=')') && (*q->cursor!='"')) {
+	if (len+1<destsize) dest[len++]=*q->cursor;
+	q->cursor++;
+}
+dest[len]=0;
+}
+
+static void getvalue(char *dest, unsigned int destsize, struct query *q) {
+unsigned int len=0;
+skipspace(q);
+if (*q->cursor!='"') {
+	getword(dest,destsize,q);
+	return;
+}
+q->cursor++;
+while (*q->cursor && (*q->cursor!='"')) {
+	if ((*q->cursor=='\\') && q->cursor[1]) q->cursor++;
+	if (len+1<destsize) dest[len++]=*q->cursor;
+	q->cursor++;
+}
+if (*q->cursor=='"') q->cursor++;
+dest[len]=0;
+}
+
+static struct token_search *findprefix(struct shared *shared, char *word) {
+// first token >= word
+unsigned int lo=0,hi=shared->search.tokencount;
+while (lo<hi) {
+	unsigned int mid=lo+(hi-lo)/2;
+	if (strcmp(shared->search.tokens[mid].word,word)<0) lo=mid+1;
+	else hi=mid;
+}
+return shared->search.tokens+lo;
+}
+
+static void containsword(uint64_t *dest, struct query *q, char *word, uint32_t fields) {
+// dest is cleared first
+struct shared *shared=q->shared;
+struct token_search *token,*limit=shared->search.tokens+shared->search.tokencount;
+unsigned int len=strlen(word);
+
+memset(dest,0,q->words*sizeof(uint64_t));
+for (token=findprefix(shared,word);token<limit;token++) {
+	uint32_t *p,*plimit;
+	if (strncmp(token->word,word,len)) break;
+	p=shared->search.postings+token->first;
+	plimit=p+token->count;
+	for (;p<plimit;p++) {
+		if (*p&fields) setbit(dest,*p>>SHIFT_FIELD_SEARCH);
+	}
+}
+}
+
+static int contains(uint64_t *dest, struct query *q, char *value, uint32_t fields) {
+// every word of value has to match
+uint64_t *temp=NULL;
+unsigned char *cursor=(unsigned char *)value;
+
+fill(dest,q);
+if (!(temp=malloc(q->words*sizeof(uint64_t)+1))) GOTOERROR;
+while (1) {
+	char word[SIZE_CRITERIA_SEARCH];
+	unsigned int len=0,ui;
+	while (*cursor && !iswordchar(*cursor)) cursor++;
+	if (!*cursor) break;
+	while (iswordchar(*cursor)) {
+		word[len++]=tolower(*cursor);
+		cursor++;
+	}
+	word[len]=0;
+	(void)containsword(temp,q,word,fields);
+	for (ui=0;ui<q->words;ui++) dest[ui]&=temp[ui];
+}
+free(temp);
+return 0;
+error:
+	iffree(temp);
+	return -1;
+}
+
+static int isequal(struct file_shared *file, uint32_t fields, char *value) {
+struct meta_file_shared *meta=file->meta;
+switch (fields) {
+	case TITLE_FIELD_SEARCH:
+		if (meta && !strcasecmp(meta->title,value)) return 1;
+		return !strcasecmp(gettitle(file),value);
+	case ARTIST_FIELD_SEARCH: return meta && !strcasecmp(meta->artist,value);
+	case ALBUM_FIELD_SEARCH: return meta && !strcasecmp(meta->album,value);
+	case GENRE_FIELD_SEARCH: return meta && !strcasecmp(meta->genre,value);
+}
+return 0;
+}
+
+static char *getclass(struct file_shared *file) {
+if (file->type&MUSICMASK_TYPE_FILE_SHARED) return MUSIC_CLASS_SEARCH;
+return VIDEO_CLASS_SEARCH;
+}
+
+static int isderived(char *upnpclass, char *value) {
+unsigned int len=strlen(value);
+if (strncmp(upnpclass,value,len)) return 0;
+return (!upnpclass[len]) || (upnpclass[len]=='.');
+}
+
+static uint32_t getfields(char *property) {
+if (!strcmp(property,"dc:title")) return TITLE_FIELD_SEARCH;
+if (!strcmp(property,"upnp:artist")) return ARTIST_FIELD_SEARCH;
+if (!strcmp(property,"dc:creator")) return ARTIST_FIELD_SEARCH;
+if (!strcmp(property,"upnp:album")) return ALBUM_FIELD_SEARCH;
+if (!strcmp(property,"upnp:genre")) return GENRE_FIELD_SEARCH;
+return 0;
+}
+
+static int parseor(uint64_t *dest, struct query *q);
+
+static int parsefactor(uint64_t *dest, struct query *q) {
+char property[64],op[32],value[SIZE_CRITERIA_SEARCH];
+unsigned int ui,max=q->shared->max_files;
+uint32_t fields;
+
+skipspace(q);
+if (*q->cursor=='(') {
+	q->cursor++;
+	if (parseor(dest,q)) GOTOERROR;
+	skipspace(q);
+	if (*q->cursor!=')') GOTOERROR;
+	q->cursor++;
+	return 0;
+}
+if (*q->cursor=='*') {
+	q->cursor++;
+	(void)fill(dest,q);
+	return 0;
+}
+getword(property,sizeof(property),q);
+getword(op,sizeof(op),q);
+skipspace(q);
+if (!*q->cursor || (*q->cursor==')')) GOTOERROR; // no value
+getvalue(value,sizeof(value),q);
+if (!property[0] || !op[0]) GOTOERROR;
+
+if (!strcmp(op,"exists")) {
+	(void)fill(dest,q); // everything has every property, near enough
+	if (!strcasecmp(value,"false")) memset(dest,0,q->words*sizeof(uint64_t));
+	return 0;
+}
+if (!strcmp(property,"upnp:class")) {
+	memset(dest,0,q->words*sizeof(uint64_t));
+	for (ui=0;ui<max;ui++) {
+		char *upnpclass=getclass(q->shared->files[ui]);
+		if (!strcmp(op,"derivedfrom")) { if (isderived(upnpclass,value)) setbit(dest,ui); }
+		else if (!strcmp(op,"=")) { if (!strcmp(upnpclass,value)) setbit(dest,ui); }
+		else if (!strcmp(op,"!=")) { if (strcmp(upnpclass,value)) setbit(dest,ui); }
+	}
+	return 0;
+}
+fields=getfields(property);
+if (!fields) { // we don't know it, nothing matches
+	memset(dest,0,q->words*sizeof(uint64_t));
+	return 0;
+}
+if (contains(dest,q,value,fields)) GOTOERROR;
+if (!strcmp(op,"contains")) {
+} else if (!strcmp(op,"doesNotContain")) {
+	(void)invert(dest,q);
+} else if (!strcmp(op,"=") || !strcmp(op,"!=")) {
+	for (ui=0;ui<max;ui++) {
+		if (!isbit(dest,ui)) continue;
+		if (!isequal(q->shared->files[ui],fields,value)) dest[ui>>6]&=~((uint64_t)1<<(ui&63));
+	}
+	if (op[0]=='!') (void)invert(dest,q);
+} else { // < > and friends, not for strings we have
+	memset(dest,0,q->words*sizeof(uint64_t));
+}
+return 0;
+error:
+	return -1;
+}
+
+static int parseand(uint64_t *dest, struct query *q) {
+uint64_t *temp=NULL;
+unsigned int ui;
+
+if (parsefactor(dest,q)) GOTOERROR;
+while (isword(q,"and")) {
+	if (!temp) {
+		if (!(temp=malloc(q->words*sizeof(uint64_t)+1))) GOTOERROR;
+	}
+	if (parsefactor(temp,q)) GOTOERROR;
+	for (ui=0;ui<q->words;ui++) dest[ui]&=temp[ui];
+}
+iffree(temp);
+return 0;
+error:
+	iffree(temp);
+	return -1;
+}
+
+static int parseor(uint64_t *dest, struct query *q) {
+uint64_t *temp=NULL;
+unsigned int ui;
+
+if (parseand(dest,q)) GOTOERROR;
+while (isword(q,"or")) {
+	if (!temp) {
+		if (!(temp=malloc(q->words*sizeof(uint64_t)+1))) GOTOERROR;
+	}
+	if (parseand(temp,q)) GOTOERROR;
+	for (ui=0;ui<q->words;ui++) dest[ui]|=temp[ui];
+}
+iffree(temp);
+return 0;
+error:
+	iffree(temp);
+	return -1;
+}
+
+static void unescape(char *str) {
+// SearchCriteria arrives xml escaped
+char *dest=str;
+while (*str) {
+	if (*str=='&') {
+		if (!strncmp(str,"&quot;",6)) { *dest++='"'; str+=6; continue; }
+		if (!strncmp(str,"&apos;",6)) { *dest++='\''; str+=6; continue; }
+		if (!strncmp(str,"&amp;",5)) { *dest++='&'; str+=5; continue; }
+		if (!strncmp(str,"&lt;",4)) { *dest++='<'; str+=4; continue; }
+		if (!strncmp(str,"&gt;",4)) { *dest++='>'; str+=4; continue; }
+	}
+	*dest++=*str++;
+}
+*dest=0;
+}
+
+static void markdescendants(uint64_t *bitmap, struct shared *shared, struct container_shared *c) {
+unsigned int ui;
+for (ui=0;ui<c->childcount;ui++) {
+	unsigned int id=c->children[ui];
+	if (id<FIRSTID_CONTAINER_SHARED) setbit(bitmap,id-1);
+	else {
+		struct container_shared *child;
+		if ((child=find_containers(shared,id))) (void)markdescendants(bitmap,shared,child);
+	}
+}
+}
+
+int find_search(unsigned int **ids_out, unsigned int *count_out, int *isinvalid_out, struct shared *shared, char *criteria,
+		unsigned int containerid, unsigned int *order) {
+// *ids_out is malloc'd, NULL if there's no match; order is from sort.c, NULL => file order
+// *isinvalid_out => criteria is empty or doesn't parse, nothing is found
+struct query q;
+uint64_t *bitmap=NULL;
+unsigned int *ids=NULL;
+unsigned int ui,count=0;
+int isinvalid=0;
+
+(void)unescape(criteria);
+q.shared=shared;
+q.cursor=criteria;
+q.words=(shared->max_files+63)/64;
+if (!(bitmap=malloc(q.words*sizeof(uint64_t)+1))) GOTOERROR;
+skipspace(&q);
+if (!*q.cursor) isinvalid=1; // everything is "*", not ""
+else if (parseor(bitmap,&q)) isinvalid=1;
+else {
+	skipspace(&q);
+	if (*q.cursor) isinvalid=1;
+}
+if (isinvalid) {
+	log_shared(shared,1,"%s:%d couldn't parse search \"%s\"\n",__FILE__,__LINE__,criteria);
+	free(bitmap);
+	*ids_out=NULL;
+	*count_out=0;
+	*isinvalid_out=1;
+	return 0;
+}
+
+if (containerid && shared->options.iscontainers) {
+	struct container_shared *c;
+	uint64_t *scope;
+	if (!(scope=calloc(q.words+1,sizeof(uint64_t)))) GOTOERROR;
+	if ((c=find_containers(shared,containerid))) (void)markdescendants(scope,shared,c);
+	for (ui=0;ui<q.words;ui++) bitmap[ui]&=scope[ui];
+	free(scope);
+}
+
+for (ui=0;ui<q.words;ui++) count+=__builtin_popcountll(bitmap[ui]);
+if (count) { // removed files can still be in a bitmap from fill()
+	unsigned int n=0;
+	if (!(ids=malloc(count*sizeof(unsigned int)))) GOTOERROR;
+	if (order) {
+		for (ui=0;ui<shared->live.count;ui++) {
+			if (isbit(bitmap,order[ui]-1)) ids[n++]=order[ui];
+		}
+	} else {
+		for (ui=0;ui<shared->max_files;ui++) {
+			if (isbit(bitmap,ui) && !shared->files[ui]->isremoved) ids[n++]=ui+1;
+		}
+	}
+	count=n;
+	if (!n) {
+		free(ids);
+		ids=NULL;
+	}
+}
+free(bitmap);
+*ids_out=ids;
+*count_out=count;
+*isinvalid_out=0;
+return 0;
+error:
+	iffree(bitmap);
+	return -1;
+}
@@ -0,0 +1,11 @@
+#define SIZE_CRITERIA_SEARCH	1024
+#define CAPS_SEARCH	"dc:title,dc:creator,upnp:artist,upnp:album,upnp:genre,upnp:class"
+
+struct token_search {
+	char *word; // lowercase
+	uint32_t first,count; // into shared->search.postings
+};
+
+int init_search(struct shared *shared);
+int find_search(unsigned int **ids_out, unsigned int *count_out, int *isinvalid_out, struct shared *shared, char *criteria,
+		unsigned int containerid, unsigned int *order);
@@ -23,24 +23,46 @@
 #include <stdint.h>
 #include <syslog.h>
 #include <stdarg.h>
+#include <sys/mman.h>
 // #define DEBUG
 #include "common/conventions.h"
 #include "common/blockmem.h"
 
 #include "shared.h"
+#include "uring.h"
+#include "watch.h"
 
 void clear_shared(struct shared *s) {
-static struct shared blank={.udp_socket=-1,.tcp_socket=-1,.children.max=5};
+static struct shared blank={.udp_socket=-1,.tcp_socket=-1,.children.max=5,.pending.backlog=16,.pending.max=8,.options.scanthreads=4,
+		.watch.fd=-1};
 *s=blank;
 }
 
 void afterfork_shared(struct shared *s) {
+unsigned int ui;
 ifclose(s->udp_socket);
 ifclose(s->tcp_socket);
+ifclose(s->watch.fd);
+s->watch.fd=-1; // workers check it
+for (ui=0;ui<s->pending.count;ui++) close(s->pending.list[ui].fd); // only the parent queues
+s->pending.count=0;
 }
 
 void deinit_shared(struct shared *s) {
 (void)afterfork_shared(s);
+if (s->uring.ring) {
+	deinit_uring(s->uring.ring);
+	free(s->uring.ring);
+}
+if (s->index.map) munmap(s->index.map,s->index.mapsize);
+iffree(s->containers.list);
+iffree(s->containers.byserial);
+iffree(s->live.ids);
+if (s->derived) {
+	deinit_blockmem(s->derived);
+	free(s->derived);
+}
+(void)deinit_watch(s);
 iffree(s->buff512);
 deinit_blockmem(&s->blockmem);
 }
@@ -80,7 +102,16 @@ error:
 }
 
 int allocs_shared(struct shared *s) {
+if (!(s->derived=new_blockmem(0))) GOTOERROR;
 if (!(s->children.list=CALLOC2_blockmem(&s->blockmem,struct onechild_shared,s->children.max))) GOTOERROR;
+if (s->pending.max) {
+	if (!(s->pending.list=CALLOC2_blockmem(&s->blockmem,struct onepending_shared,s->pending.max))) GOTOERROR;
+}
+if (s->workers.count) {
+	unsigned int ui;
+	if (!(s->workers.list=CALLOC2_blockmem(&s->blockmem,struct oneworker_shared,s->workers.count))) GOTOERROR;
+	for (ui=0;ui<s->workers.count;ui++) s->workers.list[ui].fd=-1;
+}
 return 0;
 error:
 	return -1;
@@ -5,12 +5,56 @@
 #define MP3_TYPE_FILE_SHARED	3
 #define VIDEO_TYPE_FILE_SHARED	8
 
+struct meta_file_shared {
+	char *title,*artist,*album,*date,*genre; // never NULL, "" => missing
+	unsigned int tracknumber;
+	unsigned int duration; // seconds
+	unsigned int bitrate; // bits per second, 0 => dunno
+	uint64_t samples; // flac and wav, samplerate 0 => dunno, and flac can't seek by time
+	unsigned int samplerate;
+	unsigned int channels,bitspersample; // wav only, 0 => dunno
+	uint64_t audiooffset; // first frame, or the wav data
+	unsigned int blocksize; // flac only from here
+	struct seekpoint_flacheader *seekpoints; // NULL => no SEEKTABLE
+	unsigned int seekcount;
+	uint64_t artoffset; // embedded picture, served by /art.N straight from the file
+	unsigned int artsize,arttype; // artsize 0 => none, arttype is from flacheader.h
+	unsigned int artwidth,artheight; // 0 => dunno
+};
+
 struct file_shared {
 	uint64_t size;
 	char *filename;
 	int type;
+	uint64_t mtime; // nanoseconds
+	int isparsed; // => we looked for a header, meta can still be NULL
+	struct meta_file_shared *meta; // NULL => no header, from init_files
+	char *didl; unsigned int didllen; // escaped browse <item>, from render_httpd, NULL => render per request
+	unsigned int didlparent; // offset of the "0" in parentID="0"
+#define COUNT_PROPS_DIDL	7
+	unsigned int didlprops[COUNT_PROPS_DIDL+1]; // offsets where each optional property starts, then the end of the last
+	int isremoved; // => gone from disk, see watch.c, the ObjectID isn't reused
+	unsigned int updateid; // SystemUpdateID when it last changed
 };
 
+#define FIRSTID_CONTAINER_SHARED	1000000000
+struct container_shared {
+	unsigned int id; // FIRSTID_CONTAINER_SHARED+N, kept across rebuilds, 0 for the root
+	unsigned int updateid; // ContainerUpdateID
+	unsigned int parentid;
+	char *title; // not escaped
+	char *upnpclass;
+	unsigned int childcount,childmax;
+	unsigned int *children; // ObjectIDs, files are 1..max_files, containers are FIRSTID_CONTAINER_SHARED+
+	char *didl; unsigned int didllen; // escaped browse <container>, from render_httpd
+};
+
+struct uring;
+struct seekpoint_flacheader;
+struct token_search;
+struct dir_watch;
+struct pending_watch;
+
 struct shared {
 	uint32_t ipv4_interface;
 	int udp_socket; // for ssdp
@@ -30,6 +74,34 @@ struct shared {
 	} server;
 	unsigned int max_files;
 	struct file_shared **files;
+	struct meta_file_shared *catalog; // max_files entries, parsed once at startup
+	struct {
+		unsigned int *ids; // NULL => 1..count, otherwise the files that aren't removed
+		unsigned int count;
+	} live;
+	unsigned int updateid; // SystemUpdateID
+	struct blockmem *derived; // containers, search and sort, replaced on each rebuild
+	struct {
+		unsigned int count,max;
+		struct container_shared *list; // [0] is the root, see containers.c for ObjectIDs
+		unsigned int *byserial; // [id-FIRSTID_CONTAINER_SHARED] => idx+1, 0 => gone
+		unsigned int serialcount,serialmax;
+		unsigned int allid; // the "All" container, an item's parentID when it's browsed on its own
+	} containers;
+	struct {
+		struct token_search *tokens; // sorted by word
+		unsigned int tokencount;
+		uint32_t *postings;
+	} search;
+	struct {
+#define COUNT_KEYS_SORT	6
+		unsigned int *order[COUNT_KEYS_SORT]; // ObjectIDs of live.count files, see sort.c
+		unsigned int *rank[COUNT_KEYS_SORT]; // [idx] => position in order
+	} sort;
+	struct {
+		unsigned char *map; // NULL => no index, read only
+		uint64_t mapsize;
+	} index;
 	struct {
 		uint32_t ipv4;
 	} target;
@@ -40,6 +112,38 @@ struct shared {
 			pid_t pid;
 		} *list;
 	} children;
+	struct {
+		unsigned int backlog; // for listen()
+		unsigned int count,max; // connections waiting for a child
+		struct onepending_shared {
+			int fd;
+			int ischeap; // => not a stream, these go first
+			time_t expires;
+		} *list;
+	} pending;
+	struct {
+		unsigned int count; // 0 => fork per connection
+		struct oneworker_shared {
+			int fd; // SO_REUSEPORT listener
+			pid_t pid; // 0 => not running
+			time_t started;
+		} *list;
+		int isdelayed; // => a worker died too soon after starting, retry it next second
+	} workers;
+	struct {
+		int isfailed; // => don't try again in this process
+		struct uring *ring; // one per process, made before it's needed
+	} uring;
+	struct {
+		int fd; // inotify, -1 => not watching
+		struct dir_watch *dirs; // [wd], see watch.c
+		unsigned int dirmax;
+		struct pending_watch *pending; // directories added or removed since the last update
+		unsigned int pendingcount,pendingmax;
+		int isdirty; // => update once it's been quiet for a bit
+		time_t lastevent;
+		unsigned int filesmax; // room in files
+	} watch;
 	struct {
 		int isnodiscovery; // => don't bind udp on 1900; don't respond to m-search
 		int isnoadvertising; // => don't send alives or byebyes
@@ -49,6 +153,12 @@ struct shared {
 		int isbackground;
 		int isforcediscovery;
 		int ismergefiles;
+		int iseventloop;
+		int isiouring;
+		char *indexfile;
+		int iscontainers;
+		unsigned int scanthreads; // for directory arguments
+		int iswatch;
 	} options;
 	int isquit;
 	struct blockmem blockmem;
@@ -0,0 +1,231 @@
+/*
+ * sort.c - precomputed orders for SortCriteria
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+
+#include "sort.h"
+
+/*
+ * For each key, order[] lists the ObjectIDs of every file that isn't removed in sorted order and
+ * rank[] gives each file's position in it. The flat list uses order[] directly, other lists sort by rank[], which is
+ * an integer compare. Each key has its own tie breaks (artist sorts by album and track after), so
+ * only the first key of a SortCriteria is used.
+ */
+
+struct collate {
+	char *title,*artist,*album,*date; // collation keys
+	unsigned int track;
+	uint64_t size;
+	char *filename;
+};
+
+static struct collate *collates_global; // for qsort
+static unsigned int *rank_global; // for qsort
+
+static char *makekey(struct blockmem *blockmem, char *str) {
+// case and punctuation insensitive, the same in every locale
+unsigned char *src=(unsigned char *)str;
+char *dest,*key;
+int isgap=0;
+
+if (!(key=alloc_blockmem(blockmem,strlen(str)+1))) return NULL;
+dest=key;
+for (;*src;src++) {
+	if (*src&128) *dest++=*src; // utf8 bytes sort as they are, after ascii
+	else if (isalnum(*src)) {
+		if (isgap && (dest!=key)) *dest++=' ';
+		*dest++=tolower(*src);
+		isgap=0;
+	} else isgap=1;
+}
+*dest=0;
+return key;
+}
+
+static char *gettitle(struct file_shared *file) {
+char *slash;
+if (file->meta && *file->meta->title) return file->meta->title;
+slash=strrchr(file->filename,'/');
+if (!slash) return file->filename;
+return slash+1;
+}
+
+static int cmp_last(struct collate *a, struct collate *b) {
+return strcmp(a->filename,b->filename);
+}
+static int cmp_tracks(struct collate *a, struct collate *b) {
+if (a->track!=b->track) return (a->track<b->track)?-1:1;
+return cmp_last(a,b);
+}
+static int cmp_albums(struct collate *a, struct collate *b) {
+int r;
+if ((r=strcmp(a->album,b->album))) return r;
+return cmp_tracks(a,b);
+}
+
+static int cmp_title(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+int r;
+if ((r=strcmp(a->title,b->title))) return r;
+return cmp_last(a,b);
+}
+static int cmp_artist(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+int r;
+if ((r=strcmp(a->artist,b->artist))) return r;
+return cmp_albums(a,b);
+}
+static int cmp_album(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+return cmp_albums(a,b);
+}
+static int cmp_track(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+return cmp_tracks(a,b);
+}
+static int cmp_date(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+int r;
+if ((r=strcmp(a->date,b->date))) return r;
+return cmp_albums(a,b);
+}
+static int cmp_size(const void *va, const void *vb) {
+struct collate *a=collates_global+*(const unsigned int *)va,*b=collates_global+*(const unsigned int *)vb;
+if (a->size!=b->size) return (a->size<b->size)?-1:1;
+return cmp_last(a,b);
+}
+
+int init_sort(struct shared *shared) {
+static int (*cmps[COUNT_KEYS_SORT])(const void *,const void *)={cmp_title,cmp_artist,cmp_album,cmp_track,cmp_date,cmp_size};
+struct blockmem temp;
+struct collate *collates=NULL;
+unsigned int *indexes=NULL;
+unsigned int ui,key,live,max=shared->max_files;
+
+clear_blockmem(&temp);
+if (init_blockmem(&temp,0)) GOTOERROR;
+if (!(collates=malloc((max+1)*sizeof(struct collate)))) GOTOERROR;
+if (!(indexes=malloc((max+1)*sizeof(unsigned int)))) GOTOERROR;
+for (ui=0;ui<max;ui++) {
+	struct file_shared *file=shared->files[ui];
+	struct meta_file_shared *meta=file->meta;
+	struct collate *c=collates+ui;
+	if (file->isremoved) continue;
+	if (!(c->title=makekey(&temp,gettitle(file)))) GOTOERROR;
+	if (!(c->artist=makekey(&temp,meta?meta->artist:""))) GOTOERROR;
+	if (!(c->album=makekey(&temp,meta?meta->album:""))) GOTOERROR;
+	if (!(c->date=makekey(&temp,meta?meta->date:""))) GOTOERROR;
+	c->track=meta?meta->tracknumber:0;
+	c->size=file->size;
+	c->filename=file->filename;
+}
+collates_global=collates;
+for (key=0;key<COUNT_KEYS_SORT;key++) {
+	unsigned int *order,*rank;
+	live=0;
+	for (ui=0;ui<max;ui++) {
+		if (!shared->files[ui]->isremoved) indexes[live++]=ui;
+	}
+	qsort(indexes,live,sizeof(unsigned int),cmps[key]);
+	if (!(order=ALLOC2_blockmem(shared->derived,unsigned int,live+1))) GOTOERROR;
+	if (!(rank=ALLOC2_blockmem(shared->derived,unsigned int,max+1))) GOTOERROR;
+	for (ui=0;ui<live;ui++) {
+		order[ui]=indexes[ui]+1;
+		rank[indexes[ui]]=ui;
+	}
+	shared->sort.order[key]=order;
+	shared->sort.rank[key]=rank;
+}
+free(indexes);
+free(collates);
+deinit_blockmem(&temp);
+return 0;
+error:
+	iffree(indexes);
+	iffree(collates);
+	deinit_blockmem(&temp);
+	return -1;
+}
+
+int parse_sort(int *key_out, int *isreverse_out, char *criteria) {
+// "+upnp:artist,-dc:date", only the first key we know is used, -1 => none
+char *cursor=criteria;
+
+while (*cursor) {
+	int isreverse=0;
+	unsigned int len;
+	while (isspace(*cursor) || (*cursor==',')) cursor++;
+	if (*cursor=='-') { isreverse=1; cursor++; }
+	else if (*cursor=='+') cursor++;
+	for (len=0;cursor[len] && (cursor[len]!=',') && !isspace(cursor[len]);len++);
+	if (!len) break;
+	*isreverse_out=isreverse;
+#define ISKEY(a) ((len==sizeof(a)-1) && !strncmp(cursor,a,len))
+	if (ISKEY("dc:title")) { *key_out=TITLE_KEY_SORT; return 0; }
+	if (ISKEY("dc:creator") || ISKEY("upnp:artist")) { *key_out=ARTIST_KEY_SORT; return 0; }
+	if (ISKEY("upnp:album")) { *key_out=ALBUM_KEY_SORT; return 0; }
+	if (ISKEY("upnp:originalTrackNumber")) { *key_out=TRACK_KEY_SORT; return 0; }
+	if (ISKEY("dc:date")) { *key_out=DATE_KEY_SORT; return 0; }
+	if (ISKEY("res@size")) { *key_out=SIZE_KEY_SORT; return 0; }
+#undef ISKEY
+	cursor+=len;
+}
+*key_out=-1;
+*isreverse_out=0;
+return 0;
+}
+
+static int cmp_rank(const void *va, const void *vb) {
+unsigned int a=rank_global[*(const unsigned int *)va-1],b=rank_global[*(const unsigned int *)vb-1];
+if (a<b) return -1;
+return (a>b);
+}
+
+int children_sort(unsigned int **ids_out, struct shared *shared, unsigned int *children, unsigned int count, int key, int isreverse) {
+// *ids_out is a malloc'd copy of children, containers first in their order, then files sorted by key
+unsigned int *ids;
+unsigned int ui,n=0;
+
+if (!(ids=malloc((count+1)*sizeof(unsigned int)))) GOTOERROR;
+for (ui=0;ui<count;ui++) if (children[ui]>=FIRSTID_CONTAINER_SHARED) ids[n++]=children[ui];
+for (ui=0;ui<count;ui++) if (children[ui]<FIRSTID_CONTAINER_SHARED) ids[n++]=children[ui];
+for (ui=0;ui<count;ui++) if (ids[ui]<FIRSTID_CONTAINER_SHARED) break;
+rank_global=shared->sort.rank[key];
+qsort(ids+ui,count-ui,sizeof(unsigned int),cmp_rank);
+if (isreverse) {
+	for (n=count-1;ui<n;ui++,n--) {
+		unsigned int t=ids[ui];
+		ids[ui]=ids[n];
+		ids[n]=t;
+	}
+}
+*ids_out=ids;
+return 0;
+error:
+	return -1;
+}
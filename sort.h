@@ -0,0 +1,12 @@
+#define TITLE_KEY_SORT	0
+#define ARTIST_KEY_SORT	1
+#define ALBUM_KEY_SORT	2
+#define TRACK_KEY_SORT	3
+#define DATE_KEY_SORT	4
+#define SIZE_KEY_SORT	5
+// COUNT_KEYS_SORT is in shared.h
+#define CAPS_SORT	"dc:title,dc:creator,upnp:artist,upnp:album,upnp:originalTrackNumber,dc:date,res@size"
+
+int init_sort(struct shared *shared);
+int parse_sort(int *key_out, int *isreverse_out, char *criteria);
+int children_sort(unsigned int **ids_out, struct shared *shared, unsigned int *children, unsigned int count, int key, int isreverse);
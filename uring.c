@@ -0,0 +1,363 @@
+/*
+ * uring.c - stream files to sockets with io_uring, without liburing
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "misc.h"
+
+#include "uring.h"
+
+void clear_uring(struct uring *u) {
+static struct uring blank={.fd=-1};
+*u=blank;
+}
+
+static int checkprobe(int fd) {
+// make sure the ops we use are there, they came in over several kernel versions
+static int ops[]={IORING_OP_READ,IORING_OP_WRITE,IORING_OP_OPENAT,IORING_OP_STATX};
+struct io_uring_probe *probe=NULL;
+unsigned int size,ui;
+
+size=sizeof(struct io_uring_probe)+256*sizeof(struct io_uring_probe_op);
+if (!(probe=malloc(size))) GOTOERROR;
+memset(probe,0,size);
+if (syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256)) GOTOERROR;
+for (ui=0;ui<sizeof(ops)/sizeof(int);ui++) {
+	if (ops[ui]>probe->last_op) GOTOERROR;
+	if (!(probe->ops[ops[ui]].flags&IO_URING_OP_SUPPORTED)) GOTOERROR;
+}
+free(probe);
+return 0;
+error:
+	iffree(probe);
+	return -1;
+}
+
+int init_uring(struct uring *u, unsigned int entries) {
+// returns -1 if the kernel doesn't support what we need
+struct io_uring_params params;
+unsigned char *sqring,*cqring;
+int fd;
+
+memset(&params,0,sizeof(params));
+fd=syscall(__NR_io_uring_setup,entries,&params);
+if (fd<0) GOTOERROR;
+u->fd=fd;
+if (!(params.features&IORING_FEAT_SINGLE_MMAP)) GOTOERROR; // 5.4+, older kernels lack the ops anyway
+if (checkprobe(fd)) GOTOERROR;
+
+u->entries=params.sq_entries;
+u->sqringsize=params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+u->cqringsize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+if (u->cqringsize>u->sqringsize) u->sqringsize=u->cqringsize;
+u->cqringsize=0; // single mmap
+u->sqring=mmap(NULL,u->sqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+if (u->sqring==MAP_FAILED) { u->sqring=NULL; GOTOERROR; }
+u->cqring=u->sqring;
+u->sqessize=params.sq_entries*sizeof(struct io_uring_sqe);
+u->sqes=mmap(NULL,u->sqessize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+if (u->sqes==MAP_FAILED) { u->sqes=NULL; GOTOERROR; }
+
+sqring=u->sqring;
+u->sq_head=(unsigned int *)(sqring+params.sq_off.head);
+u->sq_tail=(unsigned int *)(sqring+params.sq_off.tail);
+u->sq_mask=(unsigned int *)(sqring+params.sq_off.ring_mask);
+u->sq_array=(unsigned int *)(sqring+params.sq_off.array);
+cqring=u->cqring;
+u->cq_head=(unsigned int *)(cqring+params.cq_off.head);
+u->cq_tail=(unsigned int *)(cqring+params.cq_off.tail);
+u->cq_mask=(unsigned int *)(cqring+params.cq_off.ring_mask);
+u->cqes=(struct io_uring_cqe *)(cqring+params.cq_off.cqes);
+return 0;
+error:
+	return -1;
+}
+
+void deinit_uring(struct uring *u) {
+ifmunmap(u->sqes,u->sqessize);
+ifmunmap(u->sqring,u->sqringsize);
+ifclose(u->fd);
+}
+
+static struct io_uring_sqe *getsqe(struct uring *u) {
+struct io_uring_sqe *sqe;
+unsigned int tail,head,idx;
+
+tail=*u->sq_tail;
+head=__atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE);
+if (tail-head>=u->entries) return NULL;
+idx=tail&*u->sq_mask;
+u->sq_array[idx]=idx;
+sqe=&u->sqes[idx];
+memset(sqe,0,sizeof(struct io_uring_sqe));
+__atomic_store_n(u->sq_tail,tail+1,__ATOMIC_RELEASE);
+u->tosubmit+=1;
+return sqe;
+}
+
+static int submit(struct uring *u, unsigned int waitfor) {
+while (1) {
+	int r;
+	r=syscall(__NR_io_uring_enter,u->fd,u->tosubmit,waitfor,(waitfor)?IORING_ENTER_GETEVENTS:0,NULL,0);
+	if (r<0) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+	u->tosubmit-=r;
+	if (!u->tosubmit) break;
+}
+return 0;
+error:
+	return -1;
+}
+
+static int getcqe(uint64_t *userdata_out, int *res_out, struct uring *u) {
+// returns 0 if there's nothing to get
+struct io_uring_cqe *cqe;
+unsigned int head,tail;
+
+head=*u->cq_head;
+tail=__atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+if (head==tail) return 0;
+cqe=&u->cqes[head&*u->cq_mask];
+*userdata_out=cqe->user_data;
+*res_out=cqe->res;
+__atomic_store_n(u->cq_head,head+1,__ATOMIC_RELEASE);
+return 1;
+}
+
+static int waitcqe(int *istimeout_errorout, uint64_t *userdata_out, int *res_out, struct uring *u, time_t expires) {
+struct pollfd pollfd;
+
+pollfd.fd=u->fd;
+pollfd.events=POLLIN;
+while (1) {
+	time_t now;
+	int r;
+	if (getcqe(userdata_out,res_out,u)) break;
+	now=time(NULL);
+	if (expires<=now) {
+		*istimeout_errorout=1;
+		GOTOERROR;
+	}
+	r=poll(&pollfd,1,(expires-now)*1000);
+	if (r<0) {
+		if (errno==EINTR) continue;
+		GOTOERROR;
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+static void drain(struct uring *u, unsigned int inflight) {
+// buffers have to outlive the kernel's use of them
+while (inflight) {
+	uint64_t userdata;
+	int res;
+	if (getcqe(&userdata,&res,u)) {
+		inflight--;
+		continue;
+	}
+	if (0>syscall(__NR_io_uring_enter,u->fd,0,1,IORING_ENTER_GETEVENTS,NULL,0)) {
+		if (errno==EINTR) continue;
+		break;
+	}
+}
+}
+
+#define NUMSLOTS_STREAM	4
+#define READ_OP_STREAM	0
+#define WRITE_OP_STREAM	1
+struct slot_stream {
+#define FREE_STATE_SLOT	0
+#define READING_STATE_SLOT	1
+#define READY_STATE_SLOT	2
+#define WRITING_STATE_SLOT	3
+	int state;
+	unsigned char *buff;
+	uint64_t offset;
+	unsigned int len,done; // done is filled while reading, sent while writing
+};
+
+static int submitslot(struct uring *u, struct slot_stream *slot, unsigned int idx, int fd, int op) {
+struct io_uring_sqe *sqe;
+if (!(sqe=getsqe(u))) GOTOERROR;
+if (op==READ_OP_STREAM) {
+	sqe->opcode=IORING_OP_READ;
+	sqe->off=slot->offset+slot->done;
+} else {
+	sqe->opcode=IORING_OP_WRITE;
+	sqe->off=(uint64_t)-1; // sockets have no offset
+}
+sqe->fd=fd;
+sqe->addr=(uint64_t)(uintptr_t)(slot->buff+slot->done);
+sqe->len=slot->len-slot->done;
+sqe->user_data=(idx<<1)|op;
+return 0;
+error:
+	return -1;
+}
+
+int stream_uring(int *istimeout_errorout, struct uring *u, int fd_out, int fd_in, uint64_t offset, uint64_t len,
+		unsigned char *buff, unsigned int bufflen, unsigned int stallseconds, struct readahead *ra) {
+// reads run ahead in up to NUMSLOTS_STREAM slots of buff while the socket is written in order
+// only one write is in flight at a time since io_uring doesn't order independent writes
+// ra, if not NULL, is stepped as each slot is written, like the sendfile loop does
+struct slot_stream slots[NUMSLOTS_STREAM];
+unsigned int slotsize,readseq=0,writeseq=0,inflight=0;
+uint64_t readoffset,limit;
+time_t expires;
+int istimeout=0,iswriting=0;
+
+slotsize=bufflen/NUMSLOTS_STREAM;
+if (!slotsize) GOTOERROR;
+memset(slots,0,sizeof(slots));
+{
+	unsigned int ui;
+	for (ui=0;ui<NUMSLOTS_STREAM;ui++) slots[ui].buff=buff+ui*slotsize;
+}
+readoffset=offset;
+limit=offset+len;
+expires=time(NULL)+stallseconds;
+
+while (1) {
+	struct slot_stream *slot;
+	uint64_t userdata;
+	int res;
+
+	while (readoffset<limit) {
+		unsigned int idx;
+		idx=readseq%NUMSLOTS_STREAM;
+		slot=&slots[idx];
+		if (slot->state!=FREE_STATE_SLOT) break;
+		slot->offset=readoffset;
+		slot->len=slotsize;
+		if (slot->len>limit-readoffset) slot->len=limit-readoffset;
+		slot->done=0;
+		if (submitslot(u,slot,idx,fd_in,READ_OP_STREAM)) GOTOERROR;
+		slot->state=READING_STATE_SLOT;
+		inflight+=1;
+		readoffset+=slot->len;
+		readseq+=1;
+	}
+	if (!iswriting) {
+		unsigned int idx;
+		idx=writeseq%NUMSLOTS_STREAM;
+		slot=&slots[idx];
+		if (slot->state==READY_STATE_SLOT) {
+			slot->done=0;
+			if (submitslot(u,slot,idx,fd_out,WRITE_OP_STREAM)) GOTOERROR;
+			slot->state=WRITING_STATE_SLOT;
+			inflight+=1;
+			iswriting=1;
+		}
+	}
+	if (!inflight) break;
+	if (submit(u,0)) GOTOERROR;
+
+	if (waitcqe(&istimeout,&userdata,&res,u,expires)) GOTOERROR;
+	inflight-=1;
+	slot=&slots[userdata>>1];
+	if (res<=0) GOTOERROR; // includes EOF on a file that shrank
+	slot->done+=res;
+	if ((userdata&1)==READ_OP_STREAM) {
+		if (slot->done<slot->len) {
+			if (submitslot(u,slot,userdata>>1,fd_in,READ_OP_STREAM)) GOTOERROR;
+			inflight+=1;
+		} else {
+			slot->state=READY_STATE_SLOT;
+		}
+	} else {
+		expires=time(NULL)+stallseconds;
+		if (slot->done<slot->len) {
+			if (submitslot(u,slot,userdata>>1,fd_out,WRITE_OP_STREAM)) GOTOERROR;
+			inflight+=1;
+		} else {
+			slot->state=FREE_STATE_SLOT;
+			writeseq+=1;
+			iswriting=0;
+			if (ra) (void)step_readahead(ra,slot->offset+slot->len,limit);
+		}
+	}
+}
+return 0;
+error:
+	(ignore)shutdown(fd_out,SHUT_RDWR); // fails pending writes so we can drain
+	u->tosubmit=0;
+	(void)drain(u,inflight);
+	*istimeout_errorout=istimeout;
+	return -1;
+}
+
+int openstat_uring(int *fd_out, uint64_t *size_out, struct uring *u, char *filename) {
+// openat and statx go in together, one syscall for both
+struct io_uring_sqe *sqe;
+struct statx stx;
+int fd=-1,count=0,iserror=0;
+
+if (!(sqe=getsqe(u))) GOTOERROR;
+sqe->opcode=IORING_OP_OPENAT;
+sqe->fd=AT_FDCWD;
+sqe->addr=(uint64_t)(uintptr_t)filename;
+sqe->open_flags=O_RDONLY|O_CLOEXEC;
+sqe->user_data=0;
+if (!(sqe=getsqe(u))) GOTOERROR;
+sqe->opcode=IORING_OP_STATX;
+sqe->fd=AT_FDCWD;
+sqe->addr=(uint64_t)(uintptr_t)filename;
+sqe->len=STATX_SIZE;
+sqe->off=(uint64_t)(uintptr_t)&stx;
+sqe->user_data=1;
+if (submit(u,2)) GOTOERROR;
+
+while (count<2) {
+	uint64_t userdata;
+	int res;
+	if (!getcqe(&userdata,&res,u)) {
+		if (submit(u,1)) GOTOERROR;
+		continue;
+	}
+	count++;
+	if (res<0) iserror=1;
+	else if (!userdata) fd=res;
+}
+if (iserror) GOTOERROR;
+*fd_out=fd;
+*size_out=stx.stx_size;
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
@@ -0,0 +1,20 @@
+struct uring {
+	int fd;
+	unsigned int entries;
+	void *sqring,*cqring;
+	unsigned int sqringsize,cqringsize;
+	struct io_uring_sqe *sqes;
+	unsigned int sqessize;
+	unsigned int *sq_head,*sq_tail,*sq_mask,*sq_array;
+	unsigned int *cq_head,*cq_tail,*cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int tosubmit;
+};
+H_CLEARFUNC(uring);
+
+int init_uring(struct uring *u, unsigned int entries);
+void deinit_uring(struct uring *u);
+struct readahead;
+int stream_uring(int *istimeout_errorout, struct uring *u, int fd_out, int fd_in, uint64_t offset, uint64_t len,
+		unsigned char *buff, unsigned int bufflen, unsigned int stallseconds, struct readahead *ra);
+int openstat_uring(int *fd_out, uint64_t *size_out, struct uring *u, char *filename);
@@ -0,0 +1,493 @@
+/*
+ * watch.c - follow changes under directory arguments with inotify
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/inotify.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "common/blockmem.h"
+#include "shared.h"
+#include "files.h"
+#include "scan.h"
+#include "containers.h"
+#include "search.h"
+#include "sort.h"
+#include "metaindex.h"
+#include "httpd.h"
+
+#include "watch.h"
+
+/*
+ * Events only mark directories; nothing is rescanned until it's been quiet for QUIET_SECONDS_WATCH,
+ * so copying an album in costs one update. An update rescans the marked directories one level
+ * deep (new directories in full), then rebuilds containers, search and sort into a fresh
+ * shared->derived and bumps SystemUpdateID.
+ *
+ * Files keep their ObjectIDs: a removed file is only marked, it stays in shared->files and
+ * live.ids lists the rest. New files are appended.
+ */
+
+#define SIZE_EVENTS_WATCH	(64*1024)
+
+struct table {
+	unsigned int *slots; // idx+1, 0 => empty
+	unsigned int mask,count;
+};
+
+static uint32_t hashpath(char *path) {
+uint32_t h=2166136261u;
+for (;*path;path++) {
+	h^=(unsigned char)*path;
+	h*=16777619u;
+}
+return h;
+}
+
+static int init_table(struct table *table, unsigned int count) {
+unsigned int size=1024;
+while (size<count*2) size*=2;
+if (!(table->slots=calloc(size,sizeof(unsigned int)))) GOTOERROR;
+table->mask=size-1;
+table->count=0;
+return 0;
+error:
+	return -1;
+}
+
+static unsigned int *findslot(struct table *table, struct shared *shared, char *path) {
+unsigned int i;
+i=hashpath(path)&table->mask;
+while (table->slots[i]) {
+	if (!strcmp(shared->files[table->slots[i]-1]->filename,path)) break;
+	i=(i+1)&table->mask;
+}
+return table->slots+i;
+}
+
+static int add_table(struct table *table, struct shared *shared, unsigned int idx) {
+unsigned int *slot;
+if ((table->count+1)*2>table->mask+1) {
+	struct table bigger;
+	unsigned int ui;
+	if (init_table(&bigger,table->count+1)) GOTOERROR;
+	for (ui=0;ui<=table->mask;ui++) {
+		if (table->slots[ui]) *findslot(&bigger,shared,shared->files[table->slots[ui]-1]->filename)=table->slots[ui];
+	}
+	bigger.count=table->count;
+	free(table->slots);
+	*table=bigger;
+}
+slot=findslot(table,shared,shared->files[idx]->filename);
+if (!*slot) table->count+=1;
+*slot=idx+1;
+return 0;
+error:
+	return -1;
+}
+
+static unsigned int dirlength(char *path) {
+// ignores a trailing "/", like scan.c does when it joins
+unsigned int len;
+len=strlen(path);
+if (len && (path[len-1]=='/')) len-=1;
+return len;
+}
+
+static int isunder(char *filename, char *dir, unsigned int dirlen, int isdirect) {
+// isdirect => filename is in dir itself, not a subdirectory
+if (strncmp(filename,dir,dirlen) || (filename[dirlen]!='/')) return 0;
+if (isdirect && strchr(filename+dirlen+1,'/')) return 0;
+return 1;
+}
+
+int init_watch(struct shared *shared) {
+int fd;
+if (0>(fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC))) {
+	log_shared(shared,0,"%s:%d warning: couldn't start inotify, --watch is disabled\n",__FILE__,__LINE__);
+	return 0;
+}
+shared->watch.fd=fd;
+return 0;
+}
+
+void deinit_watch(struct shared *shared) {
+unsigned int ui;
+if (shared->watch.dirs) {
+	for (ui=0;ui<shared->watch.dirmax;ui++) iffree(shared->watch.dirs[ui].path);
+	free(shared->watch.dirs);
+	shared->watch.dirs=NULL;
+}
+if (shared->watch.pending) {
+	for (ui=0;ui<shared->watch.pendingcount;ui++) iffree(shared->watch.pending[ui].path);
+	free(shared->watch.pending);
+	shared->watch.pending=NULL;
+}
+}
+
+int setdir_watch(struct shared *shared, int wd, char *path) {
+// scan.c calls this for each directory it read, the same wd means the same directory
+struct dir_watch *dir;
+if (wd<0) return 0;
+if (wd>=shared->watch.dirmax) {
+	unsigned int max=shared->watch.dirmax?shared->watch.dirmax:256;
+	while (max<=wd) max*=2;
+	if (!(dir=realloc(shared->watch.dirs,max*sizeof(struct dir_watch)))) GOTOERROR;
+	memset(dir+shared->watch.dirmax,0,(max-shared->watch.dirmax)*sizeof(struct dir_watch));
+	shared->watch.dirs=dir;
+	shared->watch.dirmax=max;
+}
+dir=shared->watch.dirs+wd;
+if (dir->path) {
+	if (!strcmp(dir->path,path)) return 0;
+	free(dir->path); // moved, or a symlink to the same directory
+}
+if (!(dir->path=strdup(path))) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int addpending(struct shared *shared, char *dirpath, char *name, int isgone) {
+struct pending_watch *p;
+unsigned int dirlen,namelen;
+char *path;
+
+if (shared->watch.pendingcount==shared->watch.pendingmax) {
+	unsigned int max=shared->watch.pendingmax?shared->watch.pendingmax*2:16;
+	if (!(p=realloc(shared->watch.pending,max*sizeof(struct pending_watch)))) GOTOERROR;
+	shared->watch.pending=p;
+	shared->watch.pendingmax=max;
+}
+dirlen=dirlength(dirpath);
+namelen=strlen(name);
+if (!(path=malloc(dirlen+namelen+2))) GOTOERROR;
+memcpy(path,dirpath,dirlen);
+path[dirlen]='/';
+memcpy(path+dirlen+1,name,namelen+1);
+p=shared->watch.pending+shared->watch.pendingcount;
+p->path=path;
+p->isgone=isgone;
+shared->watch.pendingcount+=1;
+return 0;
+error:
+	return -1;
+}
+
+static void markall(struct shared *shared) {
+unsigned int ui;
+for (ui=0;ui<shared->watch.dirmax;ui++) {
+	if (shared->watch.dirs[ui].path) shared->watch.dirs[ui].isdirty=1;
+}
+}
+
+static int event_watch(struct shared *shared, struct inotify_event *ev) {
+// returns 1 if something changed
+struct dir_watch *dir;
+
+if (ev->mask&IN_Q_OVERFLOW) {
+	log_shared(shared,0,"%s:%d warning: inotify queue overflowed, rescanning everything\n",__FILE__,__LINE__);
+	(void)markall(shared);
+	return 1;
+}
+if ((ev->wd<0)||(ev->wd>=shared->watch.dirmax)) return 0;
+dir=shared->watch.dirs+ev->wd;
+if (ev->mask&IN_IGNORED) { // the watch is gone, the parent's event says why
+	iffree(dir->path);
+	dir->path=NULL;
+	dir->isdirty=0;
+	return 0;
+}
+if (!dir->path || !ev->len || (ev->name[0]=='.')) return 0;
+if (ev->mask&IN_ISDIR) {
+	if (ev->mask&(IN_CREATE|IN_MOVED_TO)) {
+		if (addpending(shared,dir->path,ev->name,0)) return -1;
+		return 1;
+	}
+	if (ev->mask&(IN_DELETE|IN_MOVED_FROM)) {
+		if (addpending(shared,dir->path,ev->name,1)) return -1;
+		return 1;
+	}
+	return 0;
+}
+if (!gettype_files(ev->name,strlen(ev->name))) return 0;
+dir->isdirty=1;
+return 1;
+}
+
+int read_watch(struct shared *shared) {
+// drains the inotify fd, the main loop calls this when it's readable
+char buff[SIZE_EVENTS_WATCH] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+while (1) {
+	ssize_t k;
+	char *cursor;
+
+	k=read(shared->watch.fd,buff,SIZE_EVENTS_WATCH);
+	if (k<0) {
+		if (errno==EINTR) continue;
+		if (errno==EAGAIN) break;
+		GOTOERROR;
+	}
+	if (!k) break;
+	for (cursor=buff;cursor<buff+k;) {
+		struct inotify_event *ev=(struct inotify_event *)cursor;
+		int r;
+		cursor+=sizeof(struct inotify_event)+ev->len;
+		r=event_watch(shared,ev);
+		if (r<0) GOTOERROR;
+		if (r) {
+			shared->watch.isdirty=1;
+			shared->watch.lastevent=time(NULL);
+		}
+	}
+}
+return 0;
+error:
+	return -1;
+}
+
+int isready_watch(struct shared *shared, time_t now) {
+return shared->watch.isdirty && (shared->watch.lastevent+QUIET_SECONDS_WATCH<=now);
+}
+
+static int addfile(struct shared *shared, struct table *table, struct found_scan *f, unsigned int updateid) {
+struct file_shared *file;
+
+if (shared->max_files==shared->watch.filesmax) {
+	struct file_shared **files;
+	unsigned int max=shared->watch.filesmax*2+64;
+	if (!(files=ALLOC2_blockmem(&shared->blockmem,struct file_shared *,max))) GOTOERROR;
+	memcpy(files,shared->files,shared->max_files*sizeof(struct file_shared *));
+	shared->files=files; // the old array stays in blockmem
+	shared->watch.filesmax=max;
+}
+if (!(file=CALLOC_blockmem(&shared->blockmem,struct file_shared))) GOTOERROR;
+if (!(file->filename=align64_strdup_blockmem(&shared->blockmem,f->path))) GOTOERROR;
+file->type=f->type;
+file->size=f->size;
+file->mtime=f->mtime;
+file->updateid=updateid;
+if (refresh_files(shared,file)) GOTOERROR;
+shared->files[shared->max_files]=file;
+shared->max_files+=1;
+if (add_table(table,shared,shared->max_files-1)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+static int mergefound(unsigned int *changes_inout, struct shared *shared, struct table *table, struct found_scan *found,
+		unsigned int count, unsigned int updateid) {
+// adds new files and rereads the ones that changed
+unsigned int ui,changes=*changes_inout;
+
+for (ui=0;ui<count;ui++) {
+	struct found_scan *f=found+ui;
+	struct file_shared *file;
+	unsigned int idx;
+
+	idx=*findslot(table,shared,f->path);
+	if (!idx) {
+		if (addfile(shared,table,f,updateid)) GOTOERROR;
+		changes+=1;
+		continue;
+	}
+	file=shared->files[idx-1];
+	if (!file->isremoved && (file->size==f->size) && (file->mtime==f->mtime) && (file->type==f->type)) continue;
+	file->isremoved=0;
+	file->type=f->type;
+	file->size=f->size;
+	file->mtime=f->mtime;
+	file->updateid=updateid;
+	if (refresh_files(shared,file)) GOTOERROR;
+	changes+=1;
+}
+*changes_inout=changes;
+return 0;
+error:
+	return -1;
+}
+
+static void removefile(struct file_shared *file, unsigned int updateid) {
+file->isremoved=1;
+file->updateid=updateid;
+file->didl=NULL;
+}
+
+static unsigned int removegone(struct shared *shared, char *path, unsigned int updateid) {
+// a directory was removed or moved away, returns how many files went with it
+unsigned int ui,dirlen,changes=0;
+
+dirlen=dirlength(path);
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	if (file->isremoved || !isunder(file->filename,path,dirlen,0)) continue;
+	(void)removefile(file,updateid);
+	changes+=1;
+}
+for (ui=0;ui<shared->watch.dirmax;ui++) { // the directory and everything under it
+	struct dir_watch *dir=shared->watch.dirs+ui;
+	if (!dir->path || strncmp(dir->path,path,dirlen)) continue;
+	if (dir->path[dirlen] && (dir->path[dirlen]!='/')) continue;
+	(ignore)inotify_rm_watch(shared->watch.fd,ui);
+	free(dir->path);
+	dir->path=NULL;
+	dir->isdirty=0;
+}
+return changes;
+}
+
+static int cmp_found(const void *a, const void *b) {
+return strcmp(((struct found_scan *)a)->path,((struct found_scan *)b)->path);
+}
+
+static unsigned int removemissing(struct shared *shared, char *path, struct found_scan *found, unsigned int count,
+		unsigned int updateid) {
+// files directly in path that the rescan didn't find, found is sorted by path
+unsigned int ui,dirlen,changes=0;
+
+dirlen=dirlength(path);
+for (ui=0;ui<shared->max_files;ui++) {
+	struct file_shared *file=shared->files[ui];
+	struct found_scan key;
+	if (file->isremoved || !isunder(file->filename,path,dirlen,1)) continue;
+	key.path=file->filename;
+	if (bsearch(&key,found,count,sizeof(struct found_scan),cmp_found)) continue;
+	(void)removefile(file,updateid);
+	changes+=1;
+}
+return changes;
+}
+
+static int setlive(struct shared *shared) {
+unsigned int ui,count=0;
+unsigned int *ids;
+
+for (ui=0;ui<shared->max_files;ui++) {
+	if (!shared->files[ui]->isremoved) count+=1;
+}
+if (count==shared->max_files) {
+	iffree(shared->live.ids);
+	shared->live.ids=NULL;
+	shared->live.count=count;
+	return 0;
+}
+if (!(ids=malloc((count+1)*sizeof(unsigned int)))) GOTOERROR;
+count=0;
+for (ui=0;ui<shared->max_files;ui++) {
+	if (!shared->files[ui]->isremoved) ids[count++]=ui+1;
+}
+iffree(shared->live.ids);
+shared->live.ids=ids;
+shared->live.count=count;
+return 0;
+error:
+	return -1;
+}
+
+static int rebuild(struct shared *shared, unsigned int updateid) {
+// the old derived blockmem is freed only after everything points into the new one
+struct blockmem *old=shared->derived,*fresh;
+
+if (!(fresh=new_blockmem(0))) GOTOERROR;
+shared->derived=fresh;
+shared->updateid=updateid;
+if (setlive(shared)) GOTOERROR;
+if (shared->options.iscontainers) {
+	if (init_containers(shared)) GOTOERROR;
+}
+if (init_search(shared)) GOTOERROR;
+if (init_sort(shared)) GOTOERROR;
+if (render_httpd(shared)) GOTOERROR;
+deinit_blockmem(old);
+free(old);
+if (shared->options.indexfile) {
+	if (save_metaindex(shared)) {
+		log_shared(shared,0,"%s:%d warning: couldn't save index \"%s\"\n",__FILE__,__LINE__,shared->options.indexfile);
+	}
+}
+if (restartworkers_httpd(shared)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
+
+int update_watch(struct shared *shared) {
+// rescans what changed since the last update, only the parent calls this
+struct blockmem temp;
+struct table table;
+struct found_scan *found=NULL;
+unsigned int ui,count,changes=0,updateid;
+
+clear_blockmem(&temp);
+table.slots=NULL;
+shared->watch.isdirty=0;
+updateid=shared->updateid+1;
+if (init_blockmem(&temp,0)) GOTOERROR;
+if (init_table(&table,shared->max_files)) GOTOERROR;
+for (ui=0;ui<shared->max_files;ui++) {
+	if (add_table(&table,shared,ui)) GOTOERROR;
+}
+
+for (ui=0;ui<shared->watch.pendingcount;ui++) {
+	struct pending_watch *p=shared->watch.pending+ui;
+	if (p->isgone) {
+		changes+=removegone(shared,p->path,updateid);
+	} else {
+		if (find_scan(&found,&count,shared,&temp,p->path,1)) GOTOERROR;
+		if (mergefound(&changes,shared,&table,found,count,updateid)) GOTOERROR;
+		free(found);
+		found=NULL;
+	}
+	free(p->path);
+	p->path=NULL;
+}
+shared->watch.pendingcount=0;
+
+for (ui=0;ui<shared->watch.dirmax;ui++) {
+	struct dir_watch *dir=shared->watch.dirs+ui;
+	char *path;
+	if (!dir->isdirty) continue;
+	dir->isdirty=0;
+	path=dir->path;
+	if (find_scan(&found,&count,shared,&temp,path,0)) GOTOERROR;
+	if (mergefound(&changes,shared,&table,found,count,updateid)) GOTOERROR;
+	changes+=removemissing(shared,path,found,count,updateid);
+	free(found);
+	found=NULL;
+}
+
+if (changes) {
+	log_shared(shared,1,"%s:%d %u files changed, SystemUpdateID is %u\n",__FILE__,__LINE__,changes,updateid);
+	if (rebuild(shared,updateid)) GOTOERROR;
+}
+free(table.slots);
+deinit_blockmem(&temp);
+return 0;
+error:
+	iffree(found);
+	iffree(table.slots);
+	deinit_blockmem(&temp);
+	return -1;
+}
@@ -0,0 +1,19 @@
+#define MASK_WATCH	(IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB|IN_ONLYDIR)
+#define QUIET_SECONDS_WATCH	2
+
+struct dir_watch {
+	char *path; // malloc'd, NULL => not watched
+	int isdirty; // => a file in it changed, rescan it
+};
+
+struct pending_watch {
+	char *path; // malloc'd
+	int isgone; // => the directory was removed or moved away, otherwise it's new
+};
+
+int init_watch(struct shared *shared);
+void deinit_watch(struct shared *shared);
+int setdir_watch(struct shared *shared, int wd, char *path);
+int read_watch(struct shared *shared);
+int isready_watch(struct shared *shared, time_t now);
+int update_watch(struct shared *shared);
@@ -0,0 +1,274 @@
+/*
+ * wavheader.c - read wav format, length and tags
+ * Copyright (C) 2024 Sanjay Rao
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+// #define DEBUG
+#include "common/conventions.h"
+#include "misc.h"
+
+#include "wavheader.h"
+
+/*
+ * The RIFF chunks are walked with pread(), in whatever order they come, and the data chunk is
+ * skipped by offset. RF64 files get their sizes from the ds64 chunk. A data chunk with a size of
+ * 0 or 0xffffffff, as left by a recorder that didn't finish, or one that runs past the end of the
+ * file, is taken to run to the end. Some writers don't pad odd sized chunks, so an unpadded
+ * chunk is tried when the padded one doesn't look like a chunk.
+ */
+
+#define MAX_CHUNKS_WAVHEADER	1024
+#define SIZE_FMT_WAVHEADER	40
+#define SIZE_INFO_WAVHEADER	(1024*4)
+#define EXTENSIBLE_FORMAT_WAVHEADER	0xfffe
+
+static unsigned int le16(unsigned char *c) {
+return c[0]|(c[1]<<8);
+}
+
+static unsigned int le32(unsigned char *c) {
+return (c[3]<<24)|(c[2]<<16)|(c[1]<<8)|c[0];
+}
+
+static uint64_t le64(unsigned char *c) {
+return ((uint64_t)le32(c+4)<<32)|le32(c);
+}
+
+static int preadall(int fd, unsigned char *dest, unsigned int len, uint64_t offset, unsigned int *got_out) {
+// *got_out is short only at the end of the file
+unsigned int got=0;
+while (got<len) {
+	ssize_t k;
+	k=pread(fd,dest+got,len-got,offset+got);
+	if (k<0) GOTOERROR;
+	if (!k) break;
+	got+=k;
+}
+*got_out=got;
+return 0;
+error:
+	return -1;
+}
+
+static int isfourcc(unsigned char *c) {
+int i;
+for (i=0;i<4;i++) if ((c[i]<' ') || (c[i]>'~')) return 0;
+return 1;
+}
+
+static int isutf8(unsigned char *data, unsigned int len) {
+unsigned int ui=0;
+while (ui<len) {
+	unsigned int n;
+	if (data[ui]<0x80) { ui++; continue; }
+	if ((data[ui]&0xe0)==0xc0) n=1;
+	else if ((data[ui]&0xf0)==0xe0) n=2;
+	else if ((data[ui]&0xf8)==0xf0) n=3;
+	else return 0;
+	if (ui+n>=len) return 0;
+	for (ui++;n;n--,ui++) if ((data[ui]&0xc0)!=0x80) return 0;
+}
+return 1;
+}
+
+static void copyinfo(char *dest, unsigned char *data, unsigned int len) {
+// INFO strings have no declared encoding, UTF-8 if it parses, otherwise ISO-8859-1
+unsigned int ui,n=0;
+
+for (ui=0;(ui<len) && data[ui];ui++);
+len=ui;
+while (len && (data[len-1]==' ')) len--;
+if (isutf8(data,len)) {
+	if (len>MAXSTR_WAVHEADER) { // don't leave half a character
+		len=MAXSTR_WAVHEADER;
+		while (len && ((data[len]&0xc0)==0x80)) len--;
+	}
+	memcpy(dest,data,len);
+	n=len;
+} else {
+	for (ui=0;ui<len;ui++) {
+		if (data[ui]<0x80) {
+			if (n+1>MAXSTR_WAVHEADER) break;
+			dest[n++]=data[ui];
+		} else {
+			if (n+2>MAXSTR_WAVHEADER) break;
+			dest[n++]=0xc0|(data[ui]>>6);
+			dest[n++]=0x80|(data[ui]&0x3f);
+		}
+	}
+}
+dest[n]='\0';
+}
+
+static int parseinfo(struct wavheader *dest, int fd, uint64_t offset, uint64_t size) {
+// offset and size are of the LIST payload, after "INFO"
+unsigned char buffer[SIZE_INFO_WAVHEADER];
+unsigned int len,ui;
+
+if (size>SIZE_INFO_WAVHEADER) size=SIZE_INFO_WAVHEADER;
+if (preadall(fd,buffer,size,offset,&len)) GOTOERROR;
+ui=0;
+while (ui+8<=len) {
+	unsigned char *id=buffer+ui;
+	unsigned int k;
+	k=le32(buffer+ui+4);
+	ui+=8;
+	if (k>len-ui) k=len-ui;
+	if (!memcmp(id,"INAM",4)) copyinfo(dest->title,buffer+ui,k);
+	else if (!memcmp(id,"IART",4)) copyinfo(dest->artist,buffer+ui,k);
+	else if (!memcmp(id,"IPRD",4)) copyinfo(dest->album,buffer+ui,k);
+	else if (!memcmp(id,"ICRD",4)) copyinfo(dest->date,buffer+ui,k);
+	else if (!memcmp(id,"IGNR",4)) copyinfo(dest->genre,buffer+ui,k);
+	else if (!memcmp(id,"ITRK",4) || !memcmp(id,"IPRT",4)) {
+		char number[12];
+		if (k>=sizeof(number)) k=sizeof(number)-1;
+		memcpy(number,buffer+ui,k);
+		number[k]='\0';
+		dest->tracknumber=strtoul(number,NULL,10);
+	}
+	ui+=k+(k&1);
+}
+return 0;
+error:
+	return -1;
+}
+
+static int parsefmt(struct wavheader *dest, unsigned int *containerbits_out, int fd, uint64_t offset, uint64_t size) {
+// 0 => too short to use
+unsigned char buffer[SIZE_FMT_WAVHEADER];
+unsigned int len;
+
+if (size>SIZE_FMT_WAVHEADER) size=SIZE_FMT_WAVHEADER;
+if (preadall(fd,buffer,size,offset,&len)) GOTOERROR;
+if (len<16) return 0;
+dest->format=le16(buffer);
+dest->channels=le16(buffer+2);
+dest->samplerate=le32(buffer+4);
+dest->byterate=le32(buffer+8);
+dest->blockalign=le16(buffer+12);
+dest->bitspersample=le16(buffer+14);
+*containerbits_out=dest->bitspersample;
+if ((dest->format==EXTENSIBLE_FORMAT_WAVHEADER) && (len>=40)) {
+	unsigned int validbits;
+	validbits=le16(buffer+18);
+	if (validbits && (validbits<dest->bitspersample)) dest->bitspersample=validbits;
+	dest->format=le16(buffer+24); // the start of the SubFormat GUID
+}
+return 1;
+error:
+	return -1;
+}
+
+static int readheaderfromfile(struct wavheader *dest, char *filename) {
+unsigned char header[12];
+struct stat statbuf;
+uint64_t offset,filesize,ds64data=0;
+unsigned int got,count,containerbits=0;
+int fd=-1,isrf64=0,isfmt=0,isdata=0,ispadded=0;
+
+fd=open(filename,O_RDONLY|O_CLOEXEC);
+if (fd<0) GOTOERROR;
+if (fstat(fd,&statbuf)) GOTOERROR;
+filesize=statbuf.st_size;
+if (preadall(fd,header,12,0,&got)) GOTOERROR;
+if (got<12) goto error;
+if (!memcmp(header,"RF64",4)) isrf64=1;
+else if (memcmp(header,"RIFF",4)) goto error;
+if (memcmp(header+8,"WAVE",4)) goto error;
+
+// the RIFF size isn't trusted, plenty of files have trailing chunks or a stale size
+offset=12;
+for (count=0;(count<MAX_CHUNKS_WAVHEADER) && (offset+8<=filesize);count++) {
+	uint64_t size;
+	if (preadall(fd,header,8,offset,&got)) GOTOERROR;
+	if (got<8) break;
+	if (!isfourcc(header)) {
+		if (!ispadded) break;
+		offset-=1;
+		if (preadall(fd,header,8,offset,&got)) GOTOERROR;
+		if ((got<8) || !isfourcc(header)) break;
+	}
+	size=le32(header+4);
+	if (!memcmp(header,"ds64",4)) {
+		unsigned char ds64[24];
+		if (preadall(fd,ds64,24,offset+8,&got)) GOTOERROR;
+		if (got==24) ds64data=le64(ds64+8);
+	} else if (!memcmp(header,"fmt ",4)) {
+		if (!isfmt) {
+			int r;
+			r=parsefmt(dest,&containerbits,fd,offset+8,size);
+			if (r<0) GOTOERROR;
+			isfmt=r;
+		}
+	} else if (!memcmp(header,"data",4)) {
+		if (isrf64 && (size==0xffffffff)) size=ds64data;
+		if ((!size) || (size==0xffffffff) || (size>filesize-(offset+8))) size=filesize-(offset+8);
+		if (!isdata) {
+			isdata=1;
+			dest->dataoffset=offset+8;
+			dest->datasize=size;
+		}
+	} else if (!memcmp(header,"LIST",4)) {
+		unsigned char type[4];
+		if ((size>=4) && !preadall(fd,type,4,offset+8,&got) && (got==4) && !memcmp(type,"INFO",4)) {
+			if (parseinfo(dest,fd,offset+12,size-4)) GOTOERROR;
+		}
+	}
+	ispadded=size&1;
+	offset+=8+size+ispadded;
+}
+if (!isfmt || !isdata) goto error;
+if (!dest->samplerate || !dest->channels) goto error;
+if (!dest->blockalign) dest->blockalign=dest->channels*((containerbits+7)/8);
+
+switch (dest->format) {
+	case 1: // PCM
+	case 3: // IEEE float
+	case 6: // A-law
+	case 7: // mu-law
+		if (!dest->blockalign) break;
+		dest->frames=dest->datasize/dest->blockalign;
+		dest->duration=(unsigned int)(dest->frames/dest->samplerate);
+		dest->bitrate=dest->samplerate*dest->blockalign*8;
+		break;
+	default: // compressed, only the average rate is known
+		if (!dest->byterate) break;
+		dest->duration=(unsigned int)(dest->datasize/dest->byterate);
+		dest->bitrate=dest->byterate*8;
+		break;
+}
+
+close(fd);
+return 0;
+error:
+	ifclose(fd);
+	return -1;
+}
+
+int read_wavheader(struct wavheader *dest, char *filename) {
+memset(dest,0,sizeof(struct wavheader));
+if (readheaderfromfile(dest,filename)) GOTOERROR;
+return 0;
+error:
+	return -1;
+}
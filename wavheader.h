@@ -0,0 +1,25 @@
+#define MAXSTR_WAVHEADER	256
+
+struct wavheader {
+	char title[MAXSTR_WAVHEADER+1]; // UTF-8, from a LIST INFO chunk
+	char artist[MAXSTR_WAVHEADER+1];
+	char album[MAXSTR_WAVHEADER+1];
+	char date[MAXSTR_WAVHEADER+1];
+	char genre[MAXSTR_WAVHEADER+1];
+	unsigned int tracknumber;
+
+	unsigned int format; // 1 => PCM, 3 => float, the SubFormat for WAVE_FORMAT_EXTENSIBLE
+	unsigned int samplerate;
+	unsigned int channels;
+	unsigned int bitspersample; // valid bits, can be less than the container
+	unsigned int blockalign; // bytes per sample frame
+	unsigned int byterate;
+	uint64_t frames; // sample frames, 0 => dunno (compressed)
+	uint64_t dataoffset; // first byte of the data chunk's payload
+	uint64_t datasize; // clipped to the file
+
+	unsigned int duration; // in seconds
+	unsigned int bitrate; // bits per second
+};
+
+int read_wavheader(struct wavheader *dest, char *filename);